@@ -3,97 +3,234 @@
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
+#include <sys/mman.h>
+#include "nnSimd.h"
+#include "nnModel.h"
+#include "nnCheckpoint.h"
+#include "nnInference.h"
+#include "nnOptimizer.h"
+#include "nnSchedule.h"
+#include "nnProfile.h"
+
+// The work of a layer's matrix product over rows samples, for the profile
+#define LAYER_FLOPS(layer, rows) (2.0 * (rows) * (layer)->weights.row * (layer)->weights.col)
+#define LAYER_BYTES(layer, rows)                                                           \
+    ((double)(layer)->weights.row * (layer)->weights.col * ((layer)->half_weights.arr != NULL ? 2 : 4) + \
+     4.0 * (rows) * ((layer)->weights.row + (layer)->weights.col))
+
+
+// Draws the weights of a layer between [-1, 1) and its biases
+static void randomize_layer(layer_t *layer)
+{
+    for (int i = 0; i < layer->weights.row; i++)
+    {
+        for (int j = 0; j < layer->weights.col; j++)
+        {
+            //random vals between [0,1)
+            layer->weights.arr[j + i * layer->weights.col] = (float)((float)rand() / (RAND_MAX / 2)) - 1;
+        }
+    }
 
+    //allocating random floats to bias
+    for (int i = 0; i < layer->biases.len; i++)
+    {   
+        //random biases from [0, 1)
+        layer->biases.arr[i] = (float)(rand() / (RAND_MAX / 2)) - 1;
+    }
+}
 
-neural_net_t allocate_neural_net(int layers, int* layer_sizes)
+neural_net_t allocate_neural_net(int layers, int* layer_sizes, sigmoid_mode_t sigmoid_mode)
 {
     neural_net_t new_net;
     new_net.num_layers = layers;
-
-    new_net.layers = (layer_t *)malloc(sizeof(layer_t) * layers);
-
+    new_net.sigmoid_mode = sigmoid_mode;
+    new_net.precision = PRECISION_F32;
+    new_net.optimizer = NULL;
+    new_net.loss = LOSS_QUADRATIC;
+    new_net.map = NULL;
+    new_net.map_len = 0;
+
+    new_net.layers = (layer_t *)allocate_bytes(sizeof(layer_t) * layers);
     for (int i = 0; i < new_net.num_layers; i++)
     {
-        if(i == 0)
-            new_net.layers[i] = init_layer(layer_sizes[i], 1);
-        else
-            new_net.layers[i] = init_layer(layer_sizes[i], layer_sizes[i - 1]);
+        new_net.layers[i].length = layer_sizes[i];
+        new_net.layers[i].activation = ACTIVATION_SIGMOID;
+        new_net.layers[i].half_weights.arr = NULL;
+    }
+
+    layout_params(new_net.layers, layers);
+    attach_slabs(&new_net, NULL);
+    for (int i = 1; i < new_net.num_layers; i++)
+    {
+        randomize_layer(&new_net.layers[i]);
     }
 
+    new_net.workspace.num_workers = 0;
+    reserve_workspace(&new_net, 1, 1);
+
     return new_net;
 }
 
-void free_network(neural_net_t *network)
+size_t layout_params(layer_t *layers, int num_layers)
 {
-    for(int i = 0; i < network->num_layers; i++)
+    // The input layer has no parameters
+    layers[0].weights = (matrix_t){NULL, layers[0].length, 0};
+    layers[0].biases = (vector_t){NULL, 0};
+    layers[0].weights_offset = 0;
+    layers[0].biases_offset = 0;
+
+    size_t len = 0;
+    for (int i = 1; i < num_layers; i++)
     {
-        free_layer(&network->layers[i]);
+        layer_t *layer = &layers[i];
+        layer->weights.row = layer->length;
+        layer->weights.col = layers[i - 1].length;
+        layer->biases.len = layer->length;
+
+        layer->weights_offset = len;
+        len += arena_len((size_t)layer->weights.row * layer->weights.col);
+        layer->biases_offset = len;
+        len += arena_len(layer->biases.len);
     }
-    free(network->layers);
+    return len;
 }
 
-void free_layer(layer_t* layer)
+void attach_slabs(neural_net_t *network, float *params)
 {
-    free_matrix(&layer->weights);
-    free_vector(&layer->biases);
-    free_vector(&layer->weighted_outputs);
-    free_vector(&layer->activated_outputs);
-    free_vector(&layer->error);
+    layer_t *last = &network->layers[network->num_layers - 1];
+    size_t len = last->biases_offset + arena_len(last->biases.len);
+    network->params = params != NULL ? (arena_t){params, len, 0} : init_arena(len);
+    // Every block is taken
+    network->params.used = len;
+
+    size_t activations = 0;
+    for (int i = 0; i < network->num_layers; i++)
+    {
+        activations += 2 * arena_len(network->layers[i].length);
+    }
+    network->activations = init_arena(activations);
+
+    for (int i = 0; i < network->num_layers; i++)
+    {
+        layer_t *layer = &network->layers[i];
+        if (i > 0)
+        {
+            layer->weights.arr = &network->params.arr[layer->weights_offset];
+            layer->biases.arr = &network->params.arr[layer->biases_offset];
+        }
+        layer->activated_outputs = arena_vector(&network->activations, layer->length);
+        layer->error = arena_vector(&network->activations, layer->length);
+    }
 }
 
-layer_t init_layer(int length, int previous_layer_length)
+// Whether p points into the model file the network was loaded from
+static int in_map(neural_net_t *network, const void *p)
 {
-    layer_t out;
-    out.length = length;
-
-    //defining the rows and columns of random-weight matrix
-    out.weights = init_matrix(length, previous_layer_length);
+    const char *map = (const char *)network->map;
+    return map != NULL && (const char *)p >= map && (const char *)p < map + network->map_len;
+}
 
-    for (int i = 0; i < out.weights.row; i++)
+void free_network(neural_net_t *network)
+{
+    for(int i = 0; i < network->num_layers; i++)
     {
-        for (int j = 0; j < out.weights.col; j++)
-        {
-            //random vals between [0,1)
-            out.weights.arr[j + i * out.weights.col] = (float)((float)rand() / (RAND_MAX / 2)) - 1;
-        }
+        // A half copy mapped from the model file goes with the mapping
+        layer_t *layer = &network->layers[i];
+        if (!in_map(network, layer->half_weights.arr))
+            free_half_matrix(&layer->half_weights);
     }
+    // And so do mapped parameters
+    if (!in_map(network, network->params.arr))
+        free_arena(&network->params);
+    free_arena(&network->activations);
+    free(network->layers);
+    free_workspace(network);
 
-    //init the size of vector
-    out.biases = init_vector(length);
-    
-    //allocating random floats to bias
-    for (int i = 0; i < out.biases.len; i++)
-    {   
-        //random biases from [0, 1)
-        out.biases.arr[i] = (float)(rand() / (RAND_MAX / 2)) - 1;
+    if (network->map != NULL)
+        munmap(network->map, network->map_len);
+    network->map = NULL;
+}
+
+void init_activation(neural_net_t *network, int layer, activation_t activation)
+{
+    layer_t *current = &network->layers[layer];
+    current->activation = activation;
+
+    int fan_in = current->weights.col;
+    int fan_out = current->weights.row;
+    float limit = activation == ACTIVATION_RELU || activation == ACTIVATION_LEAKY_RELU
+                      ? sqrtf(6.0f / fan_in)
+                      : sqrtf(6.0f / (fan_in + fan_out));
+    for (int i = 0; i < fan_in * fan_out; i++)
+    {
+        current->weights.arr[i] = ((float)rand() / (RAND_MAX / 2) - 1) * limit;
     }
+    memset(current->biases.arr, 0, sizeof(float) * current->biases.len);
 
-    out.activated_outputs = init_vector(length);
-    out.weighted_outputs = init_vector(length);
+    if (current->half_weights.arr != NULL)
+        round_half_matrix(&current->half_weights, &current->weights);
+}
 
-    out.error = init_vector(length);
+void set_precision(neural_net_t *network, precision_t precision)
+{
+    for (int i = 1; i < network->num_layers; i++)
+    {
+        layer_t *layer = &network->layers[i];
+        if (layer->half_weights.arr != NULL && layer->half_weights.precision == precision)
+            continue;
+
+        // A copy mapped from a half model file goes with the mapping
+        if (!in_map(network, layer->half_weights.arr))
+            free_half_matrix(&layer->half_weights);
+        layer->half_weights.arr = NULL;
+        if (precision == PRECISION_F32)
+            continue;
+
+        layer->half_weights = init_half_matrix(layer->weights.row, layer->weights.col, precision);
+        round_half_matrix(&layer->half_weights, &layer->weights);
+    }
+    network->precision = precision;
+}
 
-    return out;
+void set_loss(neural_net_t *network, loss_t loss)
+{
+    if (loss == LOSS_CROSS_ENTROPY)
+        network->layers[network->num_layers - 1].activation = ACTIVATION_SOFTMAX;
+    network->loss = loss;
 }
 
-void feed_forward(layer_t *current_layer, layer_t *previous_layer)
+// The activation the training passes apply to layer, the logits are kept
+// for the cross-entropy
+static activation_t training_activation(neural_net_t *network, int layer)
 {
-    vector_t weight_inputs = init_vector(current_layer->weights.row);
+    if (network->loss == LOSS_CROSS_ENTROPY && layer == network->num_layers - 1)
+        return ACTIVATION_LINEAR;
+    return network->layers[layer].activation;
+}
 
+static void layer_forward(layer_t *current_layer, layer_t *previous_layer, activation_t activation,
+                          sigmoid_mode_t sigmoid_mode)
+{
     //example for second layer, [16x10][10x1]+[16x1]
-    multiply_mat_vec(&weight_inputs, &current_layer->weights, &previous_layer->activated_outputs);
-
-    add_vec(&current_layer->weighted_outputs, &weight_inputs, &current_layer->biases);
+    epilogue_t forward = {activation, sigmoid_mode, current_layer->biases.arr, NULL};
+    if (current_layer->half_weights.arr != NULL)
+        multiply_half_vec_epilogue(&current_layer->activated_outputs, &current_layer->half_weights, &previous_layer->activated_outputs, &forward);
+    else
+        multiply_mat_vec_epilogue(&current_layer->activated_outputs, &current_layer->weights, &previous_layer->activated_outputs, &forward);
+}
 
-    free_vector(&weight_inputs);
+void feed_forward(layer_t *current_layer, layer_t *previous_layer, sigmoid_mode_t sigmoid_mode)
+{
+    layer_forward(current_layer, previous_layer, current_layer->activation, sigmoid_mode);
 }
 
 void forward_pass(neural_net_t *network)
 {
     for (int i = 1; i < network->num_layers; i++)
     {
-        feed_forward(&network->layers[i], &network->layers[i - 1]);
-        sigmoid_vec(&network->layers[i].activated_outputs, &network->layers[i].weighted_outputs);
+        PROFILE_START(forward_start);
+        layer_forward(&network->layers[i], &network->layers[i - 1], training_activation(network, i), network->sigmoid_mode);
+        PROFILE_STOP(forward_start, PROFILE_FORWARD, i, LAYER_FLOPS(&network->layers[i], 1), LAYER_BYTES(&network->layers[i], 1));
     }
 }
 
@@ -102,43 +239,58 @@ float loss_function(vector_t *predict, vector_t *actual)
     float sum = 0;
     for (int i = 0; i < predict->len; i++)
     {
-        sum = fabs(predict->arr[i] - actual->arr[i]);
+        sum += fabsf(predict->arr[i] - actual->arr[i]);
     }
     return sum / predict->len;
 }
 
-void backward_pass(neural_net_t *network, vector_t *expected_outputs)
+// Sets the error of the output layer from its outputs and returns the
+// summed loss of the rows
+static float output_loss(neural_net_t *network, matrix_t *error, matrix_t *outputs, matrix_t *expected_outputs)
+{
+    if (network->loss == LOSS_CROSS_ENTROPY)
+        return cross_entropy_mat(error, outputs, expected_outputs, network->sigmoid_mode);
+
+    float loss = quadratic_loss_mat(outputs, expected_outputs);
+    output_error_mat(error, expected_outputs, outputs, network->layers[network->num_layers - 1].activation);
+    return loss;
+}
+
+float backward_pass(neural_net_t *network, vector_t *expected_outputs)
 {
+    float loss = 0;
     for (int i = network->num_layers - 1; i > 0; i--)
     {
+        layer_t *layer = &network->layers[i];
+        PROFILE_START(backward_start);
         if (i == network->num_layers - 1)
         {
-            vector_t cost_derivative = init_vector(network->layers[i].length);
-            subtract_vec(&cost_derivative, &network->layers[i].activated_outputs, expected_outputs);
-            vector_t sigmoid_derivative = init_vector(network->layers[i].length);
-            dsigmoid_vec(&sigmoid_derivative, &network->layers[i].weighted_outputs);
-
-            hadamard_product(&network->layers[i].error, &cost_derivative, &sigmoid_derivative);
-
-            free_vector(&cost_derivative);
-            free_vector(&sigmoid_derivative);
+            // The vectors as one row matrices
+            matrix_t error = {layer->error.arr, 1, layer->error.len};
+            matrix_t outputs = {layer->activated_outputs.arr, 1, layer->activated_outputs.len};
+            matrix_t expected = {expected_outputs->arr, 1, expected_outputs->len};
+            loss = output_loss(network, &error, &outputs, &expected);
+            PROFILE_STOP(backward_start, PROFILE_LOSS, i, 0, 12.0 * layer->length);
+            continue;
         }
-        else
-        {
-            matrix_t weights_transpose = init_matrix(network->layers[i + 1].weights.col, network->layers[i + 1].weights.row);
-            transpose(&weights_transpose, &network->layers[i + 1].weights);
-            vector_t error_product = init_vector(weights_transpose.row);
-            multiply_mat_vec(&error_product, &weights_transpose, &network->layers[i + 1].error);
 
-            vector_t sigmoid_derivative = init_vector(network->layers[i].length);
-            dsigmoid_vec(&sigmoid_derivative, &network->layers[i].weighted_outputs);
-
-            hadamard_product(&network->layers[i].error, &error_product, &sigmoid_derivative);
+        layer_t *next = &network->layers[i + 1];
+        epilogue_t backward = {layer->activation, network->sigmoid_mode, NULL, layer->activated_outputs.arr};
+        if (next->half_weights.arr != NULL)
+            multiply_halfT_vec_epilogue(&layer->error, &next->half_weights, &next->error, &backward);
+        else
+            multiply_matT_vec_epilogue(&layer->error, &next->weights, &next->error, &backward);
+        PROFILE_STOP(backward_start, PROFILE_BACKWARD, i, LAYER_FLOPS(next, 1), LAYER_BYTES(next, 1));
+    }
+    return loss;
+}
 
-            free_matrix(&weights_transpose);
-            free_vector(&error_product);
-            free_vector(&sigmoid_derivative);
-        }
+void clear_temp(neural_net_t *network, matrix_t *temp_weights, vector_t *temp_biases)
+{
+    for (int i = 1; i < network->num_layers; i++)
+    {
+        memset(temp_weights[i].arr, 0, temp_weights[i].row * temp_weights[i].col * sizeof(float));
+        memset(temp_biases[i].arr, 0, temp_biases[i].len * sizeof(float));
     }
 }
 
@@ -147,32 +299,25 @@ void train(neural_net_t *network, matrix_t *inputs, matrix_t *expected_outputs,
            matrix_t *test_inputs, matrix_t *test_expected_outputs, char* filename)
 {
     printf("\n");
-    matrix_t temp_weights[network->num_layers];
-    vector_t temp_biases[network->num_layers];
+    // The accumulators of the first worker are reused across batches and
+    // cleared after every update
+    matrix_t *temp_weights = network->workspace.workers[0].temp_weights;
+    vector_t *temp_biases = network->workspace.workers[0].temp_biases;
 
-    for (int i = 1; i < network->num_layers; i++)
-    {
-        temp_weights[i] = init_matrix(network->layers[i].weights.row, network->layers[i].weights.col);
-        temp_biases[i] = init_vector(network->layers[i].biases.len);
-    }
+    clear_temp(network, temp_weights, temp_biases);
 
     vector_t expected_outputs2;
-    expected_outputs2.arr = (float*)malloc(1);
+    expected_outputs2.len = network->layers[network->num_layers - 1].length;
     for (int i = 0; i < epochs; i++)
     {
         printf("Starting epoch %d\n", i + 1);
         for (int j = 0; j < inputs->row; j++)
         {
-            expected_outputs2.len = network->layers[network->num_layers - 1].length;
-            expected_outputs2.arr = (float*)realloc(expected_outputs2.arr, expected_outputs2.len*sizeof(float));
-            for (int k = 0; k < inputs->col; k++)
-            {
-                network->layers[0].activated_outputs.arr[k] = inputs->arr[j * inputs->col + k];
-            }
-            for (int r = 0; r < network->layers[network->num_layers - 1].length; r++)
-            {
-                expected_outputs2.arr[r] = expected_outputs->arr[j * expected_outputs->col + r];
-            }
+            PROFILE_START(copy_start);
+            memcpy(network->layers[0].activated_outputs.arr, &inputs->arr[j * inputs->col], inputs->col * sizeof(float));
+            expected_outputs2.arr = &expected_outputs->arr[j * expected_outputs->col];
+            PROFILE_STOP(copy_start, PROFILE_DATA, 0, 0, 2.0 * sizeof(float) * inputs->col);
+
             forward_pass(network);
             backward_pass(network, &expected_outputs2);
             update_temp_weights(temp_weights, network, learning_rate);
@@ -182,14 +327,7 @@ void train(neural_net_t *network, matrix_t *inputs, matrix_t *expected_outputs,
             {
                 update_weights(network, temp_weights, batch_size, learning_rate);
                 update_biases(network, temp_biases, batch_size, learning_rate);
-                for (int i = 1; i < network->num_layers; i++)
-                {
-                    free_matrix(&temp_weights[i]);
-                    free_vector(&temp_biases[i]);
-                    temp_weights[i] = init_matrix(network->layers[i].weights.row, network->layers[i].weights.col);
-                    temp_biases[i] = init_vector(network->layers[i].biases.len);
-                }
-                
+                clear_temp(network, temp_weights, temp_biases);
             }
         }
         if((i + 1) % 1 == 0)
@@ -202,20 +340,374 @@ void train(neural_net_t *network, matrix_t *inputs, matrix_t *expected_outputs,
     printf("Testing network...\n");
     test(network, test_inputs, test_expected_outputs);
     save_network(network, filename);
+}
+
+batch_layer_t *init_batch(neural_net_t *network, arena_t *arena, int batch_size)
+{
+    batch_layer_t *batch = (batch_layer_t *)allocate_bytes(sizeof(batch_layer_t) * network->num_layers);
+
+    batch[0].activated_outputs.arr = NULL;
+    batch[0].activated_outputs.row = batch_size;
+    batch[0].activated_outputs.col = network->layers[0].length;
+
+    for (int i = 1; i < network->num_layers; i++)
+    {
+        batch[i].activated_outputs = arena_matrix(arena, batch_size, network->layers[i].length);
+        batch[i].error = arena_matrix(arena, batch_size, network->layers[i].length);
+    }
+
+    return batch;
+}
+
+void free_batch(batch_layer_t *batch)
+{
+    free(batch);
+}
+
+void set_batch_rows(neural_net_t *network, batch_layer_t *batch, int rows)
+{
+    batch[0].activated_outputs.row = rows;
+    for (int i = 1; i < network->num_layers; i++)
+    {
+        batch[i].activated_outputs.row = rows;
+        batch[i].error.row = rows;
+    }
+}
+
+void forward_pass_batch(neural_net_t *network, batch_layer_t *batch)
+{
+    for (int i = 1; i < network->num_layers; i++)
+    {
+        layer_t *layer = &network->layers[i];
+        PROFILE_START(forward_start);
+        //example for second layer, [Bx10][10x16]+[1x16]
+        epilogue_t forward = {training_activation(network, i), network->sigmoid_mode, layer->biases.arr, NULL};
+        if (layer->half_weights.arr != NULL)
+            multiply_mat_halfT_epilogue(&batch[i].activated_outputs, &batch[i - 1].activated_outputs, &layer->half_weights, &forward);
+        else
+            multiply_mat_matT_epilogue(&batch[i].activated_outputs, &batch[i - 1].activated_outputs, &layer->weights, &forward);
+        PROFILE_STOP(forward_start, PROFILE_FORWARD, i, LAYER_FLOPS(layer, batch[i].activated_outputs.row),
+                     LAYER_BYTES(layer, batch[i].activated_outputs.row));
+    }
+}
+
+float backward_pass_batch(neural_net_t *network, batch_layer_t *batch, matrix_t *expected_outputs)
+{
+    float loss = 0;
+    for (int i = network->num_layers - 1; i > 0; i--)
+    {
+        layer_t *layer = &network->layers[i];
+        PROFILE_START(backward_start);
+        if (i == network->num_layers - 1)
+        {
+            loss = output_loss(network, &batch[i].error, &batch[i].activated_outputs, expected_outputs);
+            PROFILE_STOP(backward_start, PROFILE_LOSS, i, 0, 12.0 * batch[i].error.row * layer->length);
+            continue;
+        }
+
+        // The derivative is taken from the activated outputs, as each tile
+        // of the error is finished
+        epilogue_t backward = {layer->activation, network->sigmoid_mode, NULL, batch[i].activated_outputs.arr};
+        if (network->layers[i + 1].half_weights.arr != NULL)
+            multiply_mat_half_epilogue(&batch[i].error, &batch[i + 1].error, &network->layers[i + 1].half_weights, &backward);
+        else
+            multiply_mat_mat_epilogue(&batch[i].error, &batch[i + 1].error, &network->layers[i + 1].weights, &backward);
+        PROFILE_STOP(backward_start, PROFILE_BACKWARD, i, LAYER_FLOPS(&network->layers[i + 1], batch[i].error.row),
+                     LAYER_BYTES(&network->layers[i + 1], batch[i].error.row));
+    }
+    return loss;
+}
+
+void update_temp_weights_batch(matrix_t *temp_weights, vector_t *temp_biases, neural_net_t *network, batch_layer_t *batch)
+{
+    for (int i = network->num_layers - 1; i > 0; i--)
+    {
+        PROFILE_START(gradient_start);
+        accumulate_matT_mat(&temp_weights[i], &batch[i].error, &batch[i - 1].activated_outputs, 1);
+        accumulate_rows(&temp_biases[i], &batch[i].error);
+        // The accumulators are read and written, so the weights count twice
+        PROFILE_STOP(gradient_start, PROFILE_GRADIENT, i, LAYER_FLOPS(&network->layers[i], batch[i].error.row),
+                     LAYER_BYTES(&network->layers[i], batch[i].error.row) + 4.0 * temp_weights[i].row * temp_weights[i].col);
+    }
+}
+
+// Floats needed by a workspace, matching the order reserve_workspace()
+// carves them out in
+static size_t workspace_len(neural_net_t *network, int shard_size, int num_workers)
+{
+    size_t len = num_workers * network->params.len;
 
     for (int i = 1; i < network->num_layers; i++)
     {
-        free_matrix(&temp_weights[i]);
-        free_vector(&temp_biases[i]);
+        len += num_workers * 2 * arena_len((size_t)shard_size * network->layers[i].length);
+    }
+
+    return len;
+}
+
+void reserve_workspace(neural_net_t *network, int batch_size, int num_workers)
+{
+    workspace_t *workspace = &network->workspace;
+    if (workspace->num_workers == num_workers && workspace->batch_size >= batch_size)
+        return;
+
+    free_workspace(network);
+
+    int shard_size = (batch_size + num_workers - 1) / num_workers;
+    workspace->arena = init_arena(workspace_len(network, shard_size, num_workers));
+    workspace->num_workers = num_workers;
+    workspace->batch_size = batch_size;
+
+    workspace->workers = (worker_t *)allocate_bytes(sizeof(worker_t) * num_workers);
+    for (int w = 0; w < num_workers; w++)
+    {
+        worker_t *worker = &workspace->workers[w];
+        worker->batch = init_batch(network, &workspace->arena, shard_size);
+        worker->gradients = arena_alloc(&workspace->arena, network->params.len);
+        worker->temp_weights = (matrix_t *)allocate_bytes(sizeof(matrix_t) * network->num_layers);
+        worker->temp_biases = (vector_t *)allocate_bytes(sizeof(vector_t) * network->num_layers);
+        for (int i = 1; i < network->num_layers; i++)
+        {
+            layer_t *layer = &network->layers[i];
+            worker->temp_weights[i] = (matrix_t){&worker->gradients[layer->weights_offset], layer->weights.row, layer->weights.col};
+            worker->temp_biases[i] = (vector_t){&worker->gradients[layer->biases_offset], layer->biases.len};
+        }
+    }
+}
+
+void free_workspace(neural_net_t *network)
+{
+    workspace_t *workspace = &network->workspace;
+
+    for (int w = 0; w < workspace->num_workers; w++)
+    {
+        free_batch(workspace->workers[w].batch);
+        free(workspace->workers[w].temp_weights);
+        free(workspace->workers[w].temp_biases);
+    }
+    if (workspace->num_workers > 0)
+    {
+        free(workspace->workers);
+        free_arena(&workspace->arena);
+    }
+    workspace->num_workers = 0;
+    workspace->batch_size = 0;
+}
+
+// Sums the gradient slabs of workers 1..active-1 into worker 0's. Every
+// element is summed in worker order, so the result does not depend on
+// which thread reduces which chunk.
+static void reduce_workers(neural_net_t *network, worker_t *workers, int active)
+{
+    const int chunk = 4096;
+    float *total = workers[0].gradients;
+    size_t size = network->params.len;
+    int num_chunks = (int)((size + chunk - 1) / chunk);
+    PROFILE_START(reduce_start);
+
+    #pragma omp parallel for schedule(static)
+    for (int c = 0; c < num_chunks; c++)
+    {
+        size_t start = (size_t)c * chunk;
+        int len = size - start < (size_t)chunk ? (int)(size - start) : chunk;
+        for (int w = 1; w < active; w++)
+        {
+            simd.add(&total[start], &total[start], &workers[w].gradients[start], len);
+        }
+    }
+    PROFILE_STOP(reduce_start, PROFILE_REDUCE, 0, (double)(active - 1) * size, 12.0 * (active - 1) * size);
+}
+
+float train_step(neural_net_t *network, matrix_t *inputs, matrix_t *expected_outputs, float learning_rate)
+{
+    // Grows the worker arenas when the batch is larger than reserved for
+    reserve_workspace(network, inputs->row, network->workspace.num_workers);
+
+    worker_t *workers = network->workspace.workers;
+    int num_workers = network->workspace.num_workers;
+    int rows = inputs->row;
+    int shard_size = (rows + num_workers - 1) / num_workers;
+    int active = (rows + shard_size - 1) / shard_size;
+
+    // Shard w is always rows [w * shard_size, (w + 1) * shard_size), so a
+    // given thread count always splits a batch the same way
+    #pragma omp parallel for schedule(static, 1) num_threads(num_workers)
+    for (int w = 0; w < active; w++)
+    {
+        int start = w * shard_size;
+        int count = rows - start < shard_size ? rows - start : shard_size;
+        batch_layer_t *batch = workers[w].batch;
+        matrix_t shard_expected;
+
+        set_batch_rows(network, batch, count);
+        batch[0].activated_outputs.arr = &inputs->arr[start * inputs->col];
+        shard_expected.arr = &expected_outputs->arr[start * expected_outputs->col];
+        shard_expected.row = count;
+        shard_expected.col = expected_outputs->col;
+
+        forward_pass_batch(network, batch);
+        workers[w].loss = backward_pass_batch(network, batch, &shard_expected);
+        update_temp_weights_batch(workers[w].temp_weights, workers[w].temp_biases, network, batch);
+    }
+
+    reduce_workers(network, workers, active);
+    float loss = 0;
+    for (int w = 0; w < active; w++)
+    {
+        loss += workers[w].loss;
+    }
+
+    if (network->optimizer != NULL)
+    {
+        optimizer_step(network->optimizer, network, workers[0].gradients, rows, learning_rate);
+    }
+    else
+    {
+        update_weights(network, workers[0].temp_weights, rows, learning_rate);
+        update_biases(network, workers[0].temp_biases, rows, learning_rate);
+    }
+
+    for (int w = 0; w < active; w++)
+    {
+        memset(workers[w].gradients, 0, sizeof(float) * network->params.len);
+    }
+    return loss / rows;
+}
+
+// One worker per OpenMP thread, but never more workers than samples
+static int default_workers(int batch_size)
+{
+    int num_workers = 1;
+#ifdef _OPENMP
+    num_workers = omp_get_max_threads();
+#endif
+    return num_workers > batch_size ? batch_size : num_workers;
+}
+
+void train_batch(neural_net_t *network, matrix_t *inputs, matrix_t *expected_outputs,
+                 int epochs, int batch_size, float learning_rate,
+                 matrix_t *test_inputs, matrix_t *test_expected_outputs, char* filename)
+{
+    printf("\n");
+
+    reserve_workspace(network, batch_size, default_workers(batch_size));
+    matrix_t batch_inputs;
+    matrix_t batch_expected;
+    batch_inputs.col = inputs->col;
+    batch_expected.col = expected_outputs->col;
+
+    for (int i = 0; i < epochs; i++)
+    {
+        printf("Starting epoch %d\n", i + 1);
+        for (int j = 0; j < inputs->row; j += batch_size)
+        {
+            int rows = inputs->row - j < batch_size ? inputs->row - j : batch_size;
+
+            // The inputs are row major, so a batch is just a view of its rows
+            batch_inputs.arr = &inputs->arr[j * inputs->col];
+            batch_inputs.row = rows;
+            batch_expected.arr = &expected_outputs->arr[j * expected_outputs->col];
+            batch_expected.row = rows;
+
+            train_step(network, &batch_inputs, &batch_expected, learning_rate);
+        }
+        if((i + 1) % 1 == 0)
+        {
+            test(network, test_inputs, test_expected_outputs);
+            save_network(network, filename);
+        }
+    }
+    printf("Training complete\n");
+    printf("Testing network...\n");
+    test(network, test_inputs, test_expected_outputs);
+    save_network(network, filename);
+}
+
+void train_dataset(neural_net_t *network, dataset_t *train_set, dataset_t *test_set, sampler_t *sampler,
+                   training_state_t *state, int epochs, int batch_size, checkpointer_t *checkpoints,
+                   schedule_t *schedule)
+{
+    printf("\n");
+
+    int outputs = network->layers[network->num_layers - 1].length;
+    if (train_set->features != network->layers[0].length || test_set->features != network->layers[0].length ||
+        train_set->num_classes > outputs || test_set->num_classes > outputs)
+    {
+        fprintf(stderr, "dataset shape doesn't match the network\n");
+        return;
+    }
+
+    reserve_workspace(network, batch_size, default_workers(batch_size));
+    // One batch training while the producer fills the others
+    pipeline_t pipeline;
+    pipeline_start(&pipeline, train_set, sampler, batch_size, PIPELINE_SLOTS, state->epoch, epochs, outputs, NULL, NULL);
+
+    int stop = schedule != NULL && schedule_stopped(schedule, state);
+    for (int i = state->epoch; i < epochs && !stop; i++)
+    {
+        printf("Starting epoch %d\n", i + 1);
+        double stalled = pipeline.stall_seconds;
+        double loss = 0;
+        for (int j = 0; j < train_set->count; j += batch_size)
+        {
+            PROFILE_START(wait_start);
+            pipeline_slot_t *batch = pipeline_next(&pipeline);
+            PROFILE_STOP(wait_start, PROFILE_WAIT, 0, 0, 0);
+            if (schedule != NULL)
+                state->learning_rate = schedule_rate(schedule, state, i + (float)(j + batch->inputs.row) / train_set->count, epochs);
+            loss += (double)train_step(network, &batch->inputs, &batch->expected, state->learning_rate) * batch->inputs.row;
+            pipeline_release(&pipeline);
+        }
+        printf("Waited %.3f s for data\n", pipeline.stall_seconds - stalled);
+        printf("Training loss %.5f\n", loss / train_set->count);
+
+        state->epoch = i + 1;
+        PROFILE_START(test_start);
+        int correct = test_dataset(network, test_set);
+        PROFILE_STOP(test_start, PROFILE_TEST, 0, 0, 0);
+        printf("Accuracy: %d / %d\n", correct, test_set->count);
+        if (schedule != NULL)
+        {
+            stop = schedule_epoch(schedule, state, (float)correct / test_set->count);
+            printf("Learning rate %g, best epoch %d\n", state->learning_rate, state->best_epoch);
+        }
+        // Written after the schedule has seen the epoch, so the checkpoint of
+        // a new best is already marked as the one to keep
+        if (checkpoints != NULL)
+        {
+            PROFILE_START(checkpoint_start);
+            checkpoint_async(checkpoints, network, state);
+            PROFILE_STOP(checkpoint_start, PROFILE_CHECKPOINT, 0, 0, 0);
+        }
+        PROFILE_EPOCH(i + 1, train_set->count);
     }
+    pipeline_stop(&pipeline);
+    if (stop)
+        printf("No improvement in %d epochs, stopping early\n", schedule->patience);
+    if (checkpoints != NULL)
+    {
+        checkpoint_wait(checkpoints);
+        printf("Waited %.3f s for checkpoints\n", checkpoints->wait_seconds);
+
+        if (schedule != NULL && schedule->patience > 0 && state->best_epoch > 0 && state->best_epoch < state->epoch)
+        {
+            if (rollback_checkpoint(checkpoints, network, state->best_epoch) == 0)
+                printf("Rolled back to epoch %d, accuracy %.4f\n", state->best_epoch, state->best_accuracy);
+            else
+                fprintf(stderr, "couldn't roll back to epoch %d\n", state->best_epoch);
+        }
+    }
+    printf("Training complete\n");
 }
 
 void update_biases(neural_net_t *network, vector_t *temp_biases, int batch_size, float learning_rate)
 {
     for (int i = 1; i < network->num_layers; i++)
     {
+        PROFILE_START(update_start);
         scalar_multiply_vec(&temp_biases[i], &temp_biases[i], learning_rate / (float)batch_size);
         subtract_vec(&network->layers[i].biases, &network->layers[i].biases, &temp_biases[i]);
+        PROFILE_STOP(update_start, PROFILE_UPDATE, i, 2.0 * temp_biases[i].len, 20.0 * temp_biases[i].len);
     }
 }
 
@@ -223,7 +715,9 @@ void update_temp_biases(vector_t *biases, neural_net_t *net, float learning_rate
 {
     for (int i = net->num_layers - 1; i > 0; i--)
     {
+        PROFILE_START(gradient_start);
         add_vec(&biases[i], &biases[i], &net->layers[i].error);
+        PROFILE_STOP(gradient_start, PROFILE_GRADIENT, i, biases[i].len, 12.0 * biases[i].len);
     }
 }
 
@@ -231,10 +725,10 @@ void update_temp_weights(matrix_t *weights, neural_net_t *net, float learning_ra
 {
     for (int i = net->num_layers - 1; i > 0; i--)
     {
-        matrix_t grad = init_matrix(net->layers[i].weights.row, net->layers[i].weights.col);
-        multiply_vec_vec(&grad, &net->layers[i].error, &net->layers[i - 1].activated_outputs);
-        add_mat(&weights[i], &weights[i], &grad);
-        free_matrix(&grad);
+        PROFILE_START(gradient_start);
+        accumulate_vec_vec(&weights[i], &net->layers[i].error, &net->layers[i - 1].activated_outputs, 1);
+        PROFILE_STOP(gradient_start, PROFILE_GRADIENT, i, LAYER_FLOPS(&net->layers[i], 1),
+                     LAYER_BYTES(&net->layers[i], 1) + 4.0 * weights[i].row * weights[i].col);
     }
 }
 
@@ -242,21 +736,23 @@ void update_weights(neural_net_t *net, matrix_t *temp_weights, int batch_size, f
 {
     for (int i = 1; i < net->num_layers; i++)
     {
+        PROFILE_START(update_start);
         scalar_multiply_mat(&temp_weights[i], &temp_weights[i], learning_rate / (float)batch_size);
         subtract_mat(&net->layers[i].weights, &net->layers[i].weights, &temp_weights[i]);
+        // Updates smaller than a half's precision still add up in the floats
+        if (net->layers[i].half_weights.arr != NULL)
+            round_half_matrix(&net->layers[i].half_weights, &net->layers[i].weights);
+        PROFILE_STOP(update_start, PROFILE_UPDATE, i, 2.0 * temp_weights[i].row * temp_weights[i].col,
+                     20.0 * temp_weights[i].row * temp_weights[i].col);
     }
 }
 
-void test(neural_net_t *network, matrix_t *inputs, matrix_t *expected_outputs)
+int test(neural_net_t *network, matrix_t *inputs, matrix_t *expected_outputs)
 {
-    matrix_t network_output = init_matrix(inputs->row, inputs->col);
     int sum = 0;
     for (int i = 0; i < inputs->row; i++)
     {
-        for (int j = 0; j < inputs->col; j++)
-        {
-            network->layers[0].activated_outputs.arr[j] = inputs->arr[i * inputs->col + j];
-        }
+        memcpy(network->layers[0].activated_outputs.arr, &inputs->arr[i * inputs->col], inputs->col * sizeof(float));
         forward_pass(network);
         int max_index = 0;
         for (int j = 0; j < network->layers[network->num_layers - 1].activated_outputs.len; j++)
@@ -271,9 +767,54 @@ void test(neural_net_t *network, matrix_t *inputs, matrix_t *expected_outputs)
             sum++;
         }
     }
-    printf("Accuracy: %d / 10000\n", sum);
+    printf("Accuracy: %d / %d\n", sum, inputs->row);
+    return sum;
+}
+
+int test_dataset(neural_net_t *network, dataset_t *test_set)
+{
+    int outputs = network->layers[network->num_layers - 1].length;
+    model_t model = model_view(network);
+    exec_context_t context;
+    init_context(&context, &model, TEST_BATCH_SIZE);
+
+    arena_t arena = init_arena(arena_len((size_t)TEST_BATCH_SIZE * test_set->features) + arena_len((size_t)TEST_BATCH_SIZE * outputs));
+    matrix_t batch_inputs = arena_matrix(&arena, TEST_BATCH_SIZE, test_set->features);
+    matrix_t batch_outputs = arena_matrix(&arena, TEST_BATCH_SIZE, outputs);
+
+    int sum = 0;
+    int released = 0;
+    for (int i = 0; i < test_set->count; i += TEST_BATCH_SIZE)
+    {
+        int rows = test_set->count - i < TEST_BATCH_SIZE ? test_set->count - i : TEST_BATCH_SIZE;
+
+        gather_inputs(test_set, i, rows, &batch_inputs);
+        batch_outputs.row = rows;
+        predict_batch(&model, &context, &batch_inputs, &batch_outputs);
+        dataset_stream(test_set, &released, i + rows);
+
+        for (int r = 0; r < rows; r++)
+        {
+            float *row = &batch_outputs.arr[(size_t)r * outputs];
+            int max_index = 0;
+            for (int j = 0; j < outputs; j++)
+            {
+                if (row[j] > row[max_index])
+                {
+                    max_index = j;
+                }
+            }
+            if (max_index == dataset_label(test_set, i + r))
+            {
+                sum++;
+            }
+        }
+    }
 
-    free_matrix(&network_output);
+    free_arena(&arena);
+    free_context(&context);
+    close_model(&model);
+    return sum;
 }
 
 void print_matrix(matrix_t *mat)
@@ -295,115 +836,111 @@ void print_vector(vector_t *vec)
     }
 }
 
-void save_matrix(matrix_t *mat, FILE *file)
-{
-    __uint8_t* temp = (__uint8_t*)mat->arr;
-
-    for (int i = 0; i < mat->row*mat->col*sizeof(float); i++)
-    {
-        fprintf(file, "%c", temp[i]);
-    }
-}
-void save_vector(vector_t *vec, FILE *file)
-{
-    __uint8_t* temp = (__uint8_t*)vec->arr;
-    for (int i = 0; i < vec->len*sizeof(float); i++)
-    {
-        fprintf(file, "%c", temp[i]);
-    }
-}
-
 void save_network(neural_net_t* network, char* filedescriptor)
 {
-    char filename[100];
-    char* temp = filename;
+    // Up to 11 characters and a '-' per layer size
+    size_t len = (size_t)network->num_layers * 12 + strlen(filedescriptor) + sizeof(".nnm");
+    char* filename = (char*)allocate_bytes(len);
     int j = 0;
     for(int i = 0; i < network->num_layers; i++)
     {
-        snprintf(temp+j, 100, "%d-", network->layers[i].length);
-
-        if(network->layers[i].length > 99999)
-            return;
-        else if(network->layers[i].length > 9999)
-            j += 6;
-        else if(network->layers[i].length > 999)
-            j += 5;
-        else if(network->layers[i].length > 99)
-            j += 4;
-        else if(network->layers[i].length > 9)
-            j += 3;
-        else if(network->layers[i].length < 9)
-            j += 2;
-    }
-    snprintf(temp+j, 100, "%s.pickl", filedescriptor);
+        j += snprintf(filename + j, len - j, "%d-", network->layers[i].length);
+    }
+    snprintf(filename + j, len - j, "%s.nnm", filedescriptor);
     printf("%s\n", filename);
 
-
-    FILE* file = fopen(filename, "w");
-    for(int i = 0; i < network->num_layers; i++)
-    {
-        save_matrix(&network->layers[i].weights, file);
-        save_vector(&network->layers[i].biases, file);
-    }
-    fclose(file);
+    save_model(network, filename, NULL, 0);
+    free(filename);
 }
 
-void load_network(neural_net_t* network, char* filename)
+int load_network(neural_net_t* network, char* filename)
 {
-    char file[100];
-    char* token;
+    if (is_model_file(filename))
+        return load_model(network, filename, 0);
+
+    // Legacy .pickl, the layer sizes lead the file name
+    const char* name = strrchr(filename, '/') != NULL ? strrchr(filename, '/') + 1 : filename;
+    char* file = (char*)allocate_bytes(strlen(name) + 1);
+    int* layers = (int*)allocate_bytes(sizeof(int) * (strlen(name) / 2 + 1));
     int num_layers = 0;
-    int layers[12];
 
-    strcpy(file, filename);
-    token = strtok(file, "-");
-   
-    while (token != NULL && *token < 57 && num_layers < 12)
+    strcpy(file, name);
+    for (char* token = strtok(file, "-"); token != NULL && *token >= '0' && *token <= '9'; token = strtok(NULL, "-"))
     {
-        layers[num_layers] = atoi(token);
-        token = strtok(NULL, "-");
-        num_layers++;
+        layers[num_layers++] = atoi(token);
     }
 
-    *network = allocate_neural_net(num_layers, layers);
-
-    FILE* fd = fopen(filename, "r");
+    FILE* fd = fopen(filename, "rb");
+    if (fd == NULL || num_layers < 2)
+    {
+        fprintf(stderr, "couldn't open %s as a model\n", filename);
+        if (fd != NULL)
+            fclose(fd);
+        free(file);
+        free(layers);
+        return -1;
+    }
 
-    read_file(network, fd);
+    *network = allocate_neural_net(num_layers, layers, SIGMOID_EXACT);
+    int result = read_file(network, fd);
+    if (result == -1)
+    {
+        fprintf(stderr, "%s doesn't match the topology in its name\n", filename);
+        free_network(network);
+    }
 
     fclose(fd);
-
+    free(file);
+    free(layers);
+    return result;
 }
 
-void read_file(neural_net_t* net, FILE* file)
+// Reads len values of width bytes, floats or doubles, into out
+static int read_floats(float *out, size_t len, size_t width, FILE *file)
 {
-    __uint8_t* temp_weights;
-    __uint8_t* temp_biases;
-    int temp_weights_length;
-    int temp_biases_length;
+    if (width == sizeof(float))
+        return fread(out, sizeof(float), len, file) == len ? 0 : -1;
 
-    for(int i = 0; i < net->num_layers; i++)
+    double values[256];
+    for (size_t i = 0; i < len; i += 256)
     {
-        temp_weights_length = sizeof(float) * (net->layers[i].weights.row*net->layers[i].weights.col);
-        temp_biases_length = sizeof(float) * (net->layers[i].biases.len);
+        size_t count = len - i < 256 ? len - i : 256;
+        if (fread(values, sizeof(double), count, file) != count)
+            return -1;
+        for (size_t j = 0; j < count; j++)
+            out[i + j] = (float)values[j];
+    }
+    return 0;
+}
 
-        free(net->layers[i].weights.arr);
-        free(net->layers[i].biases.arr);
-        
-        temp_weights = (__uint8_t*)calloc(temp_weights_length, sizeof(float));
-        temp_biases = (__uint8_t*)calloc(temp_biases_length, sizeof(float));
+int read_file(neural_net_t* net, FILE* file)
+{
+    // Legacy files also hold the unused input layer parameters, length x 1
+    // weights and length biases, which are skipped
+    size_t input_len = 2 * (size_t)net->layers[0].length;
+    size_t len = input_len;
+    for (int i = 1; i < net->num_layers; i++)
+    {
+        len += (size_t)net->layers[i].weights.row * net->layers[i].weights.col + net->layers[i].biases.len;
+    }
 
+    // Files saved while the network trained in doubles are twice as long
+    if (fseek(file, 0, SEEK_END) != 0)
+        return -1;
+    long file_len = ftell(file);
+    size_t width = file_len == (long)(len * sizeof(float)) ? sizeof(float)
+                 : file_len == (long)(len * sizeof(double)) ? sizeof(double) : 0;
+    if (width == 0 || fseek(file, (long)(input_len * width), SEEK_SET) != 0)
+        return -1;
 
-        for(int j = 0; j < temp_weights_length || feof(file); j++)
-        {
-            temp_weights[j] = fgetc(file);
-        }
-        for(int j = 0; j < temp_biases_length || feof(file); j++)
+    for(int i = 1; i < net->num_layers; i++)
+    {
+        layer_t *layer = &net->layers[i];
+        if (read_floats(layer->weights.arr, (size_t)layer->weights.row * layer->weights.col, width, file) == -1 ||
+            read_floats(layer->biases.arr, layer->biases.len, width, file) == -1)
         {
-            temp_biases[j] = fgetc(file); 
+            return -1;
         }
-        net->layers[i].weights.arr = (float*)temp_weights;
-        net->layers[i].biases.arr = (float*)temp_biases;
     }
-
-}
\ No newline at end of file
+    return 0;
+}
@@ -1,47 +1,175 @@
-#ifndef NURAL_NET
+#ifndef NEURAL_NET
 #define NEURAL_NET
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
 #include "nnMath.h"
+#include "nnData.h"
+#include "nnPipeline.h"
 #include <time.h>
 
 
+// The weights, biases, activated outputs and errors of a layer are views
+// into slabs of the network, see neural_net_t
 typedef struct
 {
     matrix_t weights;
+    // Rounded from weights after every update when the network trains in
+    // half precision, the passes read it instead. NULL arr otherwise.
+    half_matrix_t half_weights;
     vector_t biases;
-    vector_t weighted_outputs;
+    // The weighted outputs are never stored, the products apply the bias
+    // and activation as they finish each part of the output
     vector_t activated_outputs;
     vector_t error;
     int length;
+    // Unused by the input layer
+    activation_t activation;
+    // Where the weights and biases start in the parameter slab, and the
+    // gradients in a gradient slab, in floats. 0 for the input layer.
+    size_t weights_offset;
+    size_t biases_offset;
 } layer_t;
 
+// Outputs of one layer for a whole minibatch, one sample per row
+typedef struct
+{
+    matrix_t activated_outputs;
+    matrix_t error;
+} batch_layer_t;
+
+// Private scratch of one thread in data parallel training: the layer
+// outputs of its shard of the minibatch and its summed gradients
+typedef struct
+{
+    batch_layer_t *batch;
+    // Laid out like the parameter slab, temp_weights and temp_biases are
+    // the views of each layer's block
+    float *gradients;
+    matrix_t *temp_weights;
+    vector_t *temp_biases;
+    // Summed loss of the shard of the last step
+    float loss;
+} worker_t;
+
+// Everything the training and inference paths write to besides the layers
+// themselves. It is carved out of one arena sized from the layer sizes, so
+// a steady state training step or forward pass makes no heap allocations.
+typedef struct
+{
+    arena_t arena;
+    worker_t *workers;
+    int num_workers;
+    int batch_size;
+} workspace_t;
+
+typedef struct optimizer optimizer_t;
+
+// What training minimizes
+typedef enum
+{
+    // Half the squared distance of the outputs from the expected ones
+    LOSS_QUADRATIC,
+    // Cross-entropy of a softmax output layer. The training passes leave
+    // the output layer as logits, and backward passes take the softmax, the
+    // loss and its gradient p - y from them in one pass.
+    LOSS_CROSS_ENTROPY
+} loss_t;
+
 typedef struct neuralnet
 {
     layer_t *layers;
     int num_layers;
+    sigmoid_mode_t sigmoid_mode;
+    // Storage of the weights the passes read, the float weights are always
+    // the master copy
+    precision_t precision;
+    // How train_step() applies the gradients, NULL for plain SGD through
+    // update_weights() and update_biases()
+    optimizer_t *optimizer;
+    // Set with set_loss(), it isn't saved with the model
+    loss_t loss;
+    // Every layer's weights followed by its biases, layer by layer, each
+    // block starting on a 64-byte boundary, which is also how a model file
+    // lays them out. Gradients and optimizer state are laid out the same,
+    // so an update or a save is one pass over the slab.
+    arena_t params;
+    // The activated outputs and errors of the single sample passes
+    arena_t activations;
+    workspace_t workspace;
+    // The model file the parameter slab points into, NULL when it was
+    // allocated
+    void *map;
+    size_t map_len;
 } neural_net_t;
 
+// Where a training run stands. It is saved with every checkpoint, so a run
+// can resume from one.
+typedef struct
+{
+    // Epochs completed
+    int epoch;
+    // The rate of the last step
+    float learning_rate;
+    // The best test accuracy so far as a fraction, the epoch it was reached
+    // in and the epochs since, 0 best_epoch before the first
+    float best_accuracy;
+    int best_epoch;
+    int stale_epochs;
+    // Epochs since the best or the last plateau reduction, and the
+    // reductions made
+    int plateau_epochs;
+    int reductions;
+} training_state_t;
+
+typedef struct checkpointer checkpointer_t;
+typedef struct schedule schedule_t;
+
 void print_matrix(matrix_t *mat);
 void print_vector(vector_t *vec);
 
-neural_net_t allocate_neural_net(int, int*);
+// sigmoid_mode picks between the exact and the fast sigmoid for every
+// forward pass of the network. Layers start out sigmoid with random
+// weights and biases.
+neural_net_t allocate_neural_net(int, int*, sigmoid_mode_t sigmoid_mode);
+
+// Sets the shapes and slab offsets of the weights and biases of layers
+// whose lengths are set, and returns the floats the parameter slab holds
+size_t layout_params(layer_t *layers, int num_layers);
 
-layer_t init_layer(int length, int previous_layer_length);
+// Points the layers of a laid out network at params, allocating a zeroed
+// slab if it is NULL, and allocates the single sample activations
+void attach_slabs(neural_net_t *network, float *params);
 
-void free_layer(layer_t *layer);
+// Switches layer to activation and draws its weights again at the scale
+// that trains well with it, He initialization for the ReLUs and Glorot for
+// the others, with zero biases
+void init_activation(neural_net_t *network, int layer, activation_t activation);
+
+// Switches the weights the forward and backward passes read to an fp16 or
+// bf16 copy of the float weights, or back to the floats with
+// PRECISION_F32. Products are still summed in float, and update_weights()
+// updates the floats and rounds the copy again.
+void set_precision(neural_net_t *network, precision_t precision);
+
+// Networks start out LOSS_QUADRATIC. LOSS_CROSS_ENTROPY switches the
+// output layer to softmax, keeping its weights.
+void set_loss(neural_net_t *network, loss_t loss);
 
 void free_network(neural_net_t *);
 
-void feed_forward(layer_t *current_layer, layer_t *previous_layer);
+// Sets the activated outputs of current_layer from those of previous_layer
+void feed_forward(layer_t *current_layer, layer_t *previous_layer, sigmoid_mode_t sigmoid_mode);
 
+// Under LOSS_CROSS_ENTROPY the output layer is left as logits
 void forward_pass(neural_net_t *network);
 
-void loss(vector_t *, vector_t*);
+// Mean absolute difference of predict and actual
+float loss_function(vector_t *predict, vector_t *actual);
 
-void backward_pass(neural_net_t *network, vector_t *expected_outputs);
+// Returns the loss of the sample
+float backward_pass(neural_net_t *network, vector_t *expected_outputs);
 
 void train(neural_net_t *network, matrix_t *inputs, matrix_t *expected_outputs,
            int epochs, int batch_size, float learning_rate,
@@ -49,24 +177,92 @@ void train(neural_net_t *network, matrix_t *inputs, matrix_t *expected_outputs,
 
 void update_weights(neural_net_t *network, matrix_t *temp_weights, int batch_size, float learning_rate);
 
-void test(neural_net_t *network, matrix_t *inputs, matrix_t *expected_outputs);
+// Prints and returns the number of inputs the network classifies correctly
+int test(neural_net_t *network, matrix_t *inputs, matrix_t *expected_outputs);
+
+// Same as train_batch(), but the samples are read from a mapped dataset
+// and scaled as each minibatch is assembled, so the float copy of the
+// whole dataset is never built. sampler sets each epoch's order, NULL
+// trains in file order. Trains from epoch state->epoch up to epochs, and
+// after each one hands a checkpoint to checkpoints if it isn't NULL.
+// schedule sets the learning rate of every step from the test accuracy of
+// each epoch, NULL trains at state->learning_rate throughout. If it stops
+// early, or could have, and training ends past the best epoch, the network
+// is rolled back to that epoch's checkpoint, which checkpoints keeps.
+void train_dataset(neural_net_t *network, dataset_t *train_set, dataset_t *test_set, sampler_t *sampler,
+                   training_state_t *state, int epochs, int batch_size, checkpointer_t *checkpoints,
+                   schedule_t *schedule);
+
+// Samples test_dataset() runs through the network at once
+#define TEST_BATCH_SIZE 256
+
+// Returns the number of test_set samples the network classifies correctly
+int test_dataset(neural_net_t *network, dataset_t *test_set);
 
 void test2(neural_net_t *network, neural_net_t *network_checker, matrix_t *expected_outputs);
 
 void update_temp_weights(matrix_t *temp_weights, neural_net_t *network, float learning_rate);
 
+// Zeroes the gradient accumulators after an update
+void clear_temp(neural_net_t *network, matrix_t *temp_weights, vector_t *temp_biases);
+
 void update_temp_biases(vector_t *temp_biases, neural_net_t *network, float learning_rate);
 
 void update_biases(neural_net_t *network, vector_t *temp_biases, int batch_size, float learning_rate);
 
-void save_network(neural_net_t* network, char* filename);
+// Takes the per-layer matrices for batches of up to batch_size samples
+// from the arena. The input layer holds no storage, its activated_outputs
+// is pointed at the rows of the current batch.
+batch_layer_t *init_batch(neural_net_t *network, arena_t *arena, int batch_size);
+
+void free_batch(batch_layer_t *batch);
 
-void load_network(neural_net_t* network, char* filename);
+// Sets the number of samples in the current batch, must be <= batch_size
+void set_batch_rows(neural_net_t *network, batch_layer_t *batch, int rows);
 
-void save_vector(vector_t *vec, FILE *file);
+// Under LOSS_CROSS_ENTROPY the output layer is left as logits
+void forward_pass_batch(neural_net_t *network, batch_layer_t *batch);
+
+// Returns the loss summed over the rows of the batch
+float backward_pass_batch(neural_net_t *network, batch_layer_t *batch, matrix_t *expected_outputs);
+
+// Adds the summed gradients of the batch to temp_weights and temp_biases
+void update_temp_weights_batch(matrix_t *temp_weights, vector_t *temp_biases, neural_net_t *network, batch_layer_t *batch);
+
+// Makes room in the workspace for minibatches of up to batch_size samples
+// split across num_workers threads. Does nothing if the current workspace
+// already fits, so it is cheap to call before every training run.
+void reserve_workspace(neural_net_t *network, int batch_size, int num_workers);
+
+void free_workspace(neural_net_t *network);
+
+// Runs one minibatch split into a shard per workspace worker in parallel,
+// sums the shard gradients in a fixed order and updates the network through
+// its optimizer. The result is bit for bit the same for a given number of
+// workers. A minibatch larger than the workspace was reserved for grows it
+// first. Returns the mean loss of the minibatch, summed in the same fixed
+// order.
+float train_step(neural_net_t *network, matrix_t *inputs, matrix_t *expected_outputs, float learning_rate);
+
+// Same as train(), but each minibatch is pushed through the network as one
+// matrix per layer instead of one sample at a time, split across
+// omp_get_max_threads() workers when built with OpenMP
+void train_batch(neural_net_t *network, matrix_t *inputs, matrix_t *expected_outputs,
+                 int epochs, int batch_size, float learning_rate,
+                 matrix_t *test_inputs, matrix_t *test_expected_outputs, char* filename);
+
+// Writes the binary model format of nnModel.h to
+// <layer sizes>-<filename>.nnm
+void save_network(neural_net_t* network, char* filename);
 
-void save_matrix(matrix_t *mat, FILE *file);
+// Loads a binary model file, or a legacy .pickl whose topology is in its
+// name. The CRC of a model file is left to verify_model(). Returns 0, or -1
+// after printing why to stderr.
+int load_network(neural_net_t* network, char* filename);
 
-void read_file(neural_net_t* net, FILE* file);
+// Reads the raw floats, or doubles, of a legacy .pickl into an allocated
+// network of its topology. Returns -1 if the file's length doesn't match
+// the topology.
+int read_file(neural_net_t* net, FILE* file);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,807 @@
+#include "NeuralNet.h"
+#include "nnInference.h"
+#include "nnSimd.h"
+#include <string.h>
+#include <time.h>
+
+// Checks the matrix-matrix kernels against a reference loop, then times
+// the nnMath kernels over a sweep of sizes, the passes and training steps
+// of the 784-30-10 and 784-128-128-10 networks and their prediction
+// latency. Results go to stdout as a table and, with --json or --csv, to
+// files that can be compared across commits.
+//
+// usage: bench [--json file] [--csv file] [--label text] [--quick]
+
+#define MAX_RESULTS 512
+// Timings are the best of this many trials, which each run for their share
+// of the time budget
+#define BENCH_TRIALS 5
+#define BENCH_BATCH 64
+// Samples of the synthetic epoch
+#define EPOCH_SAMPLES 8192
+#define LATENCY_CALLS 2000
+
+typedef struct
+{
+    // "peak", "kernel", "pass", "epoch" or "latency"
+    const char *group;
+    char name[40];
+    char shape[40];
+    // Per call
+    double seconds;
+    // 0 where they don't apply
+    double gflops;
+    double gbps;
+    double samples_per_second;
+    // Microseconds, latency results only
+    double p50;
+    double p90;
+    double p99;
+    double max;
+} result_t;
+
+static result_t results[MAX_RESULTS];
+static int num_results;
+
+// Measured ceilings of one core for the instruction set simd picked. The
+// products in nnMath.c are compiled for the build's target instead, so
+// under NN_SIMD=scalar they can go past them.
+static double peak_gflops;
+static double peak_gbps;
+
+static double budget = 0.25;
+
+static double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void fill_random(matrix_t *mat)
+{
+    for (int i = 0; i < mat->row * mat->col; i++)
+    {
+        mat->arr[i] = (float)rand() / (RAND_MAX / 2) - 1;
+    }
+}
+
+static result_t *add_result(const char *group, const char *name, const char *shape)
+{
+    if (num_results == MAX_RESULTS)
+    {
+        fprintf(stderr, "too many results\n");
+        exit(-1);
+    }
+    result_t *result = &results[num_results++];
+    memset(result, 0, sizeof(*result));
+    result->group = group;
+    snprintf(result->name, sizeof(result->name), "%s", name);
+    snprintf(result->shape, sizeof(result->shape), "%s", shape);
+    return result;
+}
+
+// Seconds per call of run, after one call to warm the caches
+static double time_calls(void (*run)(void *), void *context)
+{
+    run(context);
+    double best = INFINITY;
+    for (int trial = 0; trial < BENCH_TRIALS; trial++)
+    {
+        long calls = 0;
+        double start = now_seconds();
+        double elapsed;
+        do
+        {
+            run(context);
+            calls++;
+            elapsed = now_seconds() - start;
+        } while (elapsed < budget / BENCH_TRIALS);
+        if (elapsed / calls < best)
+            best = elapsed / calls;
+    }
+    return best;
+}
+
+// Chains of independent multiply-adds on registers, enough of them to hide
+// the latency of each. Built per instruction set like nnSimd.c does.
+#define PEAK_CHAINS 12
+#define PEAK_LOOP(suffix, width)                                                      \
+    static float peak_##suffix(long iterations)                                       \
+    {                                                                                 \
+        typedef float vec __attribute__((vector_size((width) * sizeof(float))));      \
+        vec acc[PEAK_CHAINS];                                                         \
+        vec mul = (vec){0} + 0.999f;                                                  \
+        vec add = (vec){0} + 0.001f;                                                  \
+        for (int c = 0; c < PEAK_CHAINS; c++)                                         \
+            acc[c] = (vec){0} + (float)c;                                             \
+        for (long i = 0; i < iterations; i++)                                         \
+        {                                                                             \
+            _Pragma("GCC unroll 12") for (int c = 0; c < PEAK_CHAINS; c++)            \
+                acc[c] = acc[c] * mul + add;                                          \
+        }                                                                             \
+        float total = 0;                                                              \
+        for (int c = 0; c < PEAK_CHAINS; c++)                                         \
+            for (int l = 0; l < (width); l++)                                         \
+                total += acc[c][l];                                                   \
+        return total;                                                                 \
+    }
+
+PEAK_LOOP(scalar, 1)
+
+#if defined(__x86_64__) || defined(__i386__)
+PEAK_LOOP(sse, 4)
+
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+PEAK_LOOP(avx2, 8)
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+PEAK_LOOP(avx512, 16)
+#pragma GCC pop_options
+#endif
+
+static volatile float sink;
+
+static void measure_peaks()
+{
+    float (*loop)(long) = peak_scalar;
+    int width = 1;
+#if defined(__x86_64__) || defined(__i386__)
+    if (strcmp(simd.name, "sse") == 0)
+        loop = peak_sse, width = 4;
+    else if (strcmp(simd.name, "avx2") == 0)
+        loop = peak_avx2, width = 8;
+    else if (strcmp(simd.name, "avx512") == 0)
+        loop = peak_avx512, width = 16;
+#endif
+
+    const long iterations = 1 << 22;
+    double best = INFINITY;
+    for (int trial = 0; trial < BENCH_TRIALS; trial++)
+    {
+        double start = now_seconds();
+        sink = loop(iterations);
+        double elapsed = now_seconds() - start;
+        best = elapsed < best ? elapsed : best;
+    }
+    peak_gflops = 2.0 * PEAK_CHAINS * width * iterations / best * 1e-9;
+
+    // Reading an array well past the last level cache
+    const int n = 1 << 24;
+    float *stream = allocate_vec_arr(n);
+    best = INFINITY;
+    for (int trial = 0; trial < BENCH_TRIALS; trial++)
+    {
+        double start = now_seconds();
+        sink = simd.sum(stream, n);
+        double elapsed = now_seconds() - start;
+        best = elapsed < best ? elapsed : best;
+    }
+    peak_gbps = (double)n * sizeof(float) / best * 1e-9;
+    free(stream);
+
+    result_t *result = add_result("peak", "fma", simd.name);
+    result->gflops = peak_gflops;
+    result = add_result("peak", "read", simd.name);
+    result->gbps = peak_gbps;
+    printf("peak %s: %.2f GFLOP/s, %.2f GB/s on one core\n\n", simd.name, peak_gflops, peak_gbps);
+}
+
+// out = op(a) * op(b), computed one dot product at a time in double
+static void reference_mat_mat(matrix_t *out, matrix_t *a, matrix_t *b, int trans_a, int trans_b)
+{
+    int k_len = trans_a ? a->row : a->col;
+    for (int i = 0; i < out->row; i++)
+    {
+        for (int j = 0; j < out->col; j++)
+        {
+            double sum = 0;
+            for (int k = 0; k < k_len; k++)
+            {
+                float a_val = trans_a ? a->arr[k * a->col + i] : a->arr[i * a->col + k];
+                float b_val = trans_b ? b->arr[j * b->col + k] : b->arr[k * b->col + j];
+                sum += (double)a_val * b_val;
+            }
+            out->arr[i * out->col + j] = (float)sum;
+        }
+    }
+}
+
+static int check_mat_mat(const char *name, int m, int n, int k, int trans_a, int trans_b)
+{
+    matrix_t a = trans_a ? init_matrix(k, m) : init_matrix(m, k);
+    matrix_t b = trans_b ? init_matrix(n, k) : init_matrix(k, n);
+    matrix_t out = init_matrix(m, n);
+    matrix_t expected = init_matrix(m, n);
+    fill_random(&a);
+    fill_random(&b);
+
+    if (trans_a)
+        multiply_matT_mat(&out, &a, &b);
+    else if (trans_b)
+        multiply_mat_matT(&out, &a, &b);
+    else
+        multiply_mat_mat(&out, &a, &b);
+    reference_mat_mat(&expected, &a, &b, trans_a, trans_b);
+
+    // Inputs are in [-1, 1), so the error of a length k dot product in
+    // float is bounded by roughly k * epsilon
+    float max_error = 0;
+    for (int i = 0; i < m * n; i++)
+    {
+        float error = fabsf(out.arr[i] - expected.arr[i]);
+        if (error > max_error)
+            max_error = error;
+    }
+    int passed = max_error <= k * 1.2e-7f * 4;
+    printf("%-8s %5d %5d %5d  max error %.3g  %s\n", name, m, n, k, max_error, passed ? "ok" : "FAILED");
+
+    free_matrix(&a);
+    free_matrix(&b);
+    free_matrix(&out);
+    free_matrix(&expected);
+
+    return passed;
+}
+
+// Operands of a kernel. Elementwise kernels see a, b and out as rows x cols
+// matrices, or x, y and v as vectors over the same floats. Products see a
+// and b laid out as the kernel reads them, and matrix-vector ones x and y
+// as inputs and v as the output, each as long as the kernel needs.
+typedef struct
+{
+    matrix_t a;
+    matrix_t b;
+    matrix_t out;
+    vector_t x;
+    vector_t y;
+    vector_t v;
+    // cols long
+    vector_t bias;
+    half_matrix_t half;
+    epilogue_t epilogue;
+} operands_t;
+
+typedef enum
+{
+    // rows x cols elements
+    SHAPE_ELEMENTWISE,
+    // v (m) = a (m x k) * x (k), or the outer product out (m x k) of
+    // y (m) and x (k)
+    SHAPE_MAT_VEC,
+    // out (m x n) = a (m x k) * b (k x n)
+    SHAPE_MAT_MAT
+} shape_t;
+
+typedef struct
+{
+    const char *name;
+    void (*run)(void *);
+    shape_t shape;
+    // Elementwise: flops per element, 0 for the transcendental ones, and
+    // floats moved per element
+    float flops;
+    float streams;
+    // Products: how a and b are stored, and b in fp16
+    int trans_a;
+    int trans_b;
+    int half;
+    activation_t activation;
+} kernel_t;
+
+#define OPS ((operands_t *)context)
+
+static void run_add_vec(void *context) { add_vec(&OPS->v, &OPS->x, &OPS->y); }
+static void run_subtract_vec(void *context) { subtract_vec(&OPS->v, &OPS->x, &OPS->y); }
+static void run_hadamard(void *context) { hadamard_product(&OPS->v, &OPS->x, &OPS->y); }
+static void run_scale_vec(void *context) { scalar_multiply_vec(&OPS->v, &OPS->x, 0.5f); }
+static void run_add_mat(void *context) { add_mat(&OPS->out, &OPS->a, &OPS->b); }
+static void run_subtract_mat(void *context) { subtract_mat(&OPS->out, &OPS->a, &OPS->b); }
+static void run_hadamard_mat(void *context) { hadamard_product_mat(&OPS->out, &OPS->a, &OPS->b); }
+static void run_scale_mat(void *context) { scalar_multiply_mat(&OPS->out, &OPS->a, 0.5f); }
+static void run_sigmoid(void *context) { sigmoid_vec_mode(&OPS->v, &OPS->x, SIGMOID_EXACT); }
+static void run_sigmoid_fast(void *context) { sigmoid_vec_mode(&OPS->v, &OPS->x, SIGMOID_FAST); }
+static void run_dsigmoid(void *context) { dsigmoid_vec(&OPS->v, &OPS->x); }
+static void run_dsigmoid_activated(void *context) { dsigmoid_activated_vec(&OPS->v, &OPS->x); }
+static void run_add_row_vec(void *context) { add_row_vec(&OPS->out, &OPS->a, &OPS->bias); }
+static void run_accumulate_rows(void *context) { accumulate_rows(&OPS->bias, &OPS->a); }
+static void run_transpose(void *context)
+{
+    matrix_t out = {OPS->out.arr, OPS->a.col, OPS->a.row};
+    transpose(&out, &OPS->a);
+}
+static void run_output_error(void *context) { output_error_mat(&OPS->out, &OPS->b, &OPS->a, ACTIVATION_SIGMOID); }
+static void run_softmax_error(void *context) { output_error_mat(&OPS->out, &OPS->b, &OPS->a, ACTIVATION_SOFTMAX); }
+static void run_quadratic_loss(void *context) { sink = quadratic_loss_mat(&OPS->a, &OPS->b); }
+// The logits are overwritten with the softmax, so every call after the
+// first sees probabilities, which costs the same
+static void run_cross_entropy(void *context) { sink = cross_entropy_mat(&OPS->out, &OPS->a, &OPS->b, SIGMOID_EXACT); }
+static void run_round_half(void *context)
+{
+    matrix_t mat = {OPS->a.arr, OPS->half.row, OPS->half.col};
+    round_half_matrix(&OPS->half, &mat);
+}
+
+static void run_mat_vec(void *context) { multiply_mat_vec(&OPS->v, &OPS->a, &OPS->x); }
+static void run_matT_vec(void *context) { multiply_matT_vec(&OPS->v, &OPS->a, &OPS->x); }
+static void run_half_vec(void *context) { multiply_half_vec(&OPS->v, &OPS->half, &OPS->x); }
+static void run_halfT_vec(void *context) { multiply_halfT_vec(&OPS->v, &OPS->half, &OPS->x); }
+static void run_mat_vec_epilogue(void *context) { multiply_mat_vec_epilogue(&OPS->v, &OPS->a, &OPS->x, &OPS->epilogue); }
+static void run_vec_vec(void *context) { multiply_vec_vec(&OPS->out, &OPS->y, &OPS->x); }
+static void run_accumulate_vec_vec(void *context) { accumulate_vec_vec(&OPS->out, &OPS->y, &OPS->x, 0.5f); }
+
+static void run_mat_mat(void *context) { multiply_mat_mat(&OPS->out, &OPS->a, &OPS->b); }
+static void run_mat_matT(void *context) { multiply_mat_matT(&OPS->out, &OPS->a, &OPS->b); }
+static void run_matT_mat(void *context) { multiply_matT_mat(&OPS->out, &OPS->a, &OPS->b); }
+static void run_mat_halfT(void *context) { multiply_mat_halfT(&OPS->out, &OPS->a, &OPS->half); }
+static void run_mat_half(void *context) { multiply_mat_half(&OPS->out, &OPS->a, &OPS->half); }
+static void run_mat_matT_epilogue(void *context) { multiply_mat_matT_epilogue(&OPS->out, &OPS->a, &OPS->b, &OPS->epilogue); }
+static void run_accumulate_matT_mat(void *context) { accumulate_matT_mat(&OPS->out, &OPS->a, &OPS->b, 0.5f); }
+
+static const kernel_t kernels[] = {
+    {"add_vec", run_add_vec, SHAPE_ELEMENTWISE, 1, 3},
+    {"subtract_vec", run_subtract_vec, SHAPE_ELEMENTWISE, 1, 3},
+    {"hadamard_product", run_hadamard, SHAPE_ELEMENTWISE, 1, 3},
+    {"scalar_multiply_vec", run_scale_vec, SHAPE_ELEMENTWISE, 1, 2},
+    {"add_mat", run_add_mat, SHAPE_ELEMENTWISE, 1, 3},
+    {"subtract_mat", run_subtract_mat, SHAPE_ELEMENTWISE, 1, 3},
+    {"hadamard_product_mat", run_hadamard_mat, SHAPE_ELEMENTWISE, 1, 3},
+    {"scalar_multiply_mat", run_scale_mat, SHAPE_ELEMENTWISE, 1, 2},
+    {"sigmoid", run_sigmoid, SHAPE_ELEMENTWISE, 0, 2},
+    {"sigmoid_fast", run_sigmoid_fast, SHAPE_ELEMENTWISE, 0, 2},
+    {"dsigmoid", run_dsigmoid, SHAPE_ELEMENTWISE, 0, 2},
+    {"dsigmoid_activated", run_dsigmoid_activated, SHAPE_ELEMENTWISE, 2, 2},
+    {"add_row_vec", run_add_row_vec, SHAPE_ELEMENTWISE, 1, 2},
+    {"accumulate_rows", run_accumulate_rows, SHAPE_ELEMENTWISE, 1, 1},
+    {"transpose", run_transpose, SHAPE_ELEMENTWISE, 0, 2},
+    {"output_error sigmoid", run_output_error, SHAPE_ELEMENTWISE, 3, 3},
+    {"output_error softmax", run_softmax_error, SHAPE_ELEMENTWISE, 0, 3},
+    {"quadratic_loss", run_quadratic_loss, SHAPE_ELEMENTWISE, 3, 2},
+    {"cross_entropy", run_cross_entropy, SHAPE_ELEMENTWISE, 0, 4},
+    {"round_half fp16", run_round_half, SHAPE_ELEMENTWISE, 0, 1.5f},
+
+    {"mat*vec", run_mat_vec, SHAPE_MAT_VEC},
+    {"mat^T*vec", run_matT_vec, SHAPE_MAT_VEC, 0, 0, 1},
+    {"half*vec fp16", run_half_vec, SHAPE_MAT_VEC, 0, 0, 0, 0, 1},
+    {"half^T*vec fp16", run_halfT_vec, SHAPE_MAT_VEC, 0, 0, 1, 0, 1},
+    {"mat*vec+relu", run_mat_vec_epilogue, SHAPE_MAT_VEC, 0, 0, 0, 0, 0, ACTIVATION_RELU},
+    {"vec*vec^T", run_vec_vec, SHAPE_MAT_VEC},
+    {"accumulate_vec_vec", run_accumulate_vec_vec, SHAPE_MAT_VEC},
+
+    {"A*B", run_mat_mat, SHAPE_MAT_MAT},
+    {"A*B^T", run_mat_matT, SHAPE_MAT_MAT, 0, 0, 0, 1},
+    {"A^T*B", run_matT_mat, SHAPE_MAT_MAT, 0, 0, 1, 0},
+    {"A*H^T fp16", run_mat_halfT, SHAPE_MAT_MAT, 0, 0, 0, 1, 1},
+    {"A*H fp16", run_mat_half, SHAPE_MAT_MAT, 0, 0, 0, 0, 1},
+    {"A*B^T+sigmoid", run_mat_matT_epilogue, SHAPE_MAT_MAT, 0, 0, 0, 1, 0, ACTIVATION_SIGMOID},
+    {"A*B^T+relu", run_mat_matT_epilogue, SHAPE_MAT_MAT, 0, 0, 0, 1, 0, ACTIVATION_RELU},
+    {"A*B^T+softmax", run_mat_matT_epilogue, SHAPE_MAT_MAT, 0, 0, 0, 1, 0, ACTIVATION_SOFTMAX},
+    {"C+=A^T*B", run_accumulate_matT_mat, SHAPE_MAT_MAT, 0, 0, 1, 0},
+};
+
+// rows x cols: in L1, in L2 and out in memory
+static const int elementwise_sizes[][2] = {{64, 16}, {64, 1024}, {1024, 4096}};
+// m x k: the layers of the two networks, and one past the caches
+static const int mat_vec_sizes[][2] = {{30, 784}, {128, 784}, {10, 128}, {2048, 2048}};
+// m x n x k: odd sizes for the partial tiles, then the layers of
+// 784-128-128-10 at the benchmark batch size, forward and backward
+static const int mat_mat_sizes[][3] = {
+    {7, 13, 5},
+    {67, 45, 301},
+    {64, 128, 784},
+    {64, 10, 128},
+    {128, 784, 64},
+    {512, 512, 512},
+};
+
+#define COUNT(array) ((int)(sizeof(array) / sizeof(array[0])))
+
+static void bench_kernel(const kernel_t *kernel, int m, int n, int k)
+{
+    operands_t ops;
+    memset(&ops, 0, sizeof(ops));
+    char shape[40];
+    double flops;
+    double bytes;
+    int b_size = kernel->half ? 2 : 4;
+
+    switch (kernel->shape)
+    {
+    case SHAPE_ELEMENTWISE:
+        ops.a = init_matrix(m, n);
+        ops.b = init_matrix(m, n);
+        ops.out = init_matrix(m, n);
+        ops.bias = init_vector(n);
+        ops.half = init_half_matrix(m, n, PRECISION_FP16);
+        snprintf(shape, sizeof(shape), "%dx%d", m, n);
+        flops = (double)kernel->flops * m * n;
+        bytes = (double)kernel->streams * sizeof(float) * m * n;
+        break;
+    case SHAPE_MAT_VEC:
+        ops.a = init_matrix(m, k);
+        ops.out = init_matrix(m, k);
+        ops.half = init_half_matrix(m, k, PRECISION_FP16);
+        // The transposed products read m floats and write k
+        ops.x = init_vector(kernel->trans_a ? m : k);
+        ops.y = init_vector(m);
+        ops.v = init_vector(kernel->trans_a ? k : m);
+        for (int i = 0; i < ops.x.len; i++)
+            ops.x.arr[i] = (float)rand() / RAND_MAX;
+        for (int i = 0; i < ops.y.len; i++)
+            ops.y.arr[i] = (float)rand() / RAND_MAX;
+        snprintf(shape, sizeof(shape), "%dx%d", m, k);
+        flops = 2.0 * m * k;
+        bytes = (double)b_size * m * k + sizeof(float) * (m + k);
+        if (kernel->run == run_vec_vec)
+            flops = (double)m * k;
+        break;
+    default:
+        ops.a = kernel->trans_a ? init_matrix(k, m) : init_matrix(m, k);
+        ops.b = kernel->trans_b ? init_matrix(n, k) : init_matrix(k, n);
+        ops.out = init_matrix(m, n);
+        ops.half = kernel->trans_b ? init_half_matrix(n, k, PRECISION_FP16) : init_half_matrix(k, n, PRECISION_FP16);
+        ops.bias = init_vector(n);
+        snprintf(shape, sizeof(shape), "%dx%dx%d", m, n, k);
+        flops = 2.0 * m * n * k;
+        bytes = sizeof(float) * ((double)m * k + (double)m * n) + (double)b_size * n * k;
+        break;
+    }
+    if (kernel->shape != SHAPE_MAT_MAT && kernel->run == run_accumulate_vec_vec)
+        bytes += sizeof(float) * (double)m * k;
+
+    fill_random(&ops.a);
+    if (ops.b.arr != NULL)
+        fill_random(&ops.b);
+    if (ops.half.arr != NULL)
+    {
+        matrix_t source = {ops.a.arr, ops.half.row, ops.half.col};
+        if (kernel->shape == SHAPE_MAT_MAT)
+            source.arr = ops.b.arr;
+        round_half_matrix(&ops.half, &source);
+    }
+    if (kernel->shape == SHAPE_ELEMENTWISE)
+    {
+        ops.x = (vector_t){ops.a.arr, m * n};
+        ops.y = (vector_t){ops.b.arr, m * n};
+        ops.v = (vector_t){ops.out.arr, m * n};
+    }
+    ops.epilogue = (epilogue_t){kernel->activation, SIGMOID_EXACT, ops.bias.arr, NULL};
+
+    double seconds = time_calls(kernel->run, &ops);
+    result_t *result = add_result("kernel", kernel->name, shape);
+    result->seconds = seconds;
+    result->gflops = flops / seconds * 1e-9;
+    result->gbps = bytes / seconds * 1e-9;
+    printf("%-22s %-14s %10.3f us %9.2f GFLOP/s %6.1f%% %8.2f GB/s %6.1f%%\n", kernel->name, shape, seconds * 1e6,
+           result->gflops, 100 * result->gflops / peak_gflops, result->gbps, 100 * result->gbps / peak_gbps);
+
+    free_matrix(&ops.a);
+    if (ops.b.arr != NULL)
+        free_matrix(&ops.b);
+    free_matrix(&ops.out);
+    if (ops.bias.arr != NULL)
+        free_vector(&ops.bias);
+    if (kernel->shape == SHAPE_MAT_VEC)
+    {
+        free_vector(&ops.x);
+        free_vector(&ops.y);
+        free_vector(&ops.v);
+    }
+    free_half_matrix(&ops.half);
+}
+
+// A network and a synthetic dataset to time it on
+typedef struct
+{
+    neural_net_t net;
+    matrix_t inputs;
+    matrix_t expected;
+    vector_t sample_expected;
+    batch_layer_t *batch;
+    matrix_t batch_expected;
+    model_t model;
+    exec_context_t context;
+    matrix_t predict_inputs;
+    matrix_t predict_outputs;
+} network_bench_t;
+
+#define NETWORK ((network_bench_t *)context)
+
+static void run_forward_pass(void *context) { forward_pass(&NETWORK->net); }
+static void run_backward_pass(void *context) { sink = backward_pass(&NETWORK->net, &NETWORK->sample_expected); }
+static void run_forward_pass_batch(void *context) { forward_pass_batch(&NETWORK->net, NETWORK->batch); }
+static void run_backward_pass_batch(void *context)
+{
+    sink = backward_pass_batch(&NETWORK->net, NETWORK->batch, &NETWORK->batch_expected);
+}
+
+// Flops of a sample through the weights of layers from on. The forward
+// pass and the gradients go through every layer, the errors stop short of
+// the first.
+static double product_flops(neural_net_t *net, int from)
+{
+    double flops = 0;
+    for (int i = from; i < net->num_layers; i++)
+    {
+        flops += 2.0 * net->layers[i].length * net->layers[i - 1].length;
+    }
+    return flops;
+}
+
+static int bench_threads()
+{
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+static void add_pass(network_bench_t *bench, const char *name, const char *topology, void (*run)(void *),
+                     int samples, double flops)
+{
+    double seconds = time_calls(run, bench);
+    result_t *result = add_result("pass", name, topology);
+    result->seconds = seconds;
+    result->gflops = flops * samples / seconds * 1e-9;
+    result->samples_per_second = samples / seconds;
+    printf("%-22s %-14s %10.3f us %9.2f GFLOP/s %6.1f%% %11.0f samples/s\n", name, topology, seconds * 1e6,
+           result->gflops, 100 * result->gflops / peak_gflops, result->samples_per_second);
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void bench_latency(network_bench_t *bench, const char *topology, int batch_size, int calls)
+{
+    double *latencies = (double *)allocate_bytes(sizeof(double) * calls);
+    bench->predict_inputs.row = batch_size;
+    bench->predict_outputs.row = batch_size;
+    bench->predict_inputs.arr = bench->inputs.arr;
+
+    predict_batch(&bench->model, &bench->context, &bench->predict_inputs, &bench->predict_outputs);
+    for (int i = 0; i < calls; i++)
+    {
+        // A different slice of the inputs each call, as a server would see
+        bench->predict_inputs.arr = &bench->inputs.arr[(size_t)(i * batch_size % (bench->inputs.row - batch_size)) * bench->inputs.col];
+        double start = now_seconds();
+        predict_batch(&bench->model, &bench->context, &bench->predict_inputs, &bench->predict_outputs);
+        latencies[i] = (now_seconds() - start) * 1e6;
+    }
+    qsort(latencies, calls, sizeof(double), compare_doubles);
+
+    char name[40];
+    snprintf(name, sizeof(name), "predict_batch %d", batch_size);
+    result_t *result = add_result("latency", name, topology);
+    double total = 0;
+    for (int i = 0; i < calls; i++)
+        total += latencies[i];
+    result->seconds = total / calls * 1e-6;
+    result->samples_per_second = batch_size / result->seconds;
+    result->p50 = latencies[calls / 2];
+    result->p90 = latencies[calls * 9 / 10];
+    result->p99 = latencies[calls * 99 / 100];
+    result->max = latencies[calls - 1];
+    printf("%-22s %-14s p50 %8.2f us  p90 %8.2f us  p99 %8.2f us  max %8.2f us\n", name, topology, result->p50,
+           result->p90, result->p99, result->max);
+    free(latencies);
+}
+
+static void bench_network(const int *sizes, int num_layers, int epoch_samples)
+{
+    network_bench_t bench;
+    char topology[40] = "";
+    for (int i = 0; i < num_layers; i++)
+    {
+        snprintf(topology + strlen(topology), sizeof(topology) - strlen(topology), i ? "-%d" : "%d", sizes[i]);
+    }
+
+    // Set up the way main.c trains
+    bench.net = allocate_neural_net(num_layers, (int *)sizes, SIGMOID_FAST);
+    for (int i = 1; i < num_layers - 1; i++)
+        init_activation(&bench.net, i, ACTIVATION_RELU);
+    set_loss(&bench.net, LOSS_CROSS_ENTROPY);
+
+    int outputs = sizes[num_layers - 1];
+    bench.inputs = init_matrix(epoch_samples, sizes[0]);
+    bench.expected = init_matrix(epoch_samples, outputs);
+    for (int i = 0; i < epoch_samples * sizes[0]; i++)
+        bench.inputs.arr[i] = (float)rand() / RAND_MAX;
+    for (int i = 0; i < epoch_samples; i++)
+        bench.expected.arr[i * outputs + rand() % outputs] = 1;
+
+    // One sample
+    memcpy(bench.net.layers[0].activated_outputs.arr, bench.inputs.arr, sizes[0] * sizeof(float));
+    bench.sample_expected = (vector_t){bench.expected.arr, outputs};
+    forward_pass(&bench.net);
+    add_pass(&bench, "forward_pass", topology, run_forward_pass, 1, product_flops(&bench.net, 1));
+    add_pass(&bench, "backward_pass", topology, run_backward_pass, 1, product_flops(&bench.net, 2));
+
+    // One batch on one worker
+    reserve_workspace(&bench.net, BENCH_BATCH, 1);
+    bench.batch = bench.net.workspace.workers[0].batch;
+    set_batch_rows(&bench.net, bench.batch, BENCH_BATCH);
+    bench.batch[0].activated_outputs.arr = bench.inputs.arr;
+    bench.batch_expected = (matrix_t){bench.expected.arr, BENCH_BATCH, outputs};
+    forward_pass_batch(&bench.net, bench.batch);
+    add_pass(&bench, "forward_pass_batch", topology, run_forward_pass_batch, BENCH_BATCH, product_flops(&bench.net, 1));
+    add_pass(&bench, "backward_pass_batch", topology, run_backward_pass_batch, BENCH_BATCH,
+             product_flops(&bench.net, 2));
+
+    // A whole epoch of train_step() on every thread, as train_dataset()
+    // runs it less the data pipeline
+    int workers = bench_threads() < BENCH_BATCH ? bench_threads() : BENCH_BATCH;
+    reserve_workspace(&bench.net, BENCH_BATCH, workers);
+    matrix_t step_inputs = {NULL, 0, sizes[0]};
+    matrix_t step_expected = {NULL, 0, outputs};
+    double best = INFINITY;
+    for (int trial = 0; trial < 3; trial++)
+    {
+        double start = now_seconds();
+        for (int j = 0; j < epoch_samples; j += BENCH_BATCH)
+        {
+            int rows = epoch_samples - j < BENCH_BATCH ? epoch_samples - j : BENCH_BATCH;
+            step_inputs.arr = &bench.inputs.arr[(size_t)j * sizes[0]];
+            step_inputs.row = rows;
+            step_expected.arr = &bench.expected.arr[(size_t)j * outputs];
+            step_expected.row = rows;
+            sink = train_step(&bench.net, &step_inputs, &step_expected, 0.001f);
+        }
+        double elapsed = now_seconds() - start;
+        best = elapsed < best ? elapsed : best;
+    }
+    char name[40];
+    snprintf(name, sizeof(name), "train_step x%d threads", workers);
+    result_t *result = add_result("epoch", name, topology);
+    result->seconds = best;
+    result->samples_per_second = epoch_samples / best;
+    result->gflops = (2 * product_flops(&bench.net, 1) + product_flops(&bench.net, 2)) * epoch_samples / best * 1e-9;
+    printf("%-22s %-14s %10.3f ms %9.2f GFLOP/s %6.1f%% %11.0f samples/s\n", name, topology, best * 1e3,
+           result->gflops, 100 * result->gflops / (peak_gflops * workers), result->samples_per_second);
+
+    // Predictions one sample and one batch at a time
+    bench.model = model_view(&bench.net);
+    init_context(&bench.context, &bench.model, BENCH_BATCH);
+    bench.predict_inputs = (matrix_t){bench.inputs.arr, 1, sizes[0]};
+    bench.predict_outputs = init_matrix(BENCH_BATCH, outputs);
+    bench_latency(&bench, topology, 1, LATENCY_CALLS);
+    bench_latency(&bench, topology, BENCH_BATCH, LATENCY_CALLS / 4);
+
+    free_matrix(&bench.predict_outputs);
+    free_context(&bench.context);
+    close_model(&bench.model);
+    free_matrix(&bench.inputs);
+    free_matrix(&bench.expected);
+    free_network(&bench.net);
+}
+
+static void write_json(const char *path, const char *label)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+    {
+        fprintf(stderr, "couldn't write %s\n", path);
+        return;
+    }
+    fprintf(file, "{\n  \"label\": \"%s\",\n  \"isa\": \"%s\",\n  \"threads\": %d,\n", label, simd.name,
+            bench_threads());
+    fprintf(file, "  \"peak_gflops\": %.4f,\n  \"peak_gbps\": %.4f,\n  \"results\": [\n", peak_gflops, peak_gbps);
+    for (int i = 0; i < num_results; i++)
+    {
+        result_t *r = &results[i];
+        fprintf(file,
+                "    {\"group\": \"%s\", \"name\": \"%s\", \"shape\": \"%s\", \"seconds\": %.9g, \"gflops\": %.4f, "
+                "\"gbps\": %.4f, \"samples_per_second\": %.1f, \"p50_us\": %.3f, \"p90_us\": %.3f, "
+                "\"p99_us\": %.3f, \"max_us\": %.3f}%s\n",
+                r->group, r->name, r->shape, r->seconds, r->gflops, r->gbps, r->samples_per_second, r->p50, r->p90,
+                r->p99, r->max, i + 1 < num_results ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    fclose(file);
+}
+
+// One row per result, with the label and instruction set on every row so
+// the files of several commits can be concatenated
+static void write_csv(const char *path, const char *label)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+    {
+        fprintf(stderr, "couldn't write %s\n", path);
+        return;
+    }
+    fprintf(file, "label,isa,group,name,shape,seconds,gflops,gbps,pct_peak_gflops,pct_peak_gbps,"
+                  "samples_per_second,p50_us,p90_us,p99_us,max_us\n");
+    for (int i = 0; i < num_results; i++)
+    {
+        result_t *r = &results[i];
+        fprintf(file, "%s,%s,%s,%s,%s,%.9g,%.4f,%.4f,%.2f,%.2f,%.1f,%.3f,%.3f,%.3f,%.3f\n", label, simd.name,
+                r->group, r->name, r->shape, r->seconds, r->gflops, r->gbps, 100 * r->gflops / peak_gflops,
+                100 * r->gbps / peak_gbps, r->samples_per_second, r->p50, r->p90, r->p99, r->max);
+    }
+    fclose(file);
+}
+
+int main(int argc, char **argv)
+{
+    const char *json = NULL;
+    const char *csv = NULL;
+    const char *label = "";
+    int epoch_samples = EPOCH_SAMPLES;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--json") == 0 && i + 1 < argc)
+            json = argv[++i];
+        else if (strcmp(argv[i], "--csv") == 0 && i + 1 < argc)
+            csv = argv[++i];
+        else if (strcmp(argv[i], "--label") == 0 && i + 1 < argc)
+            label = argv[++i];
+        else if (strcmp(argv[i], "--quick") == 0)
+        {
+            budget = 0.02;
+            epoch_samples = 1024;
+        }
+        else
+        {
+            fprintf(stderr, "usage: %s [--json file] [--csv file] [--label text] [--quick]\n", argv[0]);
+            return -1;
+        }
+    }
+
+    int failed = 0;
+    srand(1);
+    printf("kernel       m     n     k\n");
+    for (int i = 0; i < COUNT(mat_mat_sizes); i++)
+    {
+        int m = mat_mat_sizes[i][0], n = mat_mat_sizes[i][1], k = mat_mat_sizes[i][2];
+        failed += !check_mat_mat("A*B", m, n, k, 0, 0);
+        failed += !check_mat_mat("A*B^T", m, n, k, 0, 1);
+        failed += !check_mat_mat("A^T*B", m, n, k, 1, 0);
+    }
+    printf("\n");
+
+    measure_peaks();
+
+    for (int i = 0; i < COUNT(kernels); i++)
+    {
+        const kernel_t *kernel = &kernels[i];
+        if (kernel->shape == SHAPE_ELEMENTWISE)
+        {
+            for (int s = 0; s < COUNT(elementwise_sizes); s++)
+                bench_kernel(kernel, elementwise_sizes[s][0], elementwise_sizes[s][1], 0);
+        }
+        else if (kernel->shape == SHAPE_MAT_VEC)
+        {
+            for (int s = 0; s < COUNT(mat_vec_sizes); s++)
+                bench_kernel(kernel, mat_vec_sizes[s][0], 0, mat_vec_sizes[s][1]);
+        }
+        else
+        {
+            for (int s = 0; s < COUNT(mat_mat_sizes); s++)
+                bench_kernel(kernel, mat_mat_sizes[s][0], mat_mat_sizes[s][1], mat_mat_sizes[s][2]);
+        }
+    }
+    printf("\n");
+
+    // The topologies of the networks checked in next to main.c
+    const int small[] = {784, 30, 10};
+    const int large[] = {784, 128, 128, 10};
+    bench_network(small, COUNT(small), epoch_samples);
+    printf("\n");
+    bench_network(large, COUNT(large), epoch_samples);
+
+    if (json != NULL)
+        write_json(json, label);
+    if (csv != NULL)
+        write_csv(csv, label);
+
+    return failed != 0;
+}
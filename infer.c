@@ -0,0 +1,127 @@
+#include "nnInference.h"
+#include "nnModel.h"
+#include <time.h>
+
+// Runs a test set through a trained model and reports its accuracy, its
+// throughput and the latency of each batch. The model is shared by every
+// thread, each predicting its batches with its own context. --verify checks
+// the model's CRC before it is used.
+//
+// usage: infer [--verify] model.nnm test-images test-labels [batch size]
+
+#define DEFAULT_BATCH_SIZE 256
+
+static double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static int count_correct(matrix_t *outputs, dataset_t *set)
+{
+    int sum = 0;
+    for (int i = 0; i < outputs->row; i++)
+    {
+        float *row = &outputs->arr[(size_t)i * outputs->col];
+        int max_index = 0;
+        for (int j = 0; j < outputs->col; j++)
+        {
+            if (row[j] > row[max_index])
+                max_index = j;
+        }
+        sum += max_index == dataset_label(set, i);
+    }
+    return sum;
+}
+
+int main(int argc, char **argv)
+{
+    int verify = argc > 1 && strcmp(argv[1], "--verify") == 0;
+    if (verify)
+    {
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
+    if (argc < 4)
+    {
+        fprintf(stderr, "usage: %s [--verify] model.nnm test-images test-labels [batch size]\n", argv[0]);
+        exit(-1);
+    }
+    int batch_size = argc > 4 ? atoi(argv[4]) : DEFAULT_BATCH_SIZE;
+    if (batch_size < 1)
+    {
+        fprintf(stderr, "batch size must be at least 1\n");
+        exit(-1);
+    }
+
+    model_t model;
+    dataset_t test_set;
+    if ((verify && verify_model(argv[1]) == -1) || open_model(&model, argv[1]) == -1 || load_dataset(&test_set, argv[2], argv[3], 0) == -1)
+    {
+        exit(-1);
+    }
+    int outputs = model.lengths[model.num_layers - 1];
+    if (test_set.features != model.lengths[0] || test_set.num_classes > outputs)
+    {
+        fprintf(stderr, "dataset shape doesn't match the model\n");
+        exit(-1);
+    }
+
+    matrix_t inputs = init_matrix(test_set.count, test_set.features);
+    matrix_t predictions = init_matrix(test_set.count, outputs);
+    gather_inputs(&test_set, 0, test_set.count, &inputs);
+
+    int num_batches = (test_set.count + batch_size - 1) / batch_size;
+    double *latencies = (double *)allocate_bytes(sizeof(double) * num_batches);
+    int threads = 1;
+
+    double start = now_seconds();
+    #pragma omp parallel
+    {
+        exec_context_t context;
+        init_context(&context, &model, batch_size);
+#ifdef _OPENMP
+        #pragma omp single
+        threads = omp_get_num_threads();
+#endif
+
+        #pragma omp for schedule(dynamic)
+        for (int b = 0; b < num_batches; b++)
+        {
+            int first = b * batch_size;
+            int rows = test_set.count - first < batch_size ? test_set.count - first : batch_size;
+            matrix_t batch_inputs = {&inputs.arr[(size_t)first * inputs.col], rows, inputs.col};
+            matrix_t batch_outputs = {&predictions.arr[(size_t)first * outputs], rows, outputs};
+
+            double batch_start = now_seconds();
+            predict_batch(&model, &context, &batch_inputs, &batch_outputs);
+            latencies[b] = (now_seconds() - batch_start) * 1e6;
+        }
+
+        free_context(&context);
+    }
+    double elapsed = now_seconds() - start;
+
+    qsort(latencies, num_batches, sizeof(double), compare_doubles);
+    printf("Accuracy: %d / %d\n", count_correct(&predictions, &test_set), test_set.count);
+    printf("%.0f samples/s on %d threads, batches of %d\n", test_set.count / elapsed, threads, batch_size);
+    printf("Batch latency p50 %.1f us, p90 %.1f us, p99 %.1f us, max %.1f us\n", latencies[num_batches / 2],
+           latencies[num_batches * 9 / 10], latencies[num_batches * 99 / 100], latencies[num_batches - 1]);
+
+    free(latencies);
+    free_matrix(&inputs);
+    free_matrix(&predictions);
+    free_dataset(&test_set);
+    close_model(&model);
+
+    return 0;
+}
@@ -1,96 +1,145 @@
 #include "NeuralNet.h"
+#include "nnCheckpoint.h"
+#include "nnOptimizer.h"
+#include "nnSchedule.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
-#include "dataset.h"
-#include "mnist.h"
 
-void load_mnist_matrix_vector(matrix_t *x_train, matrix_t *y_train, matrix_t *x_test, matrix_t *y_test)
+// default paths, any IDX dataset can be given on the command line instead
+#define TRAIN_IMAGE "./data/train-images.idx3-ubyte"
+#define TRAIN_LABEL "./data/train-labels.idx1-ubyte"
+#define TEST_IMAGE "./data/t10k-images.idx3-ubyte"
+#define TEST_LABEL "./data/t10k-labels.idx1-ubyte"
+
+#define MAX_LAYERS 16
+
+// Fixed so that runs visit the samples in the same order
+#define SAMPLE_SEED 1
+
+#define EPOCHS 10
+#define BATCH_SIZE 10
+// Any activation_t, for the hidden layers and the output layer
+#define HIDDEN_ACTIVATION ACTIVATION_RELU
+#define OUTPUT_ACTIVATION ACTIVATION_SOFTMAX
+// LOSS_QUADRATIC, or LOSS_CROSS_ENTROPY, which makes the output softmax
+#define LOSS LOSS_CROSS_ENTROPY
+// A sigmoid network wants a learning rate around 3.0 with plain SGD,
+// OPTIMIZER_SGD, and around 0.3 with Nesterov, a cross-entropy one around
+// 0.05 and 0.01. RMSProp and Adam want around 0.001.
+#define OPTIMIZER OPTIMIZER_NESTEROV
+#define LEARNING_RATE 0.01
+// SCHEDULE_CONSTANT, SCHEDULE_STEP, SCHEDULE_COSINE or SCHEDULE_PLATEAU
+#define SCHEDULE SCHEDULE_COSINE
+#define WARMUP_EPOCHS 1
+// Epochs without a better test accuracy before training stops and rolls
+// back to the best one, 0 trains every epoch
+#define PATIENCE 3
+#define CHECKPOINT_DIR "./checkpoints"
+#define CHECKPOINTS_KEPT 3
+// PRECISION_FP16 or PRECISION_BF16 trains on half weights over float ones
+#define PRECISION PRECISION_F32
+
+///*
+// usage: main [train-images train-labels test-images test-labels [hidden layer sizes...]]
+// The input and output layer sizes come from the dataset.
+int main(int argc, char **argv)
 {
-    for (int i = 0; i < NUM_TRAIN; i++)
+    srand(time(NULL));
+
+    const char *paths[4] = {TRAIN_IMAGE, TRAIN_LABEL, TEST_IMAGE, TEST_LABEL};
+    int sizes[MAX_LAYERS] = {0, 30};
+    int num_layers = 3;
+
+    if (argc > 1 && argc < 5)
     {
-        for (int j = 0; j < SIZE; j++)
-        {
-            x_train->arr[i * SIZE + j] = train_image[i][j];
-        }
+        fprintf(stderr, "usage: %s [train-images train-labels test-images test-labels [hidden sizes...]]\n", argv[0]);
+        exit(-1);
     }
-
-    for (int i = 0; i < NUM_TEST; i++)
+    if (argc >= 5)
     {
-        for (int j = 0; j < SIZE; j++)
-        {
-            x_test->arr[i * SIZE + j] = test_image[i][j];
-        }
+        for (int i = 0; i < 4; i++)
+            paths[i] = argv[i + 1];
     }
-
-    for (int i = 0; i < NUM_TRAIN; i++)
+    if (argc > 5)
     {
-        for (int j = 0; j < 10; j++)
-        {
-            if(train_label[i] == j)
-            {
-                y_train->arr[i * 10 + j] = 1;
-            }
-            else
-            {
-                y_train->arr[i * 10 + j] = 0;
-            }
-        }
+        num_layers = 2;
+        for (int i = 5; i < argc && num_layers < MAX_LAYERS; i++)
+            sizes[num_layers++ - 1] = atoi(argv[i]);
     }
 
-    for (int i = 0; i < NUM_TEST; i++)
+    dataset_t train_set;
+    dataset_t test_set;
+    if (load_dataset(&train_set, paths[0], paths[1], 0) == -1 ||
+        load_dataset(&test_set, paths[2], paths[3], 0) == -1)
     {
-        for (int j = 0; j < 10; j++)
-        {
-            if(test_label[i] == j)
-            {
-                y_test->arr[i * 10 + j] = 1;
-            }
-            else
-            {
-                y_test->arr[i * 10 + j] = 0;
-            }
-        }
+        exit(-1);
     }
-}
+    printf("Loaded %d training and %d test samples\n", train_set.count, test_set.count);
 
-///*
-int main()
-{
-    srand(time(NULL));
+    sizes[0] = train_set.features;
+    sizes[num_layers - 1] = train_set.num_classes > test_set.num_classes ? train_set.num_classes : test_set.num_classes;
+    train_set.num_classes = test_set.num_classes = sizes[num_layers - 1];
 
-    int sizes[] = {784, 30, 10};
+    checkpointer_t checkpoints;
+    init_checkpointer(&checkpoints, CHECKPOINT_DIR, "testTest", CHECKPOINTS_KEPT);
+    training_state_t state = {0, LEARNING_RATE};
 
-    load_mnist();
-
-    neural_net_t net = allocate_neural_net(sizeof(sizes) / sizeof(int), sizes);
-
-    printf("Allocated Network\n");
+    // Carry on from the last checkpoint of the same topology, if any
+    neural_net_t net;
+    int loaded = resume_checkpoint(&checkpoints, &net, &state) == 0;
+    int resumed = loaded;
+    for (int i = 0; resumed && i < num_layers; i++)
+    {
+        resumed = net.num_layers == num_layers && net.layers[i].length == sizes[i];
+    }
+    if (resumed)
+    {
+        net.sigmoid_mode = SIGMOID_FAST;
+        printf("Resuming after epoch %d\n", state.epoch);
+    }
+    else
+    {
+        if (loaded)
+            free_network(&net);
+        state = (training_state_t){0, LEARNING_RATE};
+        net = allocate_neural_net(num_layers, sizes, SIGMOID_FAST);
+        for (int i = 1; i < num_layers; i++)
+            init_activation(&net, i, i == num_layers - 1 ? OUTPUT_ACTIVATION : HIDDEN_ACTIVATION);
+        printf("Allocated Network\n");
+    }
 
-    // TODO: Shuffle data
-    matrix_t x_train = init_matrix(NUM_TRAIN, SIZE);
-    matrix_t y_train = init_matrix(NUM_TRAIN, 10);
+    // Checkpoints hold the float weights, so a resumed run is put back
+    set_precision(&net, PRECISION);
+    set_loss(&net, LOSS);
 
-    matrix_t x_test = init_matrix(NUM_TEST, SIZE);
-    matrix_t y_test = init_matrix(NUM_TRAIN, 10);
+    optimizer_t optimizer;
+    init_optimizer(&optimizer, &net, OPTIMIZER);
+    net.optimizer = &optimizer;
+    if (resumed && restore_optimizer(&optimizer, &net) == -1)
+        printf("The checkpoint has no matching optimizer state, starting it afresh\n");
 
-    matrix_t test_input = init_matrix(1, SIZE);
-    matrix_t test_output = init_matrix(1, 10);
+    schedule_t schedule;
+    init_schedule(&schedule, SCHEDULE, LEARNING_RATE);
+    schedule.warmup_epochs = WARMUP_EPOCHS;
+    schedule.patience = PATIENCE;
 
-    load_mnist_matrix_vector(&x_train, &y_train, &x_test, &y_test);
-    printf("Loaded MNIST\n");
+    sampler_t sampler;
+    init_sampler(&sampler, &train_set, SAMPLE_SHUFFLE, SAMPLE_SEED, NULL);
 
     printf("\nTraining...\n");
-    train(&net, &x_train, &y_train, 10, 10, 3.0, &x_test, &y_test, "testTest");
+    train_dataset(&net, &train_set, &test_set, &sampler, &state, EPOCHS, BATCH_SIZE, &checkpoints, &schedule);
+    printf("Testing network...\n");
+    printf("Accuracy: %d / %d\n", test_dataset(&net, &test_set), test_set.count);
+    save_network(&net, "testTest");
     printf("Trained\n");
 
+    free_checkpointer(&checkpoints);
+    free_optimizer(&optimizer);
+    free_sampler(&sampler);
     free_network(&net);
-    free_matrix(&x_train);
-    free_matrix(&y_train);
-    free_matrix(&x_test);
-    free_matrix(&y_test);
-    free_matrix(&test_input);
-    free_matrix(&test_output);
+    free_dataset(&train_set);
+    free_dataset(&test_set);
 
     printf("freed\n");
 
@@ -101,34 +150,26 @@ int main()
 int main()
 {
     srand(time(NULL));
-    load_mnist();
-
-    neural_net_t net;
-
-    load_network(&net, "784-128-128-10-testTest.pickl");
 
-    matrix_t x_train = init_matrix(NUM_TRAIN, SIZE);
-    matrix_t y_train = init_matrix(NUM_TRAIN, 10);
-
-    matrix_t x_test = init_matrix(NUM_TEST, SIZE);
-    matrix_t y_test = init_matrix(NUM_TRAIN, 10);
+    dataset_t test_set;
+    if (load_dataset(&test_set, TEST_IMAGE, TEST_LABEL, 0) == -1)
+    {
+        exit(-1);
+    }
+    printf("Loaded %d test samples\n", test_set.count);
 
-    matrix_t test_input = init_matrix(1, SIZE);
-    matrix_t test_output = init_matrix(1, 10);
+    neural_net_t net;
 
-    load_mnist_matrix_vector(&x_train, &y_train, &x_test, &y_test);
-    printf("Loaded MNIST\n");
+    if (load_network(&net, "784-128-128-10-testTest.pickl") == -1)
+    {
+        exit(-1);
+    }
 
-    test(&net, &x_test, &y_test);
+    printf("Accuracy: %d / %d\n", test_dataset(&net, &test_set), test_set.count);
 
     free_network(&net);
-    free_matrix(&x_train);
-    free_matrix(&y_train);
-    free_matrix(&x_test);
-    free_matrix(&y_test);
-    free_matrix(&test_input);
-    free_matrix(&test_output);
+    free_dataset(&test_set);
 
     return 0;
 }
-//*/
\ No newline at end of file
+//*/
@@ -0,0 +1,252 @@
+#include "nnCheckpoint.h"
+#include "nnModel.h"
+#include "nnOptimizer.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static char *checkpoint_path(checkpointer_t *checkpoints, int epoch, const char *suffix)
+{
+    size_t len = strlen(checkpoints->directory) + strlen(checkpoints->name) + strlen(suffix) + 16;
+    char *path = (char *)allocate_bytes(len);
+    snprintf(path, len, "%s/%s-%06d%s", checkpoints->directory, checkpoints->name, epoch, suffix);
+    return path;
+}
+
+static int compare_descending(const void *a, const void *b)
+{
+    return *(const int *)b - *(const int *)a;
+}
+
+// Epochs of the checkpoints in the directory, newest first. Temporary files
+// left by a crash are removed.
+static int list_checkpoints(checkpointer_t *checkpoints, int **epochs)
+{
+    int count = 0, capacity = 16;
+    *epochs = (int *)allocate_bytes(sizeof(int) * capacity);
+
+    DIR *dir = opendir(checkpoints->directory);
+    if (dir == NULL)
+        return 0;
+
+    size_t name_len = strlen(checkpoints->name);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (strncmp(entry->d_name, checkpoints->name, name_len) != 0 || entry->d_name[name_len] != '-')
+            continue;
+
+        char *end;
+        long epoch = strtol(&entry->d_name[name_len + 1], &end, 10);
+        if (end == &entry->d_name[name_len + 1])
+            continue;
+
+        if (strcmp(end, ".nnm.tmp") == 0)
+        {
+            char *path = checkpoint_path(checkpoints, (int)epoch, ".nnm.tmp");
+            unlink(path);
+            free(path);
+        }
+        else if (strcmp(end, ".nnm") == 0)
+        {
+            if (count == capacity)
+            {
+                capacity *= 2;
+                *epochs = (int *)realloc(*epochs, sizeof(int) * capacity);
+            }
+            (*epochs)[count++] = (int)epoch;
+        }
+    }
+    closedir(dir);
+
+    qsort(*epochs, count, sizeof(int), compare_descending);
+    return count;
+}
+
+static void *write_checkpoint(void *arg)
+{
+    checkpointer_t *checkpoints = (checkpointer_t *)arg;
+    char *temp = checkpoint_path(checkpoints, checkpoints->state.epoch, ".nnm.tmp");
+    char *path = checkpoint_path(checkpoints, checkpoints->state.epoch, ".nnm");
+    model_section_t sections[] = {
+        {MODEL_SECTION_TRAINING, &checkpoints->state, sizeof(training_state_t)},
+        {MODEL_SECTION_OPTIMIZER, checkpoints->optimizer_state, checkpoints->optimizer_len},
+    };
+    int num_sections = checkpoints->optimizer_state != NULL ? 2 : 1;
+
+    if (save_model(&checkpoints->snapshot, temp, sections, num_sections) == -1 || rename(temp, path) == -1)
+    {
+        fprintf(stderr, "couldn't write checkpoint %s\n", path);
+        unlink(temp);
+        checkpoints->failures++;
+    }
+    else
+    {
+        // The rename itself is only durable once the directory is synced
+        int fd = open(checkpoints->directory, O_RDONLY | O_DIRECTORY);
+        if (fd != -1)
+        {
+            fsync(fd);
+            close(fd);
+        }
+
+        int *epochs;
+        int count = list_checkpoints(checkpoints, &epochs);
+        for (int i = checkpoints->keep; i < count; i++)
+        {
+            if (epochs[i] == checkpoints->state.best_epoch)
+                continue;
+            char *old = checkpoint_path(checkpoints, epochs[i], ".nnm");
+            unlink(old);
+            free(old);
+        }
+        free(epochs);
+    }
+
+    free(temp);
+    free(path);
+    return NULL;
+}
+
+void init_checkpointer(checkpointer_t *checkpoints, const char *directory, const char *name, int keep)
+{
+    memset(checkpoints, 0, sizeof(*checkpoints));
+    checkpoints->directory = strdup(directory);
+    checkpoints->name = strdup(name);
+    checkpoints->keep = keep > 0 ? keep : 1;
+
+    if (mkdir(directory, 0755) == -1 && errno != EEXIST)
+        fprintf(stderr, "couldn't create %s\n", directory);
+}
+
+void free_checkpointer(checkpointer_t *checkpoints)
+{
+    checkpoint_wait(checkpoints);
+    free(checkpoints->directory);
+    free(checkpoints->name);
+    if (checkpoints->snapshot.layers != NULL)
+    {
+        free(checkpoints->snapshot.layers);
+        free_arena(&checkpoints->snapshot.params);
+        free_arena(&checkpoints->snapshot.activations);
+    }
+    free(checkpoints->optimizer_state);
+}
+
+void checkpoint_wait(checkpointer_t *checkpoints)
+{
+    if (!checkpoints->writing)
+        return;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_join(checkpoints->thread, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    checkpoints->wait_seconds += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    checkpoints->writing = 0;
+}
+
+void checkpoint_async(checkpointer_t *checkpoints, neural_net_t *network, training_state_t *state)
+{
+    checkpoint_wait(checkpoints);
+
+    neural_net_t *snapshot = &checkpoints->snapshot;
+    if (snapshot->layers == NULL)
+    {
+        // Only the sizes and parameters are needed to save it
+        snapshot->num_layers = network->num_layers;
+        snapshot->layers = (layer_t *)allocate_bytes(sizeof(layer_t) * network->num_layers);
+        for (int i = 0; i < network->num_layers; i++)
+        {
+            snapshot->layers[i].length = network->layers[i].length;
+            snapshot->layers[i].activation = network->layers[i].activation;
+            snapshot->layers[i].half_weights.arr = NULL;
+        }
+        layout_params(snapshot->layers, snapshot->num_layers);
+        attach_slabs(snapshot, NULL);
+    }
+
+    memcpy(snapshot->params.arr, network->params.arr, sizeof(float) * network->params.len);
+    checkpoints->state = *state;
+
+    size_t optimizer_len = network->optimizer != NULL ? optimizer_section_len(network->optimizer) : 0;
+    if (optimizer_len != checkpoints->optimizer_len)
+    {
+        free(checkpoints->optimizer_state);
+        checkpoints->optimizer_state = optimizer_len > 0 ? allocate_bytes(optimizer_len) : NULL;
+        checkpoints->optimizer_len = optimizer_len;
+    }
+    if (optimizer_len > 0)
+        write_optimizer_section(network->optimizer, checkpoints->optimizer_state);
+
+    int error = pthread_create(&checkpoints->thread, NULL, write_checkpoint, checkpoints);
+    if (error != 0)
+    {
+        fprintf(stderr, "couldn't start the checkpoint writer (%s), writing epoch %d on the training thread\n",
+                strerror(error), state->epoch);
+        write_checkpoint(checkpoints);
+        return;
+    }
+    checkpoints->writing = 1;
+}
+
+int rollback_checkpoint(checkpointer_t *checkpoints, neural_net_t *network, int epoch)
+{
+    checkpoint_wait(checkpoints);
+
+    neural_net_t saved;
+    char *path = checkpoint_path(checkpoints, epoch, ".nnm");
+    int loaded = load_model(&saved, path, 1) == 0;
+    free(path);
+    if (!loaded)
+        return -1;
+
+    int matches = saved.num_layers == network->num_layers;
+    for (int i = 0; matches && i < network->num_layers; i++)
+        matches = saved.layers[i].length == network->layers[i].length;
+
+    if (matches)
+        memcpy(network->params.arr, saved.params.arr, sizeof(float) * network->params.len);
+    for (int i = 1; matches && i < network->num_layers; i++)
+    {
+        layer_t *layer = &network->layers[i];
+        if (layer->half_weights.arr != NULL)
+            round_half_matrix(&layer->half_weights, &layer->weights);
+    }
+
+    free_network(&saved);
+    return matches ? 0 : -1;
+}
+
+int resume_checkpoint(checkpointer_t *checkpoints, neural_net_t *network, training_state_t *state)
+{
+    int *epochs;
+    int count = list_checkpoints(checkpoints, &epochs);
+
+    for (int i = 0; i < count; i++)
+    {
+        char *path = checkpoint_path(checkpoints, epochs[i], ".nnm");
+        int loaded = load_model(network, path, 1) == 0;
+        free(path);
+        if (!loaded)
+            continue;
+
+        // Fields added to training_state_t after the checkpoint was written
+        // keep the values state came in with
+        size_t len;
+        const void *saved = model_section(network, MODEL_SECTION_TRAINING, &len);
+        if (saved != NULL)
+            memcpy(state, saved, len < sizeof(*state) ? len : sizeof(*state));
+        state->epoch = epochs[i];
+
+        free(epochs);
+        return 0;
+    }
+
+    free(epochs);
+    return -1;
+}
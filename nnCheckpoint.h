@@ -0,0 +1,60 @@
+#ifndef NN_CHECKPOINT_H
+#define NN_CHECKPOINT_H
+
+#include <pthread.h>
+#include "NeuralNet.h"
+
+// Writes checkpoints as <directory>/<name>-<epoch>.nnm model files with
+// the training state in a MODEL_SECTION_TRAINING section, and the state of
+// the network's optimizer in a MODEL_SECTION_OPTIMIZER one. The parameters
+// are copied aside and written by a background thread to a temporary file,
+// which is synced and renamed over, so a crash leaves either the old or
+// the new checkpoint and never half of one.
+struct checkpointer
+{
+    char *directory;
+    char *name;
+    // How many of the newest checkpoints are kept, besides the one of the
+    // best epoch in the training state
+    int keep;
+
+    // The copy of the parameter slab being written
+    neural_net_t snapshot;
+    training_state_t state;
+    // The optimizer section, optimizer_len bytes, NULL without an optimizer
+    void *optimizer_state;
+    size_t optimizer_len;
+
+    pthread_t thread;
+    int writing;
+
+    // Time training spent waiting for the previous write to finish, and
+    // the writes that failed
+    double wait_seconds;
+    int failures;
+};
+
+// Creates directory if it doesn't exist
+void init_checkpointer(checkpointer_t *checkpoints, const char *directory, const char *name, int keep);
+
+// Waits for the write in flight
+void free_checkpointer(checkpointer_t *checkpoints);
+
+// Copies the parameters of network, its optimizer's state and state and
+// starts writing them. Only waits if the previous checkpoint is still being
+// written. If the writer thread can't be started it is written before
+// returning instead.
+void checkpoint_async(checkpointer_t *checkpoints, neural_net_t *network, training_state_t *state);
+
+void checkpoint_wait(checkpointer_t *checkpoints);
+
+// Copies the parameters of the checkpoint of epoch into network, which has
+// to be of the same topology. Returns 0, or -1 if it can't be loaded.
+int rollback_checkpoint(checkpointer_t *checkpoints, neural_net_t *network, int epoch);
+
+// Loads the newest checkpoint that passes its checksum into network and
+// state. Returns 0, or -1 if there is none. The optimizer state is put back
+// with restore_optimizer() once the optimizer is set up.
+int resume_checkpoint(checkpointer_t *checkpoints, neural_net_t *network, training_state_t *state);
+
+#endif
@@ -0,0 +1,321 @@
+#include "nnData.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// IDX stores everything big endian
+static unsigned read_be32(const unsigned char *p)
+{
+    return (unsigned)p[0] << 24 | (unsigned)p[1] << 16 | (unsigned)p[2] << 8 | (unsigned)p[3];
+}
+
+static unsigned long long read_be64(const unsigned char *p)
+{
+    return (unsigned long long)read_be32(p) << 32 | read_be32(p + 4);
+}
+
+static int idx_elem_size(int type)
+{
+    switch (type)
+    {
+    case IDX_UBYTE:
+    case IDX_BYTE:
+        return 1;
+    case IDX_SHORT:
+        return 2;
+    case IDX_INT:
+    case IDX_FLOAT:
+        return 4;
+    case IDX_DOUBLE:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+static float idx_read_elem(idx_t *idx, size_t index)
+{
+    const unsigned char *p = &idx->data[index * idx->elem_size];
+    union { unsigned u; float f; } f32;
+    union { unsigned long long u; double d; } f64;
+
+    switch (idx->type)
+    {
+    case IDX_UBYTE:
+        return p[0];
+    case IDX_BYTE:
+        return (signed char)p[0];
+    case IDX_SHORT:
+        return (short)(p[0] << 8 | p[1]);
+    case IDX_INT:
+        return (int)read_be32(p);
+    case IDX_FLOAT:
+        f32.u = read_be32(p);
+        return f32.f;
+    default:
+        f64.u = read_be64(p);
+        return (float)f64.d;
+    }
+}
+
+int idx_open(idx_t *idx, const char *path)
+{
+    memset(idx, 0, sizeof(*idx));
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        fprintf(stderr, "couldn't open %s\n", path);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < 4)
+    {
+        fprintf(stderr, "%s is too short to be an IDX file\n", path);
+        close(fd);
+        return -1;
+    }
+
+    idx->map_len = st.st_size;
+    idx->map = mmap(NULL, idx->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (idx->map == MAP_FAILED)
+    {
+        fprintf(stderr, "couldn't map %s\n", path);
+        idx->map = NULL;
+        return -1;
+    }
+
+    const unsigned char *header = (const unsigned char *)idx->map;
+    idx->num_dims = header[3];
+    size_t header_len = 4 + 4 * (size_t)idx->num_dims;
+
+    if (header[0] != 0 || header[1] != 0)
+    {
+        fprintf(stderr, "%s has a bad IDX magic number\n", path);
+        idx_close(idx);
+        return -1;
+    }
+    idx->type = header[2];
+    idx->elem_size = idx_elem_size(idx->type);
+    if (idx->elem_size == 0)
+    {
+        fprintf(stderr, "%s has unknown IDX type 0x%02x\n", path, idx->type);
+        idx_close(idx);
+        return -1;
+    }
+    if (idx->num_dims < 1 || idx->num_dims > IDX_MAX_DIMS || idx->map_len < header_len)
+    {
+        fprintf(stderr, "%s has %d dimensions\n", path, idx->num_dims);
+        idx_close(idx);
+        return -1;
+    }
+
+    size_t total = 1;
+    idx->record_len = 1;
+    for (int i = 0; i < idx->num_dims; i++)
+    {
+        idx->dims[i] = (int)read_be32(&header[4 + 4 * i]);
+        if (idx->dims[i] < 0)
+        {
+            fprintf(stderr, "%s has a negative dimension\n", path);
+            idx_close(idx);
+            return -1;
+        }
+        total *= idx->dims[i];
+        if (i > 0)
+            idx->record_len *= idx->dims[i];
+    }
+    idx->count = idx->dims[0];
+
+    total *= idx->elem_size;
+    if (idx->map_len != header_len + total)
+    {
+        fprintf(stderr, "%s holds %zu bytes of data, its header describes %zu\n",
+                path, idx->map_len - header_len, total);
+        idx_close(idx);
+        return -1;
+    }
+
+    idx->data = header + header_len;
+    return 0;
+}
+
+void idx_close(idx_t *idx)
+{
+    if (idx->map != NULL)
+        munmap(idx->map, idx->map_len);
+    idx->map = NULL;
+    idx->data = NULL;
+}
+
+void idx_read_record(idx_t *idx, int index, float scale, float *out)
+{
+    size_t first = (size_t)index * idx->record_len;
+
+    if (idx->type == IDX_UBYTE)
+    {
+        const unsigned char *p = &idx->data[first];
+        for (int j = 0; j < idx->record_len; j++)
+            out[j] = p[j] * scale;
+        return;
+    }
+
+    for (int j = 0; j < idx->record_len; j++)
+        out[j] = idx_read_elem(idx, first + j) * scale;
+}
+
+int idx_read_int(idx_t *idx, size_t index)
+{
+    return (int)idx_read_elem(idx, index);
+}
+
+void idx_release(idx_t *idx, int start, int count)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t record_bytes = (size_t)idx->record_len * idx->elem_size;
+    size_t from = (size_t)(idx->data - (const unsigned char *)idx->map) + start * record_bytes;
+    size_t to = from + count * record_bytes;
+
+    // Only whole pages inside the range, the ones at its ends may still
+    // hold records that are in use
+    from = (from + page - 1) / page * page;
+    to = to / page * page;
+    if (to > from)
+        madvise((char *)idx->map + from, to - from, MADV_DONTNEED);
+}
+
+int load_dataset(dataset_t *dataset, const char *images_path, const char *labels_path, int num_classes)
+{
+    if (idx_open(&dataset->images, images_path) == -1)
+        return -1;
+    if (idx_open(&dataset->labels, labels_path) == -1)
+    {
+        idx_close(&dataset->images);
+        return -1;
+    }
+
+    if (dataset->images.count != dataset->labels.count || dataset->labels.record_len != 1)
+    {
+        fprintf(stderr, "%s and %s don't describe the same samples\n", images_path, labels_path);
+        free_dataset(dataset);
+        return -1;
+    }
+
+    dataset->count = dataset->images.count;
+    dataset->features = dataset->images.record_len;
+
+    switch (dataset->images.type)
+    {
+    case IDX_UBYTE:
+        dataset->scale = 1.0f / 255.0f;
+        break;
+    case IDX_BYTE:
+        dataset->scale = 1.0f / 127.0f;
+        break;
+    case IDX_SHORT:
+        dataset->scale = 1.0f / 32767.0f;
+        break;
+    case IDX_INT:
+        dataset->scale = 1.0f / 2147483647.0f;
+        break;
+    default:
+        dataset->scale = 1;
+    }
+
+    if (dataset->labels.type == IDX_FLOAT || dataset->labels.type == IDX_DOUBLE)
+    {
+        fprintf(stderr, "%s holds non integer labels\n", labels_path);
+        free_dataset(dataset);
+        return -1;
+    }
+
+    int max_label = -1;
+    for (int i = 0; i < dataset->count; i++)
+    {
+        int label = dataset_label(dataset, i);
+        if (label < 0)
+        {
+            fprintf(stderr, "%s has a negative label at %d\n", labels_path, i);
+            free_dataset(dataset);
+            return -1;
+        }
+        if (num_classes > 0 && label >= num_classes)
+        {
+            fprintf(stderr, "%s has label %d at %d, past its %d classes\n", labels_path, label, i, num_classes);
+            free_dataset(dataset);
+            return -1;
+        }
+        max_label = label > max_label ? label : max_label;
+    }
+    dataset->num_classes = num_classes > 0 ? num_classes : max_label + 1;
+
+    // Samples are read in order, let the kernel read ahead
+    madvise(dataset->images.map, dataset->images.map_len, MADV_SEQUENTIAL);
+
+    return 0;
+}
+
+void free_dataset(dataset_t *dataset)
+{
+    idx_close(&dataset->images);
+    idx_close(&dataset->labels);
+}
+
+void gather_inputs(dataset_t *dataset, int start, int count, matrix_t *inputs)
+{
+    for (int i = 0; i < count; i++)
+    {
+        idx_read_record(&dataset->images, start + i, dataset->scale, &inputs->arr[(size_t)i * inputs->col]);
+    }
+    inputs->row = count;
+}
+
+static void one_hot(dataset_t *dataset, int row, int index, matrix_t *expected)
+{
+    int label = dataset_label(dataset, index);
+    if (label < expected->col)
+        expected->arr[(size_t)row * expected->col + label] = 1;
+}
+
+void gather_batch(dataset_t *dataset, int start, int count, matrix_t *inputs, matrix_t *expected)
+{
+    gather_inputs(dataset, start, count, inputs);
+
+    memset(expected->arr, 0, (size_t)count * expected->col * sizeof(float));
+    for (int i = 0; i < count; i++)
+        one_hot(dataset, i, start + i, expected);
+    expected->row = count;
+}
+
+void gather_batch_indexed(dataset_t *dataset, const int *indices, int count, matrix_t *inputs, matrix_t *expected)
+{
+    memset(expected->arr, 0, (size_t)count * expected->col * sizeof(float));
+    for (int i = 0; i < count; i++)
+    {
+        idx_read_record(&dataset->images, indices[i], dataset->scale, &inputs->arr[(size_t)i * inputs->col]);
+        one_hot(dataset, i, indices[i], expected);
+    }
+    inputs->row = count;
+    expected->row = count;
+}
+
+int dataset_label(dataset_t *dataset, int index)
+{
+    if (dataset->labels.type == IDX_UBYTE)
+        return dataset->labels.data[index];
+    return idx_read_int(&dataset->labels, index);
+}
+
+void dataset_stream(dataset_t *dataset, int *released, int next)
+{
+    size_t record_bytes = (size_t)dataset->images.record_len * dataset->images.elem_size;
+
+    if ((size_t)(next - *released) * record_bytes < DATASET_CHUNK_BYTES)
+        return;
+
+    idx_release(&dataset->images, *released, next - *released);
+    *released = next;
+}
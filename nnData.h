@@ -0,0 +1,90 @@
+#ifndef NN_DATA_H
+#define NN_DATA_H
+
+#include "nnMath.h"
+
+#define IDX_MAX_DIMS 8
+
+// IDX type codes
+#define IDX_UBYTE 0x08
+#define IDX_BYTE 0x09
+#define IDX_SHORT 0x0B
+#define IDX_INT 0x0C
+#define IDX_FLOAT 0x0D
+#define IDX_DOUBLE 0x0E
+
+// Bytes of image data a training or test pass reads before it drops the
+// pages behind it, so a file larger than RAM is streamed through
+#define DATASET_CHUNK_BYTES (64 << 20)
+
+// An IDX file mapped into memory. The type and every dimension come from
+// its header, records are read straight from the mapping and nothing is
+// copied at load time.
+typedef struct
+{
+    void *map;
+    size_t map_len;
+    int type;
+    int elem_size;
+    int num_dims;
+    int dims[IDX_MAX_DIMS];
+    // dims[0], and the product of the remaining dims
+    int count;
+    int record_len;
+    const unsigned char *data;
+} idx_t;
+
+// Maps an IDX file and checks its header: the magic, the type code, the
+// number of dimensions and that the file holds exactly the data the
+// dimensions describe. Returns 0, or -1 after printing why to stderr.
+int idx_open(idx_t *idx, const char *path);
+void idx_close(idx_t *idx);
+
+// Converts record index to floats, multiplying by scale
+void idx_read_record(idx_t *idx, int index, float scale, float *out);
+
+// Reads a single integer element, element index of the whole file
+int idx_read_int(idx_t *idx, size_t index);
+
+// Drops the mapped pages of records [start, start + count), they are read
+// from the file again if touched later
+void idx_release(idx_t *idx, int start, int count);
+
+// A pair of IDX files, one with a record of inputs per sample and one with
+// an integer label per sample
+typedef struct
+{
+    idx_t images;
+    idx_t labels;
+    int count;
+    int features;
+    int num_classes;
+    // Integer inputs are scaled by 1 / the largest value of their type
+    float scale;
+} dataset_t;
+
+// num_classes of 0 takes it from the largest label in the file, otherwise a
+// label of num_classes or more is refused. Returns 0, or -1 after printing
+// why to stderr.
+int load_dataset(dataset_t *dataset, const char *images_path, const char *labels_path, int num_classes);
+void free_dataset(dataset_t *dataset);
+
+// Fills the first count rows of inputs with samples [start, start + count),
+// unsigned bytes scaled to [0, 1], signed integers to about [-1, 1] and
+// floats as they are
+void gather_inputs(dataset_t *dataset, int start, int count, matrix_t *inputs);
+
+// Same as gather_inputs(), and also fills expected with the one hot labels
+void gather_batch(dataset_t *dataset, int start, int count, matrix_t *inputs, matrix_t *expected);
+
+// Same as gather_batch(), with the samples at indices[0..count)
+void gather_batch_indexed(dataset_t *dataset, const int *indices, int count, matrix_t *inputs, matrix_t *expected);
+
+int dataset_label(dataset_t *dataset, int index);
+
+// Called as a pass moves through the dataset in order. Once more than
+// DATASET_CHUNK_BYTES lie between *released and next, drops them and moves
+// *released up to next.
+void dataset_stream(dataset_t *dataset, int *released, int next);
+
+#endif
@@ -0,0 +1,466 @@
+#include "nnHalf.h"
+#include <stdlib.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+static inline uint32_t float_bits(float f)
+{
+    uint32_t w;
+    memcpy(&w, &f, sizeof(w));
+    return w;
+}
+
+static inline float bits_float(uint32_t w)
+{
+    float f;
+    memcpy(&f, &w, sizeof(f));
+    return f;
+}
+
+// Rounds by adding a power of two that pushes the bits below the half's
+// mantissa out of the float's, so the FPU does the round to nearest even.
+// Overflow goes to infinity and NaNs keep the top of their payload, quieted,
+// as vcvtps2ph does.
+static inline uint16_t fp16_from_float1(float f)
+{
+    uint32_t w = float_bits(f);
+    uint32_t shl1_w = w + w;
+    uint32_t sign = w & 0x80000000u;
+    uint32_t bias = shl1_w & 0xff000000u;
+    if (bias < 0x71000000u)
+        bias = 0x71000000u;
+
+    float base = (fabsf(f) * 0x1.0p+112f) * 0x1.0p-110f;
+    base = bits_float((bias >> 1) + 0x07800000u) + base;
+    uint32_t bits = float_bits(base);
+    uint32_t nonsign = ((bits >> 13) & 0x7c00u) + (bits & 0x0fffu);
+
+    uint32_t nan = 0x7e00u | ((w >> 13) & 0x03ffu);
+    return (uint16_t)((sign >> 16) | (shl1_w > 0xff000000u ? nan : nonsign));
+}
+
+static inline uint16_t bf16_from_float1(float f)
+{
+    uint32_t w = float_bits(f);
+    if ((w & 0x7f800000u) == 0)
+        w &= 0x80000000u;
+    if ((w & 0x7fffffffu) > 0x7f800000u)
+        return (uint16_t)((w >> 16) | 0x40u);
+    w += 0x7fffu + ((w >> 16) & 1);
+    return (uint16_t)(w >> 16);
+}
+
+static void fp16_from_float_scalar(uint16_t *out, const float *in, int n)
+{
+    for (int i = 0; i < n; i++)
+        out[i] = fp16_from_float1(in[i]);
+}
+
+static void fp16_to_float_scalar(float *out, const uint16_t *in, int n)
+{
+    for (int i = 0; i < n; i++)
+        out[i] = fp16_to_float1(in[i]);
+}
+
+static void bf16_from_float_scalar(uint16_t *out, const float *in, int n)
+{
+    for (int i = 0; i < n; i++)
+        out[i] = bf16_from_float1(in[i]);
+}
+
+static void bf16_to_float_scalar(float *out, const uint16_t *in, int n)
+{
+    for (int i = 0; i < n; i++)
+        out[i] = bf16_to_float1(in[i]);
+}
+
+static inline __attribute__((always_inline)) void gemm_scalar(float *out, int ldo, const float *a, int lda, int samples,
+                                                              const uint16_t *w, int ldw, int rows, int len, precision_t precision)
+{
+    for (int r = 0; r < rows; r++)
+    {
+        for (int s = 0; s < samples; s++)
+        {
+            float sum = 0;
+            for (int k = 0; k < len; k++)
+            {
+                sum += a[(size_t)s * lda + k] * half_to_float1(w[(size_t)r * ldw + k], precision);
+            }
+            out[(size_t)s * ldo + r] += sum;
+        }
+    }
+}
+
+static void fp16_gemm_scalar(float *out, int ldo, const float *a, int lda, int samples,
+                             const uint16_t *w, int ldw, int rows, int len)
+{
+    gemm_scalar(out, ldo, a, lda, samples, w, ldw, rows, len, PRECISION_FP16);
+}
+
+static void bf16_gemm_scalar(float *out, int ldo, const float *a, int lda, int samples,
+                             const uint16_t *w, int ldw, int rows, int len)
+{
+    gemm_scalar(out, ldo, a, lda, samples, w, ldw, rows, len, PRECISION_BF16);
+}
+
+static const half_kernels_t scalar_kernels = {
+    "scalar", fp16_from_float_scalar, fp16_to_float_scalar, bf16_from_float_scalar, bf16_to_float_scalar,
+    fp16_gemm_scalar, bf16_gemm_scalar};
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// Four samples share every load of a weight row, like the int8 kernels
+#define HGEMM_SAMPLES 4
+
+#pragma GCC push_options
+#pragma GCC target("avx2,fma,f16c")
+
+static void fp16_from_float_avx2(uint16_t *out, const float *in, int n)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(&in[i]), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        _mm_storeu_si128((__m128i *)&out[i], h);
+    }
+    fp16_from_float_scalar(&out[i], &in[i], n - i);
+}
+
+static void fp16_to_float_avx2(float *out, const uint16_t *in, int n)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+        _mm256_storeu_ps(&out[i], _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)&in[i])));
+    fp16_to_float_scalar(&out[i], &in[i], n - i);
+}
+
+// bf16_from_float1() on eight floats in integer registers
+static inline __m256i bf16_round_avx2(__m256 v)
+{
+    const __m256i exponent = _mm256_set1_epi32(0x7f800000);
+    __m256i w = _mm256_castps_si256(v);
+    __m256i denormal = _mm256_cmpeq_epi32(_mm256_and_si256(w, exponent), _mm256_setzero_si256());
+    w = _mm256_andnot_si256(_mm256_and_si256(denormal, _mm256_set1_epi32(0x7fffffff)), w);
+
+    __m256i nan = _mm256_cmpgt_epi32(_mm256_and_si256(w, _mm256_set1_epi32(0x7fffffff)), exponent);
+    __m256i odd = _mm256_and_si256(_mm256_srli_epi32(w, 16), _mm256_set1_epi32(1));
+    __m256i rounded = _mm256_srli_epi32(_mm256_add_epi32(w, _mm256_add_epi32(odd, _mm256_set1_epi32(0x7fff))), 16);
+    __m256i quiet = _mm256_or_si256(_mm256_srli_epi32(w, 16), _mm256_set1_epi32(0x40));
+    return _mm256_blendv_epi8(rounded, quiet, nan);
+}
+
+static void bf16_from_float_avx2(uint16_t *out, const float *in, int n)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i w = bf16_round_avx2(_mm256_loadu_ps(&in[i]));
+        // The packs work per 128-bit lane, so the lanes are put back in order
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(w, w), 0x08);
+        _mm_storeu_si128((__m128i *)&out[i], _mm256_castsi256_si128(packed));
+    }
+    bf16_from_float_scalar(&out[i], &in[i], n - i);
+}
+
+static inline __m256 bf16_widen_avx2(__m128i h)
+{
+    return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(h), 16));
+}
+
+static void bf16_to_float_avx2(float *out, const uint16_t *in, int n)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+        _mm256_storeu_ps(&out[i], bf16_widen_avx2(_mm_loadu_si128((const __m128i *)&in[i])));
+    bf16_to_float_scalar(&out[i], &in[i], n - i);
+}
+
+// Eight halves from p as floats
+static inline __attribute__((always_inline)) __m256 widen_avx2(const uint16_t *p, precision_t precision)
+{
+    __m128i h = _mm_loadu_si128((const __m128i *)p);
+    return precision == PRECISION_BF16 ? bf16_widen_avx2(h) : _mm256_cvtph_ps(h);
+}
+
+static inline __attribute__((always_inline)) void hrows_avx2(float *out, int ldo, const float *a, int lda, int count,
+                                                             const uint16_t *w, int ldw, int rows, int len, precision_t precision)
+{
+    for (int r = 0; r < rows; r++)
+    {
+        const uint16_t *row = &w[(size_t)r * ldw];
+        // Two chains per sample, so a lone sample isn't held up by the
+        // latency of each fma
+        __m256 acc[HGEMM_SAMPLES][2];
+        for (int j = 0; j < count; j++)
+            acc[j][0] = acc[j][1] = _mm256_setzero_ps();
+
+        int k = 0;
+        for (; k + 16 <= len; k += 16)
+        {
+            __m256 w0 = widen_avx2(&row[k], precision);
+            __m256 w1 = widen_avx2(&row[k + 8], precision);
+            for (int j = 0; j < count; j++)
+            {
+                acc[j][0] = _mm256_fmadd_ps(_mm256_loadu_ps(&a[(size_t)j * lda + k]), w0, acc[j][0]);
+                acc[j][1] = _mm256_fmadd_ps(_mm256_loadu_ps(&a[(size_t)j * lda + k + 8]), w1, acc[j][1]);
+            }
+        }
+        for (; k + 8 <= len; k += 8)
+        {
+            __m256 w0 = widen_avx2(&row[k], precision);
+            for (int j = 0; j < count; j++)
+                acc[j][0] = _mm256_fmadd_ps(_mm256_loadu_ps(&a[(size_t)j * lda + k]), w0, acc[j][0]);
+        }
+
+        for (int j = 0; j < count; j++)
+        {
+            __m256 both = _mm256_add_ps(acc[j][0], acc[j][1]);
+            __m128 sum = _mm_add_ps(_mm256_castps256_ps128(both), _mm256_extractf128_ps(both, 1));
+            sum = _mm_hadd_ps(sum, sum);
+            sum = _mm_hadd_ps(sum, sum);
+            float total = _mm_cvtss_f32(sum);
+            for (int t = k; t < len; t++)
+                total += a[(size_t)j * lda + t] * half_to_float1(row[t], precision);
+            out[(size_t)j * ldo + r] += total;
+        }
+    }
+}
+
+static inline __attribute__((always_inline)) void gemm_avx2(float *out, int ldo, const float *a, int lda, int samples,
+                                                            const uint16_t *w, int ldw, int rows, int len, precision_t precision)
+{
+    int s = 0;
+    for (; s + HGEMM_SAMPLES <= samples; s += HGEMM_SAMPLES)
+        hrows_avx2(&out[(size_t)s * ldo], ldo, &a[(size_t)s * lda], lda, HGEMM_SAMPLES, w, ldw, rows, len, precision);
+    for (; s < samples; s++)
+        hrows_avx2(&out[(size_t)s * ldo], ldo, &a[(size_t)s * lda], lda, 1, w, ldw, rows, len, precision);
+}
+
+static void fp16_gemm_avx2(float *out, int ldo, const float *a, int lda, int samples,
+                           const uint16_t *w, int ldw, int rows, int len)
+{
+    gemm_avx2(out, ldo, a, lda, samples, w, ldw, rows, len, PRECISION_FP16);
+}
+
+static void bf16_gemm_avx2(float *out, int ldo, const float *a, int lda, int samples,
+                           const uint16_t *w, int ldw, int rows, int len)
+{
+    gemm_avx2(out, ldo, a, lda, samples, w, ldw, rows, len, PRECISION_BF16);
+}
+
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+
+static void fp16_from_float_avx512(uint16_t *out, const float *in, int n)
+{
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m256i h = _mm512_cvtps_ph(_mm512_loadu_ps(&in[i]), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        _mm256_storeu_si256((__m256i *)&out[i], h);
+    }
+    fp16_from_float_scalar(&out[i], &in[i], n - i);
+}
+
+static void fp16_to_float_avx512(float *out, const uint16_t *in, int n)
+{
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+        _mm512_storeu_ps(&out[i], _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *)&in[i])));
+    fp16_to_float_scalar(&out[i], &in[i], n - i);
+}
+
+static void bf16_from_float_avx512(uint16_t *out, const float *in, int n)
+{
+    const __m512i exponent = _mm512_set1_epi32(0x7f800000);
+    const __m512i magnitude = _mm512_set1_epi32(0x7fffffff);
+
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m512i w = _mm512_castps_si512(_mm512_loadu_ps(&in[i]));
+        __mmask16 denormal = _mm512_testn_epi32_mask(w, exponent);
+        w = _mm512_mask_and_epi32(w, denormal, w, _mm512_set1_epi32(0x80000000));
+
+        __mmask16 nan = _mm512_cmpgt_epu32_mask(_mm512_and_si512(w, magnitude), exponent);
+        __m512i odd = _mm512_and_si512(_mm512_srli_epi32(w, 16), _mm512_set1_epi32(1));
+        __m512i rounded = _mm512_srli_epi32(_mm512_add_epi32(w, _mm512_add_epi32(odd, _mm512_set1_epi32(0x7fff))), 16);
+        rounded = _mm512_mask_or_epi32(rounded, nan, _mm512_srli_epi32(w, 16), _mm512_set1_epi32(0x40));
+        _mm256_storeu_si256((__m256i *)&out[i], _mm512_cvtepi32_epi16(rounded));
+    }
+    bf16_from_float_scalar(&out[i], &in[i], n - i);
+}
+
+static inline __m512 bf16_widen_avx512(__m256i h)
+{
+    return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(h), 16));
+}
+
+static void bf16_to_float_avx512(float *out, const uint16_t *in, int n)
+{
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+        _mm512_storeu_ps(&out[i], bf16_widen_avx512(_mm256_loadu_si256((const __m256i *)&in[i])));
+    bf16_to_float_scalar(&out[i], &in[i], n - i);
+}
+
+static inline __attribute__((always_inline)) __m512 widen_avx512(const uint16_t *p, precision_t precision)
+{
+    __m256i h = _mm256_loadu_si256((const __m256i *)p);
+    return precision == PRECISION_BF16 ? bf16_widen_avx512(h) : _mm512_cvtph_ps(h);
+}
+
+static inline __attribute__((always_inline)) void hrows_avx512(float *out, int ldo, const float *a, int lda, int count,
+                                                               const uint16_t *w, int ldw, int rows, int len, precision_t precision)
+{
+    for (int r = 0; r < rows; r++)
+    {
+        const uint16_t *row = &w[(size_t)r * ldw];
+        __m512 acc[HGEMM_SAMPLES][2];
+        for (int j = 0; j < count; j++)
+            acc[j][0] = acc[j][1] = _mm512_setzero_ps();
+
+        int k = 0;
+        for (; k + 32 <= len; k += 32)
+        {
+            __m512 w0 = widen_avx512(&row[k], precision);
+            __m512 w1 = widen_avx512(&row[k + 16], precision);
+            for (int j = 0; j < count; j++)
+            {
+                acc[j][0] = _mm512_fmadd_ps(_mm512_loadu_ps(&a[(size_t)j * lda + k]), w0, acc[j][0]);
+                acc[j][1] = _mm512_fmadd_ps(_mm512_loadu_ps(&a[(size_t)j * lda + k + 16]), w1, acc[j][1]);
+            }
+        }
+        for (; k + 16 <= len; k += 16)
+        {
+            __m512 w0 = widen_avx512(&row[k], precision);
+            for (int j = 0; j < count; j++)
+                acc[j][0] = _mm512_fmadd_ps(_mm512_loadu_ps(&a[(size_t)j * lda + k]), w0, acc[j][0]);
+        }
+
+        for (int j = 0; j < count; j++)
+        {
+            float total = _mm512_reduce_add_ps(_mm512_add_ps(acc[j][0], acc[j][1]));
+            for (int t = k; t < len; t++)
+                total += a[(size_t)j * lda + t] * half_to_float1(row[t], precision);
+            out[(size_t)j * ldo + r] += total;
+        }
+    }
+}
+
+static inline __attribute__((always_inline)) void gemm_avx512(float *out, int ldo, const float *a, int lda, int samples,
+                                                              const uint16_t *w, int ldw, int rows, int len, precision_t precision)
+{
+    int s = 0;
+    for (; s + HGEMM_SAMPLES <= samples; s += HGEMM_SAMPLES)
+        hrows_avx512(&out[(size_t)s * ldo], ldo, &a[(size_t)s * lda], lda, HGEMM_SAMPLES, w, ldw, rows, len, precision);
+    for (; s < samples; s++)
+        hrows_avx512(&out[(size_t)s * ldo], ldo, &a[(size_t)s * lda], lda, 1, w, ldw, rows, len, precision);
+}
+
+static void fp16_gemm_avx512(float *out, int ldo, const float *a, int lda, int samples,
+                             const uint16_t *w, int ldw, int rows, int len)
+{
+    gemm_avx512(out, ldo, a, lda, samples, w, ldw, rows, len, PRECISION_FP16);
+}
+
+static void bf16_gemm_avx512(float *out, int ldo, const float *a, int lda, int samples,
+                             const uint16_t *w, int ldw, int rows, int len)
+{
+    gemm_avx512(out, ldo, a, lda, samples, w, ldw, rows, len, PRECISION_BF16);
+}
+
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx512bf16")
+
+// vcvtneps2bf16 rounds to nearest even and treats denormals as zero in
+// one instruction
+static void bf16_from_float_avx512bf16(uint16_t *out, const float *in, int n)
+{
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m256bh h = _mm512_cvtneps_pbh(_mm512_loadu_ps(&in[i]));
+        memcpy(&out[i], &h, sizeof(h));
+    }
+    bf16_from_float_scalar(&out[i], &in[i], n - i);
+}
+
+#pragma GCC pop_options
+
+static const half_kernels_t avx2_kernels = {
+    "avx2", fp16_from_float_avx2, fp16_to_float_avx2, bf16_from_float_avx2, bf16_to_float_avx2,
+    fp16_gemm_avx2, bf16_gemm_avx2};
+
+static const half_kernels_t avx512_kernels = {
+    "avx512", fp16_from_float_avx512, fp16_to_float_avx512, bf16_from_float_avx512, bf16_to_float_avx512,
+    fp16_gemm_avx512, bf16_gemm_avx512};
+
+#endif
+
+half_kernels_t half = {
+    "scalar", fp16_from_float_scalar, fp16_to_float_scalar, bf16_from_float_scalar, bf16_to_float_scalar,
+    fp16_gemm_scalar, bf16_gemm_scalar};
+
+__attribute__((constructor)) void half_init()
+{
+    const char *forced = getenv("NN_SIMD");
+    half = scalar_kernels;
+
+    if (forced != NULL && strcmp(forced, "scalar") == 0)
+        return;
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+
+    const half_kernels_t *candidates[] = {&avx512_kernels, &avx2_kernels};
+    int supported[] = {
+        __builtin_cpu_supports("avx512f"),
+        __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c"),
+    };
+
+    for (int i = 0; i < (int)(sizeof(candidates) / sizeof(candidates[0])); i++)
+    {
+        if (!supported[i])
+            continue;
+        if (forced != NULL && strcmp(forced, candidates[i]->name) != 0)
+            continue;
+        half = *candidates[i];
+        if (half.bf16_from_float == bf16_from_float_avx512 && __builtin_cpu_supports("avx512bf16"))
+            half.bf16_from_float = bf16_from_float_avx512bf16;
+        return;
+    }
+#endif
+}
+
+void half_from_float(uint16_t *out, const float *in, int n, precision_t precision)
+{
+    if (precision == PRECISION_BF16)
+        half.bf16_from_float(out, in, n);
+    else
+        half.fp16_from_float(out, in, n);
+}
+
+void half_to_float(float *out, const uint16_t *in, int n, precision_t precision)
+{
+    if (precision == PRECISION_BF16)
+        half.bf16_to_float(out, in, n);
+    else
+        half.fp16_to_float(out, in, n);
+}
+
+void half_gemm(float *out, int ldo, const float *a, int lda, int samples,
+               const uint16_t *w, int ldw, int rows, int len, precision_t precision)
+{
+    if (precision == PRECISION_BF16)
+        half.bf16_gemm(out, ldo, a, lda, samples, w, ldw, rows, len);
+    else
+        half.fp16_gemm(out, ldo, a, lda, samples, w, ldw, rows, len);
+}
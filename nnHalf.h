@@ -0,0 +1,107 @@
+#ifndef NN_HALF_H
+#define NN_HALF_H
+
+#include <stdint.h>
+#include <string.h>
+
+// How a network's weights are stored for the forward and backward passes.
+// The float weights stay the master copy that updates are made to, a half
+// copy is rounded from them after every update.
+typedef enum
+{
+    PRECISION_F32,
+    // IEEE binary16, 10 bits of mantissa but only up to 65504
+    PRECISION_FP16,
+    // The top half of a float, the range of a float with 7 bits of mantissa
+    PRECISION_BF16
+} precision_t;
+
+// A row major matrix of fp16 or bf16 values
+typedef struct
+{
+    uint16_t *arr;
+    int row;
+    int col;
+    precision_t precision;
+} half_matrix_t;
+
+// Conversions and products for one instruction set. Conversions round to
+// nearest even, and bf16 rounds float denormals to zero like
+// vcvtneps2bf16 does, so every table gives the same bits.
+typedef struct
+{
+    const char *name;
+
+    void (*fp16_from_float)(uint16_t *out, const float *in, int n);
+    void (*fp16_to_float)(float *out, const uint16_t *in, int n);
+    void (*bf16_from_float)(uint16_t *out, const float *in, int n);
+    void (*bf16_to_float)(float *out, const uint16_t *in, int n);
+
+    // out[s * ldo + r] += sum over k of a[s * lda + k] * w[r * ldw + k], for
+    // samples float rows of a and rows half rows of w, summed in float
+    void (*fp16_gemm)(float *out, int ldo, const float *a, int lda, int samples,
+                      const uint16_t *w, int ldw, int rows, int len);
+    void (*bf16_gemm)(float *out, int ldo, const float *a, int lda, int samples,
+                      const uint16_t *w, int ldw, int rows, int len);
+} half_kernels_t;
+
+// The kernels in use, like simd in nnSimd.h
+extern half_kernels_t half;
+
+// Picks "scalar", "avx2" (F16C) or "avx512" like simd_init() does, NN_SIMD
+// applies the same way. The avx512 table converts to bf16 with
+// AVX512-BF16 when the CPU has it. Runs automatically at startup.
+void half_init();
+
+// Converts n values either way in the given precision, which isn't
+// PRECISION_F32
+void half_from_float(uint16_t *out, const float *in, int n, precision_t precision);
+void half_to_float(float *out, const uint16_t *in, int n, precision_t precision);
+
+// The fp16_gemm or bf16_gemm of half for precision
+void half_gemm(float *out, int ldo, const float *a, int lda, int samples,
+               const uint16_t *w, int ldw, int rows, int len, precision_t precision);
+
+// One value at a time, for strided reads
+static inline float fp16_to_float1(uint16_t h)
+{
+    // The exponent is rebiased by scaling, which also gets infinities,
+    // NaNs and denormals right without branching on them
+    uint32_t w = (uint32_t)h << 16;
+    uint32_t sign = w & 0x80000000u;
+    uint32_t two_w = w + w;
+
+    uint32_t normalized_bits = (two_w >> 4) + (0xe0u << 23);
+    uint32_t denormalized_bits = (two_w >> 17) | (126u << 23);
+    float normalized, denormalized;
+    memcpy(&normalized, &normalized_bits, sizeof(float));
+    memcpy(&denormalized, &denormalized_bits, sizeof(float));
+    normalized *= 0x1.0p-112f;
+    denormalized -= 0.5f;
+
+    uint32_t result;
+    if (two_w < (1u << 27))
+        memcpy(&result, &denormalized, sizeof(float));
+    else
+        memcpy(&result, &normalized, sizeof(float));
+    result |= sign;
+
+    float f;
+    memcpy(&f, &result, sizeof(float));
+    return f;
+}
+
+static inline float bf16_to_float1(uint16_t h)
+{
+    uint32_t w = (uint32_t)h << 16;
+    float f;
+    memcpy(&f, &w, sizeof(float));
+    return f;
+}
+
+static inline float half_to_float1(uint16_t h, precision_t precision)
+{
+    return precision == PRECISION_BF16 ? bf16_to_float1(h) : fp16_to_float1(h);
+}
+
+#endif
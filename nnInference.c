@@ -0,0 +1,101 @@
+#include "nnInference.h"
+
+model_t model_view(neural_net_t *network)
+{
+    model_t model;
+    model.num_layers = network->num_layers;
+    model.sigmoid_mode = network->sigmoid_mode;
+    model.owned = NULL;
+
+    // Copies of the headers, the floats stay where they are
+    model.lengths = (int *)allocate_bytes(sizeof(int) * network->num_layers);
+    model.weights = (matrix_t *)allocate_bytes(sizeof(matrix_t) * network->num_layers);
+    model.half_weights = (half_matrix_t *)allocate_bytes(sizeof(half_matrix_t) * network->num_layers);
+    model.biases = (vector_t *)allocate_bytes(sizeof(vector_t) * network->num_layers);
+    model.activations = (activation_t *)allocate_bytes(sizeof(activation_t) * network->num_layers);
+    for (int i = 0; i < network->num_layers; i++)
+    {
+        model.lengths[i] = network->layers[i].length;
+        model.weights[i] = network->layers[i].weights;
+        model.half_weights[i] = network->layers[i].half_weights;
+        model.biases[i] = network->layers[i].biases;
+        model.activations[i] = network->layers[i].activation;
+    }
+
+    return model;
+}
+
+int open_model(model_t *model, const char *path)
+{
+    neural_net_t *network = (neural_net_t *)allocate_bytes(sizeof(neural_net_t));
+    if (load_network(network, (char *)path) == -1)
+    {
+        free(network);
+        return -1;
+    }
+
+    *model = model_view(network);
+    model->owned = network;
+    return 0;
+}
+
+void close_model(model_t *model)
+{
+    free(model->lengths);
+    free(model->weights);
+    free(model->half_weights);
+    free(model->biases);
+    free(model->activations);
+    if (model->owned != NULL)
+    {
+        free_network(model->owned);
+        free(model->owned);
+    }
+    model->owned = NULL;
+}
+
+void init_context(exec_context_t *context, model_t *model, int batch_size)
+{
+    int widest = 0;
+    for (int i = 1; i < model->num_layers - 1; i++)
+    {
+        widest = model->lengths[i] > widest ? model->lengths[i] : widest;
+    }
+
+    context->batch_size = batch_size;
+    context->arena = init_arena(2 * arena_len((size_t)batch_size * widest));
+    context->buffers[0] = arena_matrix(&context->arena, batch_size, widest);
+    context->buffers[1] = arena_matrix(&context->arena, batch_size, widest);
+}
+
+void free_context(exec_context_t *context)
+{
+    free_arena(&context->arena);
+}
+
+void predict_batch(model_t *model, exec_context_t *context, matrix_t *inputs, matrix_t *outputs)
+{
+    int last = model->num_layers - 1;
+
+    for (int start = 0; start < inputs->row; start += context->batch_size)
+    {
+        int rows = inputs->row - start < context->batch_size ? inputs->row - start : context->batch_size;
+
+        // Row major, so a batch of rows is a view
+        matrix_t in = {&inputs->arr[(size_t)start * inputs->col], rows, inputs->col};
+        for (int i = 1; i <= last; i++)
+        {
+            matrix_t out = {context->buffers[i % 2].arr, rows, model->lengths[i]};
+            if (i == last)
+                out.arr = &outputs->arr[(size_t)start * outputs->col];
+
+            //example for second layer, [Bx10][10x16]+[1x16]
+            epilogue_t forward = {model->activations[i], model->sigmoid_mode, model->biases[i].arr, NULL};
+            if (model->half_weights[i].arr != NULL)
+                multiply_mat_halfT_epilogue(&out, &in, &model->half_weights[i], &forward);
+            else
+                multiply_mat_matT_epilogue(&out, &in, &model->weights[i], &forward);
+            in = out;
+        }
+    }
+}
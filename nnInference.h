@@ -0,0 +1,52 @@
+#ifndef NN_INFERENCE_H
+#define NN_INFERENCE_H
+
+#include "NeuralNet.h"
+
+// The parameters of a network and nothing else. Predictions never write to
+// it, so one model can serve any number of threads at once, each with its
+// own exec_context_t.
+typedef struct
+{
+    int num_layers;
+    // Indexed by layer like neural_net_t.layers, the input layer's unused
+    int *lengths;
+    matrix_t *weights;
+    // The half copies of a network in half precision, which predictions
+    // read instead of weights. NULL arr otherwise.
+    half_matrix_t *half_weights;
+    vector_t *biases;
+    activation_t *activations;
+    sigmoid_mode_t sigmoid_mode;
+    // The network open_model() loaded, NULL for a view
+    neural_net_t *owned;
+} model_t;
+
+// Scratch of one thread's predictions, up to batch_size samples at a time
+typedef struct
+{
+    arena_t arena;
+    // Layer outputs alternate between the two, the last layer writes
+    // straight to the caller's outputs
+    matrix_t buffers[2];
+    int batch_size;
+} exec_context_t;
+
+// Shares the parameters of network, which must not be trained while the
+// model is in use
+model_t model_view(neural_net_t *network);
+
+// Loads a model file the way load_network() does. Returns 0, or -1 after
+// printing why to stderr.
+int open_model(model_t *model, const char *path);
+void close_model(model_t *model);
+
+void init_context(exec_context_t *context, model_t *model, int batch_size);
+void free_context(exec_context_t *context);
+
+// Runs every row of inputs, inputs->row x the input layer length, through
+// the model into the same rows of outputs, which has the output layer
+// length columns. Works through the rows batch_size at a time.
+void predict_batch(model_t *model, exec_context_t *context, matrix_t *inputs, matrix_t *outputs);
+
+#endif
@@ -1,4 +1,5 @@
 #include "nnMath.h"
+#include "nnSimd.h"
 
 // * is the hadamard product
 // L is the last layer
@@ -51,216 +52,722 @@ matrix_t init_matrix(int row, int col)
     return mat;
 }
 
-inline void free_vector(vector_t *vec)
+void free_vector(vector_t *vec)
 {
     free(vec->arr);
 }
-inline void free_matrix(matrix_t *mat)
+void free_matrix(matrix_t *mat)
 {
     free(mat->arr);
 }
 
-inline float *allocate_mat_arr(int row, int col)
+static long allocations = 0;
+
+static inline void count_allocation()
+{
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+}
+
+long allocation_count()
 {
+    return __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+}
+
+void *allocate_bytes(size_t size)
+{
+    count_allocation();
+    return calloc(1, size);
+}
+
+float *allocate_mat_arr(int row, int col)
+{
+    count_allocation();
     return (float*)calloc(row*col, sizeof(float));
 }
-inline float *allocate_vec_arr(int len)
+float *allocate_vec_arr(int len)
 {
+    count_allocation();
     return (float*)calloc(len, sizeof(float));
 }
 
-inline matrix_t *allocate_mat()
+matrix_t *allocate_mat()
 {
+    count_allocation();
     return (matrix_t*)malloc(sizeof(matrix_t));
 }
 
-inline vector_t *allocate_vec()
+vector_t *allocate_vec()
 {
+    count_allocation();
     return (vector_t*)malloc(sizeof(vector_t));
 }
 
-inline void multiply_mat_vec(vector_t *out, matrix_t *mat, vector_t *vec)
+#define ARENA_ALIGN 16
+
+size_t arena_len(size_t len)
+{
+    return (len + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+}
+
+arena_t init_arena(size_t len)
+{
+    arena_t arena;
+    arena.len = arena_len(len);
+    arena.used = 0;
+
+    count_allocation();
+    arena.arr = (float *)aligned_alloc(ARENA_ALIGN * sizeof(float), (arena.len ? arena.len : ARENA_ALIGN) * sizeof(float));
+    memset(arena.arr, 0, arena.len * sizeof(float));
+
+    return arena;
+}
+
+void free_arena(arena_t *arena)
+{
+    free(arena->arr);
+    arena->arr = NULL;
+    arena->len = 0;
+    arena->used = 0;
+}
+
+float *arena_alloc(arena_t *arena, size_t len)
+{
+    len = arena_len(len);
+    if (arena->used + len > arena->len)
+    {
+        fprintf(stderr, "arena of %zu floats exhausted\n", arena->len);
+        exit(-1);
+    }
+
+    float *out = &arena->arr[arena->used];
+    arena->used += len;
+    return out;
+}
+
+vector_t arena_vector(arena_t *arena, int len)
+{
+    vector_t vec;
+    vec.len = len;
+    vec.arr = arena_alloc(arena, len);
+
+    return vec;
+}
+
+matrix_t arena_matrix(arena_t *arena, int row, int col)
+{
+    matrix_t mat;
+    mat.row = row;
+    mat.col = col;
+    mat.arr = arena_alloc(arena, (size_t)row * col);
+
+    return mat;
+}
+
+half_matrix_t init_half_matrix(int row, int col, precision_t precision)
+{
+    half_matrix_t mat;
+    mat.row = row;
+    mat.col = col;
+    mat.precision = precision;
+    mat.arr = (uint16_t *)allocate_bytes(sizeof(uint16_t) * (size_t)row * col);
+
+    return mat;
+}
+
+void free_half_matrix(half_matrix_t *mat)
+{
+    free(mat->arr);
+    mat->arr = NULL;
+}
+
+void round_half_matrix(half_matrix_t *out, matrix_t *mat)
+{
+    half_from_float(out->arr, mat->arr, mat->row * mat->col, out->precision);
+}
+
+void multiply_mat_vec(vector_t *out, matrix_t *mat, vector_t *vec)
 {
-    int j, k = 0;
     for (int i = 0; i < mat->row; i++)
     {
-        for (j = 0; j < mat->col; j++)
+        out->arr[i] += simd.dot(&mat->arr[i * mat->col], vec->arr, mat->col);
+    }
+}
+
+// Walks mat a row at a time, adding row i scaled by vec[i] to out, so the
+// weights are read in the order they are stored
+void multiply_matT_vec(vector_t *out, matrix_t *mat, vector_t *vec)
+{
+    for (int i = 0; i < mat->row; i++)
+    {
+        simd.axpy(out->arr, &mat->arr[i * mat->col], vec->arr[i], mat->col);
+    }
+}
+
+void multiply_half_vec(vector_t *out, half_matrix_t *mat, vector_t *vec)
+{
+    half_gemm(out->arr, mat->row, vec->arr, mat->col, 1, mat->arr, mat->col, mat->row, mat->col, mat->precision);
+}
+
+// Widens each row a block at a time into a buffer that stays in L1
+#define HALF_BLOCK 256
+
+void multiply_halfT_vec(vector_t *out, half_matrix_t *mat, vector_t *vec)
+{
+    float row[HALF_BLOCK];
+    for (int i = 0; i < mat->row; i++)
+    {
+        for (int j = 0; j < mat->col; j += HALF_BLOCK)
         {
-            out->arr[i] += mat->arr[k++] * vec->arr[j];
+            int len = mat->col - j < HALF_BLOCK ? mat->col - j : HALF_BLOCK;
+            half_to_float(row, &mat->arr[(size_t)i * mat->col + j], len, mat->precision);
+            simd.axpy(&out->arr[j], row, vec->arr[i], len);
         }
     }
 }
 
-inline void add_vec(vector_t *out, vector_t *v1, vector_t *v2)
+// Applies epilogue, if not NULL, to rows x cols of out at row, col of the
+// whole output, ldo floats apart. Softmax needs whole rows, so a tile only gets the bias
+// and finish_rows() does the rest once the product is done.
+static void apply_epilogue(const epilogue_t *epilogue, float *out, int ldo, int row, int col, int rows, int cols,
+                           int whole_rows)
 {
-    for (int i = 0; i < out->len; i++)
+    if (epilogue == NULL)
+        return;
+    int fast = epilogue->sigmoid_mode == SIGMOID_FAST;
+    int partial = epilogue->activation == ACTIVATION_SOFTMAX && !whole_rows;
+    for (int i = 0; i < rows; i++)
     {
-        out->arr[i] = v1->arr[i] + v2->arr[i];
+        float *out_row = &out[(size_t)i * ldo];
+        if (epilogue->activated != NULL)
+        {
+            if (!partial)
+                simd.backprop(out_row, &epilogue->activated[(size_t)(row + i) * ldo + col], NULL, cols, epilogue->activation);
+        }
+        else if (!partial)
+        {
+            simd.activate(out_row, out_row, epilogue->bias != NULL ? &epilogue->bias[col] : NULL, cols,
+                          epilogue->activation, fast);
+        }
+        else if (epilogue->bias != NULL)
+        {
+            simd.add(out_row, out_row, &epilogue->bias[col], cols);
+        }
     }
 }
 
-inline void subtract_vec(vector_t *out, vector_t *v1, vector_t *v2)
+// The softmax of rows whose bias apply_epilogue() has already added
+static void finish_rows(const epilogue_t *epilogue, float *out, int ldo, int rows, int cols)
+{
+    if (epilogue == NULL || epilogue->activation != ACTIVATION_SOFTMAX)
+        return;
+    epilogue_t rest = *epilogue;
+    rest.bias = NULL;
+    apply_epilogue(&rest, out, ldo, 0, 0, rows, cols, 1);
+}
+
+void multiply_mat_vec_epilogue(vector_t *out, matrix_t *mat, vector_t *vec, const epilogue_t *epilogue)
 {
-    for (int i = 0; i < out->len; i++)
+    for (int i = 0; i < mat->row; i++)
     {
-        out->arr[i] = v1->arr[i] - v2->arr[i];
+        out->arr[i] = simd.dot(&mat->arr[i * mat->col], vec->arr, mat->col);
     }
+    apply_epilogue(epilogue, out->arr, out->len, 0, 0, 1, out->len, 1);
+}
+
+void multiply_half_vec_epilogue(vector_t *out, half_matrix_t *mat, vector_t *vec, const epilogue_t *epilogue)
+{
+    memset(out->arr, 0, sizeof(float) * out->len);
+    multiply_half_vec(out, mat, vec);
+    apply_epilogue(epilogue, out->arr, out->len, 0, 0, 1, out->len, 1);
+}
+
+void multiply_matT_vec_epilogue(vector_t *out, matrix_t *mat, vector_t *vec, const epilogue_t *epilogue)
+{
+    memset(out->arr, 0, sizeof(float) * out->len);
+    multiply_matT_vec(out, mat, vec);
+    apply_epilogue(epilogue, out->arr, out->len, 0, 0, 1, out->len, 1);
+}
+
+void multiply_halfT_vec_epilogue(vector_t *out, half_matrix_t *mat, vector_t *vec, const epilogue_t *epilogue)
+{
+    memset(out->arr, 0, sizeof(float) * out->len);
+    multiply_halfT_vec(out, mat, vec);
+    apply_epilogue(epilogue, out->arr, out->len, 0, 0, 1, out->len, 1);
 }
 
-inline float sigmoid(float val)
+void add_vec(vector_t *out, vector_t *v1, vector_t *v2)
+{
+    simd.add(out->arr, v1->arr, v2->arr, out->len);
+}
+
+void subtract_vec(vector_t *out, vector_t *v1, vector_t *v2)
+{
+    simd.sub(out->arr, v1->arr, v2->arr, out->len);
+}
+
+float sigmoid(float val)
 {
     return 1 / (1 + exp(-1 * val));
 }
 
-inline void sigmoid_mat(matrix_t *out, matrix_t* mat)
+void sigmoid_mat(matrix_t *out, matrix_t* mat)
+{
+    simd.sigmoid(out->arr, mat->arr, mat->row * mat->col);
+}
+
+void dsigmoid_mat(matrix_t *out, matrix_t* mat)
+{
+    simd.dsigmoid(out->arr, mat->arr, mat->row * mat->col);
+}
+
+void sigmoid_vec(vector_t *out, vector_t* vec)
+{
+    simd.sigmoid(out->arr, vec->arr, out->len);
+}
+
+void dsigmoid_vec(vector_t *out, vector_t* vec)
+{
+    simd.dsigmoid(out->arr, vec->arr, out->len);
+}
+
+void sigmoid_vec_mode(vector_t *out, vector_t *vec, sigmoid_mode_t mode)
+{
+    if (mode == SIGMOID_FAST)
+        simd.sigmoid_fast(out->arr, vec->arr, out->len);
+    else
+        simd.sigmoid(out->arr, vec->arr, out->len);
+}
+
+void sigmoid_mat_mode(matrix_t *out, matrix_t *mat, sigmoid_mode_t mode)
 {
-    for (int i = 0; i < mat->row*mat->col; i++)
+    if (mode == SIGMOID_FAST)
+        simd.sigmoid_fast(out->arr, mat->arr, mat->row * mat->col);
+    else
+        simd.sigmoid(out->arr, mat->arr, mat->row * mat->col);
+}
+
+void dsigmoid_activated_vec(vector_t *out, vector_t *activated)
+{
+    simd.dsigmoid_activated(out->arr, activated->arr, out->len);
+}
+
+void dsigmoid_activated_mat(matrix_t *out, matrix_t *activated)
+{
+    simd.dsigmoid_activated(out->arr, activated->arr, activated->row * activated->col);
+}
+
+void hadamard_product(vector_t *out, vector_t *vec1, vector_t *vec2)
+{
+    simd.mul(out->arr, vec1->arr, vec2->arr, out->len);
+}
+
+void output_error(vector_t *out,
+                  vector_t *expected_output, 
+                  vector_t *last_layer_activations, 
+                  activation_t activation)
+{
+    simd.backprop(out->arr, last_layer_activations->arr, expected_output->arr, out->len, activation);
+}
+
+void output_error_mat(matrix_t *out, matrix_t *expected_outputs, matrix_t *activations, activation_t activation)
+{
+    // The elementwise activations don't care where the rows end
+    if (activation != ACTIVATION_SOFTMAX)
+    {
+        simd.backprop(out->arr, activations->arr, expected_outputs->arr, out->row * out->col, activation);
+        return;
+    }
+    for (int i = 0; i < out->row; i++)
     {
-        out->arr[i] = sigmoid(mat->arr[i]);
+        simd.backprop(&out->arr[i * out->col], &activations->arr[i * activations->col],
+                      &expected_outputs->arr[i * expected_outputs->col], out->col, activation);
     }
 }
 
-inline void dsigmoid_mat(matrix_t *out, matrix_t* mat)
+float quadratic_loss_mat(matrix_t *activations, matrix_t *expected_outputs)
 {
-    float sig;
-    for (int i = 0; i < mat->row*mat->col; i++)
-    {   
-        sig = sigmoid(mat->arr[i]);
-        out->arr[i] = sig * (1 - sig);
+    float loss = 0;
+    for (int i = 0; i < activations->row; i++)
+    {
+        float *a = &activations->arr[i * activations->col];
+        float *y = &expected_outputs->arr[i * expected_outputs->col];
+        float row = 0;
+        for (int j = 0; j < activations->col; j++)
+            row += (a[j] - y[j]) * (a[j] - y[j]);
+        loss += 0.5f * row;
     }
+    return loss;
 }
 
-inline void sigmoid_vec(vector_t *out, vector_t* vec)
+float cross_entropy_mat(matrix_t *out, matrix_t *logits, matrix_t *expected_outputs, sigmoid_mode_t mode)
 {
-    for (int i = 0; i < out->len; i++)
+    float loss = 0;
+    for (int i = 0; i < out->row; i++)
     {
-        out->arr[i] = sigmoid(vec->arr[i]);
+        float *z = &logits->arr[i * logits->col];
+        loss += simd.cross_entropy(z, &out->arr[i * out->col], z, &expected_outputs->arr[i * expected_outputs->col],
+                                   out->col, mode == SIGMOID_FAST);
     }
+    return loss;
+}
+
+void layer_error(vector_t *out, 
+                 matrix_t *next_layer_weights,
+                 vector_t *next_layer_error,
+                 vector_t *current_layer_activations,
+                 activation_t activation)
+{
+    epilogue_t backward = {activation, SIGMOID_EXACT, NULL, current_layer_activations->arr};
+    multiply_matT_vec_epilogue(out, next_layer_weights, next_layer_error, &backward);
 }
 
-inline void dsigmoid_vec(vector_t *out, vector_t* vec)
+void transpose(matrix_t *out, matrix_t* mat)
 {
-    float sig;
-    for (int i = 0; i < out->len; i++)
+    for (int i = 0; i < out->row; i++)
     {
-        sig = sigmoid(vec->arr[i]);
-        out->arr[i] = sig * (1 - sig);
+        for (int j = 0; j < out->col; j++)
+        {
+            out->arr[j + i * out->col] = mat->arr[i + j * mat->col];
+        }
     }
 }
 
-inline void hadamard_product(vector_t *out, vector_t *vec1, vector_t *vec2)
+void multiply_vec_vec(matrix_t *out, vector_t *v1, vector_t *v2)
 {
-    for (int i = 0; i < out->len; i++)
+    for (int i = 0; i < out->row; i++)
     {
-        out->arr[i] = vec1->arr[i] * vec2->arr[i];
+        simd.scale(&out->arr[i * out->col], v2->arr, v1->arr[i], out->col);
     }
 }
 
-void output_error(vector_t *out,
-                  vector_t *expected_output, 
-                  vector_t *last_layer_activations, 
-                  vector_t *last_layer_weighted)
+void scalar_multiply_mat(matrix_t *out, matrix_t *mat, float scalar)
 {
-    vector_t llw_dsig = init_vector(last_layer_weighted->len);
-    dsigmoid_vec(&llw_dsig, last_layer_weighted);
+    simd.scale(out->arr, mat->arr, scalar, mat->row * mat->col);
+}
+
+void subtract_mat(matrix_t *out, matrix_t *mat1, matrix_t *mat2)
+{
+    simd.sub(out->arr, mat1->arr, mat2->arr, out->row * out->col);
+}
 
-    vector_t error = init_vector(last_layer_activations->len);
-    subtract_vec(&error, last_layer_activations, expected_output);
+void scalar_multiply_vec(vector_t *out, vector_t *vec, float scalar)
+{
+    simd.scale(out->arr, vec->arr, scalar, out->len);
+}
 
-    hadamard_product(out, &error, &llw_dsig);
+void add_mat(matrix_t *out, matrix_t *mat1, matrix_t *mat2)
+{
+    simd.add(out->arr, mat1->arr, mat2->arr, out->row * out->col);
+}
 
-    free_vector(&llw_dsig);
-    free_vector(&error);
+// Blocking for the matrix-matrix kernels. A MC x KC panel of A is packed
+// to stay in L2, a KC x NR sliver of the packed B stays in L1 while the
+// micro-kernel walks down the A panel, and the MR x NR tile of C lives in
+// registers for the whole KC loop.
+#define GEMM_MR 6
+#define GEMM_NR 16
+#define GEMM_MC 120
+#define GEMM_KC 256
+#define GEMM_NC 1024
+
+static _Thread_local float packed_a[GEMM_MC * GEMM_KC] __attribute__((aligned(64)));
+static _Thread_local float packed_b[GEMM_KC * GEMM_NC] __attribute__((aligned(64)));
+
+// Packs op(A)[ic:ic+mc, pc:pc+kc] into MR row slivers, each stored column
+// by column so the micro-kernel reads it sequentially. Short slivers are
+// zero padded.
+static void pack_a(float *dst, const float *a, int lda, int trans,
+                   int ic, int pc, int mc, int kc)
+{
+    for (int ir = 0; ir < mc; ir += GEMM_MR)
+    {
+        int mr = mc - ir < GEMM_MR ? mc - ir : GEMM_MR;
+        for (int p = 0; p < kc; p++)
+        {
+            for (int i = 0; i < mr; i++)
+            {
+                int row = ic + ir + i;
+                int col = pc + p;
+                dst[i] = trans ? a[col * lda + row] : a[row * lda + col];
+            }
+            for (int i = mr; i < GEMM_MR; i++)
+            {
+                dst[i] = 0;
+            }
+            dst += GEMM_MR;
+        }
+    }
 }
 
-void layer_error(vector_t *out, 
-                 matrix_t *next_layer_weights,
-                 vector_t *next_layer_error,
-                 vector_t *current_layer_weighted)
+// Element i of a B that is float or half
+static inline float b_element(const void *b, precision_t precision, size_t i)
 {
-    vector_t clw_dsig = init_vector(current_layer_weighted->len);
-    dsigmoid_vec(&clw_dsig, current_layer_weighted);
+    if (precision == PRECISION_F32)
+        return ((const float *)b)[i];
+    return half_to_float1(((const uint16_t *)b)[i], precision);
+}
 
-    matrix_t nlwT = init_matrix(next_layer_weights->col, next_layer_weights->row);
-    transpose(&nlwT, next_layer_weights);
+// Packs op(B)[pc:pc+kc, jc:jc+nc] into NR column slivers, each stored row
+// by row. Short slivers are zero padded. A half B is widened here, so the
+// micro-kernel only ever sees floats.
+static void pack_b(float *dst, const void *b, precision_t precision, int ldb, int trans,
+                   int pc, int jc, int kc, int nc)
+{
+    for (int jr = 0; jr < nc; jr += GEMM_NR)
+    {
+        int nr = nc - jr < GEMM_NR ? nc - jr : GEMM_NR;
+        for (int p = 0; p < kc; p++)
+        {
+            int row = pc + p;
+            if (!trans && nr == GEMM_NR && precision == PRECISION_F32)
+            {
+                memcpy(dst, &((const float *)b)[row * ldb + jc + jr], GEMM_NR * sizeof(float));
+            }
+            else if (!trans && nr == GEMM_NR)
+            {
+                half_to_float(dst, &((const uint16_t *)b)[row * ldb + jc + jr], GEMM_NR, precision);
+            }
+            else
+            {
+                for (int j = 0; j < nr; j++)
+                {
+                    int col = jc + jr + j;
+                    dst[j] = b_element(b, precision, trans ? (size_t)col * ldb + row : (size_t)row * ldb + col);
+                }
+                for (int j = nr; j < GEMM_NR; j++)
+                {
+                    dst[j] = 0;
+                }
+            }
+            dst += GEMM_NR;
+        }
+    }
+}
 
-    vector_t product = init_vector(nlwT.row);
-    multiply_mat_vec(&product, &nlwT, next_layer_error);
+// One register of floats for the target, the micro-kernel keeps an
+// MR x NR tile of C in GEMM_MR * GEMM_NR / GEMM_VEC of them
+#ifdef __AVX__
+#define GEMM_VEC 8
+#else
+#define GEMM_VEC 4
+#endif
+typedef float gemm_vec_t __attribute__((vector_size(GEMM_VEC * sizeof(float))));
+
+// C[0:mr, 0:nr] = alpha * A_sliver * B_sliver + beta * C
+static void gemm_micro_kernel(int kc, const float *a, const float *b,
+                              float *c, int ldc, int mr, int nr,
+                              float alpha, float beta)
+{
+    gemm_vec_t acc[GEMM_MR][GEMM_NR / GEMM_VEC];
+    memset(acc, 0, sizeof(acc));
 
-    hadamard_product(out, &product, &clw_dsig);
+    for (int p = 0; p < kc; p++)
+    {
+        gemm_vec_t b_vec[GEMM_NR / GEMM_VEC];
+        memcpy(b_vec, b, sizeof(b_vec));
+        for (int i = 0; i < GEMM_MR; i++)
+        {
+            for (int j = 0; j < GEMM_NR / GEMM_VEC; j++)
+            {
+                acc[i][j] += a[i] * b_vec[j];
+            }
+        }
+        a += GEMM_MR;
+        b += GEMM_NR;
+    }
 
-    free_vector(&clw_dsig);
-    free_matrix(&nlwT);
-    free_vector(&product);
+    for (int i = 0; i < mr; i++)
+    {
+        float tile[GEMM_NR];
+        float *c_row = &c[i * ldc];
+        memcpy(tile, acc[i], sizeof(tile));
+        if (beta == 0)
+        {
+            for (int j = 0; j < nr; j++)
+                c_row[j] = alpha * tile[j];
+        }
+        else
+        {
+            for (int j = 0; j < nr; j++)
+                c_row[j] = alpha * tile[j] + beta * c_row[j];
+        }
+    }
 }
 
-inline void transpose(matrix_t *out, matrix_t* mat)
+// C = alpha * op(A) * op(B) + beta * C, with op(X) = X^T when trans_x is set.
+// All matrices are row major, op(A) is m x k and op(B) is k x n. B holds
+// floats, or halves of b_precision. epilogue, if not NULL, is applied to
+// each tile of C right after its last block along K is stored.
+static void sgemm(int trans_a, int trans_b, int m, int n, int k,
+                  float alpha, const float *a, int lda,
+                  const void *b, precision_t b_precision, int ldb,
+                  float beta, float *c, int ldc, const epilogue_t *epilogue)
 {
-    for (int i = 0; i < out->row; i++)
+    if (k == 0)
     {
-        for (int j = 0; j < out->col; j++)
+        for (int i = 0; i < m; i++)
+            for (int j = 0; j < n; j++)
+                c[i * ldc + j] = beta == 0 ? 0 : beta * c[i * ldc + j];
+        apply_epilogue(epilogue, c, ldc, 0, 0, m, n, 1);
+        return;
+    }
+
+    for (int jc = 0; jc < n; jc += GEMM_NC)
+    {
+        int nc = n - jc < GEMM_NC ? n - jc : GEMM_NC;
+        for (int pc = 0; pc < k; pc += GEMM_KC)
         {
-            out->arr[j + i * out->col] = mat->arr[i + j * mat->col];
+            int kc = k - pc < GEMM_KC ? k - pc : GEMM_KC;
+            // Only the first block along K applies beta, the rest accumulate
+            float beta_block = pc == 0 ? beta : 1;
+            const epilogue_t *last_block = pc + kc == k ? epilogue : NULL;
+
+            pack_b(packed_b, b, b_precision, ldb, trans_b, pc, jc, kc, nc);
+
+            for (int ic = 0; ic < m; ic += GEMM_MC)
+            {
+                int mc = m - ic < GEMM_MC ? m - ic : GEMM_MC;
+                pack_a(packed_a, a, lda, trans_a, ic, pc, mc, kc);
+
+                for (int jr = 0; jr < nc; jr += GEMM_NR)
+                {
+                    int nr = nc - jr < GEMM_NR ? nc - jr : GEMM_NR;
+                    for (int ir = 0; ir < mc; ir += GEMM_MR)
+                    {
+                        int mr = mc - ir < GEMM_MR ? mc - ir : GEMM_MR;
+                        float *tile = &c[(ic + ir) * ldc + jc + jr];
+                        gemm_micro_kernel(kc, &packed_a[ir * kc], &packed_b[jr * kc],
+                                          tile, ldc, mr, nr, alpha, beta_block);
+                        // While the tile is still in L1
+                        if (last_block != NULL)
+                            apply_epilogue(last_block, tile, ldc, ic + ir, jc + jr, mr, nr, 0);
+                    }
+                }
+            }
         }
     }
+    finish_rows(epilogue, c, ldc, m, n);
 }
 
-inline void multiply_vec_vec(matrix_t *out, vector_t *v1, vector_t *v2)
+void multiply_mat_mat(matrix_t *out, matrix_t *mat1, matrix_t *mat2)
 {
-    int k = 0;
-    float* arr1= v1->arr;
-    float* arr2 = v2->arr;
-    for (int i = 0; i < out->row; i++)
+    multiply_mat_mat_epilogue(out, mat1, mat2, NULL);
+}
+
+void multiply_mat_matT(matrix_t *out, matrix_t *mat1, matrix_t *mat2)
+{
+    multiply_mat_matT_epilogue(out, mat1, mat2, NULL);
+}
+
+void multiply_matT_mat(matrix_t *out, matrix_t *mat1, matrix_t *mat2)
+{
+    sgemm(1, 0, mat1->col, mat2->col, mat1->row,
+          1, mat1->arr, mat1->col, mat2->arr, PRECISION_F32, mat2->col,
+          0, out->arr, out->col, NULL);
+}
+
+void multiply_mat_halfT(matrix_t *out, matrix_t *mat1, half_matrix_t *mat2)
+{
+    multiply_mat_halfT_epilogue(out, mat1, mat2, NULL);
+}
+
+void multiply_mat_half(matrix_t *out, matrix_t *mat1, half_matrix_t *mat2)
+{
+    multiply_mat_half_epilogue(out, mat1, mat2, NULL);
+}
+
+void multiply_mat_mat_epilogue(matrix_t *out, matrix_t *mat1, matrix_t *mat2, const epilogue_t *epilogue)
+{
+    sgemm(0, 0, mat1->row, mat2->col, mat1->col,
+          1, mat1->arr, mat1->col, mat2->arr, PRECISION_F32, mat2->col,
+          0, out->arr, out->col, epilogue);
+}
+
+// Below this many rows the strided packing of mat2 costs more than it
+// saves, and each output is instead one dot product of two rows that are
+// already contiguous, as for single requests at inference
+#define DOT_PACK_ROWS 8
+
+void multiply_mat_matT_epilogue(matrix_t *out, matrix_t *mat1, matrix_t *mat2, const epilogue_t *epilogue)
+{
+    if (mat1->row < DOT_PACK_ROWS)
     {
-        for (int j = 0; j < out->col; j++)
+        for (int i = 0; i < mat1->row; i++)
         {
-            out->arr[k++] = arr1[i] * arr2[j];
+            const float *row = &mat1->arr[(size_t)i * mat1->col];
+            for (int j = 0; j < mat2->row; j++)
+            {
+                out->arr[(size_t)i * out->col + j] = simd.dot(row, &mat2->arr[(size_t)j * mat2->col], mat1->col);
+            }
         }
+        // Fewer rows than a packed panel, so out is still in cache
+        apply_epilogue(epilogue, out->arr, out->col, 0, 0, out->row, out->col, 1);
+        return;
     }
+    sgemm(0, 1, mat1->row, mat2->row, mat1->col,
+          1, mat1->arr, mat1->col, mat2->arr, PRECISION_F32, mat2->col,
+          0, out->arr, out->col, epilogue);
 }
 
-inline void scalar_multiply_mat(matrix_t *out, matrix_t *mat, float scalar)
+// Below this many rows the packing of B costs more than it saves, and the
+// half rows are streamed straight through the dot product kernels instead
+#define HALF_PACK_ROWS 64
+
+void multiply_mat_halfT_epilogue(matrix_t *out, matrix_t *mat1, half_matrix_t *mat2, const epilogue_t *epilogue)
 {
-    int max = mat->row*mat->col;
-    for (int i = 0; i < max; i+=4)
+    if (mat1->row < HALF_PACK_ROWS)
     {
-        out->arr[i] = mat->arr[i] * scalar;
-        out->arr[i+1] = mat->arr[i+1] * scalar;
-        out->arr[i+2] = mat->arr[i+2] * scalar;
-        out->arr[i+3] = mat->arr[i+3] * scalar;
+        memset(out->arr, 0, sizeof(float) * out->row * out->col);
+        half_gemm(out->arr, out->col, mat1->arr, mat1->col, mat1->row,
+                  mat2->arr, mat2->col, mat2->row, mat2->col, mat2->precision);
+        // Fewer rows than a packed panel, so out is still in cache
+        apply_epilogue(epilogue, out->arr, out->col, 0, 0, out->row, out->col, 1);
+        return;
     }
+    sgemm(0, 1, mat1->row, mat2->row, mat1->col,
+          1, mat1->arr, mat1->col, mat2->arr, mat2->precision, mat2->col,
+          0, out->arr, out->col, epilogue);
+}
+
+void multiply_mat_half_epilogue(matrix_t *out, matrix_t *mat1, half_matrix_t *mat2, const epilogue_t *epilogue)
+{
+    sgemm(0, 0, mat1->row, mat2->col, mat1->col,
+          1, mat1->arr, mat1->col, mat2->arr, mat2->precision, mat2->col,
+          0, out->arr, out->col, epilogue);
+}
+
+void hadamard_product_mat(matrix_t *out, matrix_t *mat1, matrix_t *mat2)
+{
+    simd.mul(out->arr, mat1->arr, mat2->arr, out->row * out->col);
 }
 
-inline void subtract_mat(matrix_t *out, matrix_t *mat1, matrix_t *mat2)
+void add_row_vec(matrix_t *out, matrix_t *mat, vector_t *vec)
 {
-    int max = out->row*out->col;
-    int i;
-    for (i = 0; i < max; i+=4)
+    for (int i = 0; i < mat->row; i++)
     {
-        out->arr[i] = mat1->arr[i] - mat2->arr[i];
-        out->arr[i+1] = mat1->arr[i+1] - mat2->arr[i+1];
-        out->arr[i+2] = mat1->arr[i+2] - mat2->arr[i+2];
-        out->arr[i+3] = mat1->arr[i+3] - mat2->arr[i+3];
+        simd.add(&out->arr[i * out->col], &mat->arr[i * mat->col], vec->arr, mat->col);
     }
 }
 
-inline void scalar_multiply_vec(vector_t *out, vector_t *vec, float scalar)
+void accumulate_rows(vector_t *out, matrix_t *mat)
 {
-    for (int i = 0; i < out->len; i++)
+    for (int i = 0; i < mat->row; i++)
     {
-        out->arr[i] = vec->arr[i] * scalar;
+        simd.add(out->arr, out->arr, &mat->arr[i * mat->col], mat->col);
     }
 }
 
-inline void add_mat(matrix_t *out, matrix_t *mat1, matrix_t *mat2)
+void accumulate_vec_vec(matrix_t *out, vector_t *v1, vector_t *v2, float scalar)
 {
-    int max = out->row*out->col;
-    int i;
-    for (i = 0; i < max; i+=4)
+    for (int i = 0; i < out->row; i++)
     {
-        out->arr[i] = mat1->arr[i] + mat2->arr[i];
-        out->arr[i+1] = mat1->arr[i+1] + mat2->arr[i+1];
-        out->arr[i+2] = mat1->arr[i+2] + mat2->arr[i+2];
-        out->arr[i+3] = mat1->arr[i+3] + mat2->arr[i+3];
+        simd.axpy(&out->arr[i * out->col], v2->arr, scalar * v1->arr[i], out->col);
     }
 }
+
+void accumulate_matT_mat(matrix_t *out, matrix_t *mat1, matrix_t *mat2, float scalar)
+{
+    sgemm(1, 0, mat1->col, mat2->col, mat1->row,
+          scalar, mat1->arr, mat1->col, mat2->arr, PRECISION_F32, mat2->col,
+          1, out->arr, out->col, NULL);
+}
@@ -2,7 +2,10 @@
 #include <string.h>
 #include <stdlib.h>
 #include <math.h>
+#ifdef _OPENMP
 #include <omp.h>
+#endif
+#include "nnHalf.h"
 
 #ifndef NN_MATH_H
 #define NN_MATH_H
@@ -20,6 +23,60 @@ typedef struct
     int len;
 } vector_t;
 
+// How sigmoid is evaluated, with the largest errors measured over every
+// finite float on every instruction set. SIGMOID_EXACT is within 2.5 ULP
+// for x >= -87, and 9e-8 absolute everywhere. SIGMOID_FAST uses a cheaper
+// exp and is within 1.9e-5 absolute and 7.9e-5 relative for x >= -87,
+// about 1200 ULP. test.c checks both bounds.
+typedef enum
+{
+    SIGMOID_EXACT,
+    SIGMOID_FAST
+} sigmoid_mode_t;
+
+// What a layer applies to its weighted outputs. The values are stored in
+// model files, so new ones go at the end.
+typedef enum
+{
+    ACTIVATION_SIGMOID,
+    ACTIVATION_RELU,
+    // x above 0, LEAKY_RELU_SLOPE * x below
+    ACTIVATION_LEAKY_RELU,
+    ACTIVATION_TANH,
+    // e^x / sum of e^x over each row of outputs, so it can't be applied a
+    // tile at a time like the others
+    ACTIVATION_SOFTMAX,
+    // x, the logits of a softmax cross-entropy output while training
+    ACTIVATION_LINEAR
+} activation_t;
+
+#define ACTIVATION_COUNT 6
+#define LEAKY_RELU_SLOPE 0.01f
+
+// Work a product does on its output while it is still in registers or
+// cache, instead of in passes over it afterwards
+typedef struct
+{
+    activation_t activation;
+    // Picks the exp of sigmoid, tanh and softmax
+    sigmoid_mode_t sigmoid_mode;
+    // Forward: out = activation(out + bias), bias added to every row, NULL
+    // adds none
+    const float *bias;
+    // Backward when set: out *= activation'(activated), with activated the
+    // layer's outputs laid out like out
+    const float *activated;
+} epilogue_t;
+
+// One zeroed, 64-byte aligned block that vectors and matrices are carved
+// out of, so a hot path can reuse memory instead of allocating it
+typedef struct
+{
+    float *arr;
+    size_t len;
+    size_t used;
+} arena_t;
+
 // Allocates space of a matrix and a vector
 vector_t init_vector(int len);
 matrix_t init_matrix(int row, int col);
@@ -32,8 +89,65 @@ vector_t *allocate_vec();
 void free_vector(vector_t *vec);
 void free_matrix(matrix_t *mat);
 
+// Counts a heap allocation made outside the functions above
+void *allocate_bytes(size_t size);
+
+// Number of heap allocations made through this file since startup, for
+// checking that a code path does not allocate
+long allocation_count();
+
+// Floats an arena needs to hold len floats, rounded up to keep every
+// block carved from it 64-byte aligned
+size_t arena_len(size_t len);
+
+// Allocates an arena of len floats. Vectors and matrices taken from it
+// are views, they are freed all at once with free_arena() and must not be
+// passed to free_vector() or free_matrix().
+arena_t init_arena(size_t len);
+void free_arena(arena_t *arena);
+float *arena_alloc(arena_t *arena, size_t len);
+vector_t arena_vector(arena_t *arena, int len);
+matrix_t arena_matrix(arena_t *arena, int row, int col);
+
+// Allocates a half matrix, and rounds the floats of mat into out, which
+// has the same shape
+half_matrix_t init_half_matrix(int row, int col, precision_t precision);
+void free_half_matrix(half_matrix_t *mat);
+void round_half_matrix(half_matrix_t *out, matrix_t *mat);
+
 // Multiply a matrix with a vector
 void multiply_mat_vec(vector_t *out, matrix_t *mat, vector_t *vec);
+// Multiply the transpose of a matrix with a vector without building the
+// transpose, out += mat^T * vec. Like multiply_mat_vec it adds to out.
+void multiply_matT_vec(vector_t *out, matrix_t *mat, vector_t *vec);
+
+// multiply_mat_vec() and multiply_matT_vec() with half weights, which are
+// widened as they are read and summed in float
+void multiply_half_vec(vector_t *out, half_matrix_t *mat, vector_t *vec);
+void multiply_halfT_vec(vector_t *out, half_matrix_t *mat, vector_t *vec);
+
+// The products of a layer, out = epilogue(mat * vec) and
+// out = epilogue(mat^T * vec), not adding to out
+void multiply_mat_vec_epilogue(vector_t *out, matrix_t *mat, vector_t *vec, const epilogue_t *epilogue);
+void multiply_half_vec_epilogue(vector_t *out, half_matrix_t *mat, vector_t *vec, const epilogue_t *epilogue);
+void multiply_matT_vec_epilogue(vector_t *out, matrix_t *mat, vector_t *vec, const epilogue_t *epilogue);
+void multiply_halfT_vec_epilogue(vector_t *out, half_matrix_t *mat, vector_t *vec, const epilogue_t *epilogue);
+
+// Multiply two matrices, out = mat1 * mat2
+void multiply_mat_mat(matrix_t *out, matrix_t *mat1, matrix_t *mat2);
+// out = mat1 * mat2^T, used for a batch of row samples times a weight matrix
+void multiply_mat_matT(matrix_t *out, matrix_t *mat1, matrix_t *mat2);
+// out = mat1^T * mat2, used for summing the outer products of a batch
+void multiply_matT_mat(matrix_t *out, matrix_t *mat1, matrix_t *mat2);
+// multiply_mat_matT() and multiply_mat_mat() with half mat2, summed in float
+void multiply_mat_halfT(matrix_t *out, matrix_t *mat1, half_matrix_t *mat2);
+void multiply_mat_half(matrix_t *out, matrix_t *mat1, half_matrix_t *mat2);
+// The products above with epilogue applied to each tile of out as the
+// product finishes it. NULL does nothing more.
+void multiply_mat_mat_epilogue(matrix_t *out, matrix_t *mat1, matrix_t *mat2, const epilogue_t *epilogue);
+void multiply_mat_matT_epilogue(matrix_t *out, matrix_t *mat1, matrix_t *mat2, const epilogue_t *epilogue);
+void multiply_mat_halfT_epilogue(matrix_t *out, matrix_t *mat1, half_matrix_t *mat2, const epilogue_t *epilogue);
+void multiply_mat_half_epilogue(matrix_t *out, matrix_t *mat1, half_matrix_t *mat2, const epilogue_t *epilogue);
 // Add two vectors
 void add_vec(vector_t *out, vector_t *v1, vector_t *v2);
 // Subtract two vectors
@@ -45,33 +159,56 @@ float sigmoid(float val);
 // Sigmoid of a matrix
 void sigmoid_mat(matrix_t *out, matrix_t *mat);
 // Sigmoid derivative of a matrix
-void dsigmoid(matrix_t *out, matrix_t *mat);
+void dsigmoid_mat(matrix_t *out, matrix_t *mat);
 
 // Sigmoid of a vector
 void sigmoid_vec(vector_t *out, vector_t *vec);
 // Sigmoid derivative of a vector
 void dsigmoid_vec(vector_t *out, vector_t *vec);
 
+// Sigmoid of a vector or matrix evaluated with the given mode
+void sigmoid_vec_mode(vector_t *out, vector_t *vec, sigmoid_mode_t mode);
+void sigmoid_mat_mode(matrix_t *out, matrix_t *mat, sigmoid_mode_t mode);
+
+// Sigmoid derivative from the already activated outputs, a * (1 - a),
+// which saves evaluating the sigmoid a second time
+void dsigmoid_activated_vec(vector_t *out, vector_t *activated);
+void dsigmoid_activated_mat(matrix_t *out, matrix_t *activated);
+
 void hadamard_product(vector_t *out, vector_t *vec1, vector_t *vec2);
 
-// Gets the error at the output layer
-// last_layer_activations - output of last layer after sigmoid
-// last_layer_weighted - output of last layer before sigmoid
+// Gets the error at the output layer, (a - y) * activation'(a) in one pass
+// last_layer_activations - output of last layer after its activation
 void output_error(vector_t *out,
                   vector_t *expected_output,
                   vector_t *last_layer_activations,
-                  vector_t *last_layer_weighted);
+                  activation_t activation);
+
+// output_error() for a batch of samples, one per row
+void output_error_mat(matrix_t *out, matrix_t *expected_outputs, matrix_t *activations, activation_t activation);
+
+// Half the squared distance of each row of activations from its expected
+// outputs, summed over the rows
+float quadratic_loss_mat(matrix_t *activations, matrix_t *expected_outputs);
+
+// Softmax cross-entropy of rows of logits in one pass per row: the logits
+// are replaced by the softmax, out gets its gradient p - y, and the summed
+// loss is returned. The loss is taken from the log-sum-exp of the logits,
+// so it stays finite however confident a wrong answer is.
+float cross_entropy_mat(matrix_t *out, matrix_t *logits, matrix_t *expected_outputs, sigmoid_mode_t mode);
 
 void transpose(matrix_t *out, matrix_t *mat);
 
 // Gets the error of all layers except output
 // next_layer_weights - weights of next layer
 // next_layer_error - error of the next layer
-// output of the current layer before sigmoid
+// current_layer_activations - output of the current layer after its
+// activation
 void layer_error(vector_t *out,
                  matrix_t *next_layer_weights,
                  vector_t *next_layer_error,
-                 vector_t *current_layer_weighted);
+                 vector_t *current_layer_activations,
+                 activation_t activation);
 
 void multiply_vec_vec(matrix_t *out, vector_t *v1, vector_t *v2);
 
@@ -83,4 +220,20 @@ void scalar_multiply_vec(vector_t *out, vector_t *vec, float scalar);
 
 void add_mat(matrix_t *out, matrix_t *mat1, matrix_t *mat2);
 
+void hadamard_product_mat(matrix_t *out, matrix_t *mat1, matrix_t *mat2);
+
+// Adds vec to every row of mat
+void add_row_vec(matrix_t *out, matrix_t *mat, vector_t *vec);
+
+// Adds every row of mat to out
+void accumulate_rows(vector_t *out, matrix_t *mat);
+
+// out += scalar * v1 * v2^T, the outer product added to out in one pass
+// without being built first
+void accumulate_vec_vec(matrix_t *out, vector_t *v1, vector_t *v2, float scalar);
+
+// out += scalar * mat1^T * mat2, the sum of the outer products of the rows
+// of mat1 and mat2 added to out as a single matrix multiply
+void accumulate_matT_mat(matrix_t *out, matrix_t *mat1, matrix_t *mat2, float scalar);
+
 #endif
\ No newline at end of file
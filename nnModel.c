@@ -0,0 +1,387 @@
+#include "nnModel.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// CRC-32 (IEEE, reflected 0xEDB88320) eight bytes at a time, crc_table[k]
+// advances a byte that is k more bytes away from the end of the block
+static uint32_t crc_table[8][256];
+
+__attribute__((constructor)) static void crc_init()
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+        crc_table[0][i] = crc;
+    }
+    for (int k = 1; k < 8; k++)
+    {
+        for (int i = 0; i < 256; i++)
+            crc_table[k][i] = (crc_table[k - 1][i] >> 8) ^ crc_table[0][crc_table[k - 1][i] & 255];
+    }
+}
+
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+
+    crc = ~crc;
+    for (; len >= 8; p += 8, len -= 8)
+    {
+        uint32_t low = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+        crc = crc_table[7][low & 255] ^ crc_table[6][(low >> 8) & 255] ^
+              crc_table[5][(low >> 16) & 255] ^ crc_table[4][low >> 24] ^
+              crc_table[3][p[4]] ^ crc_table[2][p[5]] ^ crc_table[1][p[6]] ^ crc_table[0][p[7]];
+    }
+    for (size_t i = 0; i < len; i++)
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ p[i]) & 255];
+    return ~crc;
+}
+
+uint64_t align_offset(uint64_t offset)
+{
+    return (offset + MODEL_ALIGN - 1) / MODEL_ALIGN * MODEL_ALIGN;
+}
+
+int write_blob(FILE *file, uint32_t *crc, uint64_t *offset, const void *data, size_t len, int pad)
+{
+    static const unsigned char zeros[MODEL_ALIGN];
+
+    if (len > 0 && fwrite(data, 1, len, file) != len)
+        return -1;
+    *crc = crc32_update(*crc, data, len);
+    *offset += len;
+
+    size_t padding = pad ? align_offset(*offset) - *offset : 0;
+    if (padding > 0 && fwrite(zeros, 1, padding, file) != padding)
+        return -1;
+    *crc = crc32_update(*crc, zeros, padding);
+    *offset += padding;
+
+    return 0;
+}
+
+static uint32_t precision_dtype(precision_t precision)
+{
+    return precision == PRECISION_FP16 ? MODEL_F16 : precision == PRECISION_BF16 ? MODEL_BF16 : MODEL_F32;
+}
+
+int save_model(neural_net_t *network, const char *path, const model_section_t *sections, int num_sections)
+{
+    int half = network->precision != PRECISION_F32;
+    size_t weight_size = half ? sizeof(uint16_t) : sizeof(float);
+
+    model_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MODEL_MAGIC, sizeof(MODEL_MAGIC));
+    header.version = MODEL_VERSION;
+    header.endian = MODEL_ENDIAN;
+    header.num_layers = network->num_layers;
+    header.dtype = precision_dtype(network->precision);
+    header.alignment = MODEL_ALIGN;
+
+    model_layer_t *table = (model_layer_t *)allocate_bytes(sizeof(model_layer_t) * network->num_layers);
+    uint64_t offset = align_offset(sizeof(header) + sizeof(model_layer_t) * network->num_layers);
+    for (int i = 0; i < network->num_layers; i++)
+    {
+        table[i].length = network->layers[i].length;
+        table[i].activation = network->layers[i].activation;
+        if (i == 0)
+            continue;
+
+        table[i].weights_offset = offset;
+        offset = align_offset(offset + weight_size * network->layers[i].weights.row * network->layers[i].weights.col);
+        table[i].biases_offset = offset;
+        offset = align_offset(offset + sizeof(float) * network->layers[i].biases.len);
+    }
+    header.sections_offset = num_sections > 0 ? offset : 0;
+    header.num_sections = num_sections;
+    for (int i = 0; i < num_sections; i++)
+        offset = align_offset(offset + sizeof(model_section_header_t) + sections[i].len);
+    header.file_len = offset;
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "couldn't create %s\n", path);
+        free(table);
+        return -1;
+    }
+
+    // The header goes in with a zero crc, which is rewritten at the end
+    uint32_t crc = 0;
+    offset = 0;
+    int failed = write_blob(file, &crc, &offset, &header, sizeof(header), 0) ||
+                 write_blob(file, &crc, &offset, table, sizeof(model_layer_t) * network->num_layers, 1);
+    // The float parameter slab is laid out like the file, padding and all
+    if (!half && !failed)
+        failed = write_blob(file, &crc, &offset, network->params.arr, sizeof(float) * network->params.len, 1);
+    for (int i = 1; i < network->num_layers && half && !failed; i++)
+    {
+        layer_t *layer = &network->layers[i];
+        failed = write_blob(file, &crc, &offset, layer->half_weights.arr, weight_size * layer->weights.row * layer->weights.col, 1) ||
+                 write_blob(file, &crc, &offset, layer->biases.arr, sizeof(float) * layer->biases.len, 1);
+    }
+    for (int i = 0; i < num_sections && !failed; i++)
+    {
+        model_section_header_t section = {sections[i].tag, 0, sections[i].len};
+        failed = write_blob(file, &crc, &offset, &section, sizeof(section), 0) ||
+                 write_blob(file, &crc, &offset, sections[i].data, sections[i].len, 1);
+    }
+
+    header.crc = crc;
+    if (!failed)
+        failed = fseek(file, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, file) != 1;
+    // A checkpoint is only renamed over the last one once it is on disk
+    if (!failed)
+        failed = fflush(file) != 0 || fsync(fileno(file)) != 0;
+    failed = fclose(file) != 0 || failed;
+    free(table);
+
+    if (failed)
+    {
+        fprintf(stderr, "couldn't write %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+int is_model_file(const char *path)
+{
+    char magic[sizeof(MODEL_MAGIC)];
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return 0;
+
+    int found = fread(magic, 1, sizeof(magic), file) == sizeof(magic) && memcmp(magic, MODEL_MAGIC, sizeof(magic)) == 0;
+    fclose(file);
+    return found;
+}
+
+int blob_fits(uint64_t offset, uint64_t len, size_t map_len)
+{
+    return offset % MODEL_ALIGN == 0 && offset <= map_len && map_len - offset >= len;
+}
+
+// Checks what every dtype shares: the header, that the layer table and
+// sections lie inside the file, and the layer sizes and activations
+static int check_header(const unsigned char *map, size_t map_len, const char *path)
+{
+    const model_header_t *header = (const model_header_t *)map;
+
+    if (map_len < sizeof(model_header_t) || memcmp(header->magic, MODEL_MAGIC, sizeof(MODEL_MAGIC)) != 0)
+    {
+        fprintf(stderr, "%s is not a model file\n", path);
+        return -1;
+    }
+    if (header->version != MODEL_VERSION || header->endian != MODEL_ENDIAN)
+    {
+        fprintf(stderr, "%s is model format version %u, or from a machine of the other byte order\n", path, header->version);
+        return -1;
+    }
+    if (header->alignment != MODEL_ALIGN)
+    {
+        fprintf(stderr, "%s has unsupported alignment %u\n", path, header->alignment);
+        return -1;
+    }
+    if (header->file_len != map_len || header->num_layers < 2 ||
+        sizeof(model_header_t) + sizeof(model_layer_t) * (uint64_t)header->num_layers > map_len)
+    {
+        fprintf(stderr, "%s is truncated or has a bad layer count\n", path);
+        return -1;
+    }
+
+    const model_layer_t *table = (const model_layer_t *)(map + sizeof(model_header_t));
+    for (uint32_t i = 0; i < header->num_layers; i++)
+    {
+        if (table[i].length == 0 || table[i].activation >= ACTIVATION_COUNT)
+        {
+            fprintf(stderr, "%s has a bad layer %u\n", path, i);
+            return -1;
+        }
+    }
+
+    uint64_t offset = header->sections_offset;
+    for (uint32_t i = 0; i < header->num_sections; i++)
+    {
+        const model_section_header_t *section = (const model_section_header_t *)(map + offset);
+        if (!blob_fits(offset, sizeof(*section), map_len) ||
+            map_len - offset - sizeof(*section) < section->len)
+        {
+            fprintf(stderr, "%s has section %u outside the file\n", path, i);
+            return -1;
+        }
+        offset = align_offset(offset + sizeof(*section) + section->len);
+    }
+
+    return 0;
+}
+
+unsigned char *map_model(const char *path, size_t *map_len, int verify)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        fprintf(stderr, "couldn't open %s\n", path);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    // Copy on write, so training can go on from the loaded weights without
+    // touching the file
+    *map_len = st.st_size;
+    unsigned char *map = (unsigned char *)mmap(NULL, *map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "couldn't map %s\n", path);
+        return NULL;
+    }
+
+    if (check_header(map, *map_len, path) == -1)
+    {
+        munmap(map, *map_len);
+        return NULL;
+    }
+
+    model_header_t *header = (model_header_t *)map;
+    if (verify)
+    {
+        uint32_t expected = header->crc;
+        header->crc = 0;
+        uint32_t crc = crc32_update(0, map, *map_len);
+        header->crc = expected;
+        if (crc != expected)
+        {
+            fprintf(stderr, "%s fails its checksum\n", path);
+            munmap(map, *map_len);
+            return NULL;
+        }
+    }
+
+    return map;
+}
+
+int verify_model(const char *path)
+{
+    size_t map_len;
+    unsigned char *map = map_model(path, &map_len, 1);
+    if (map == NULL)
+        return -1;
+    munmap(map, map_len);
+    return 0;
+}
+
+const void *model_section(neural_net_t *network, uint32_t tag, size_t *len)
+{
+    if (network->map == NULL)
+        return NULL;
+
+    const unsigned char *map = (const unsigned char *)network->map;
+    const model_header_t *header = (const model_header_t *)map;
+    uint64_t offset = header->sections_offset;
+
+    // check_header() has walked the chain already
+    for (uint32_t i = 0; i < header->num_sections; i++)
+    {
+        const model_section_header_t *section = (const model_section_header_t *)(map + offset);
+        if (section->tag == tag)
+        {
+            *len = section->len;
+            return section + 1;
+        }
+        offset = align_offset(offset + sizeof(*section) + section->len);
+    }
+    return NULL;
+}
+
+int load_model(neural_net_t *network, const char *path, int verify)
+{
+    size_t map_len;
+    unsigned char *map = map_model(path, &map_len, verify);
+    if (map == NULL)
+        return -1;
+
+    model_header_t *header = (model_header_t *)map;
+    const model_layer_t *table = (const model_layer_t *)(map + sizeof(model_header_t));
+    precision_t precision = header->dtype == MODEL_F16 ? PRECISION_FP16 : header->dtype == MODEL_BF16 ? PRECISION_BF16 : PRECISION_F32;
+    size_t weight_size = precision == PRECISION_F32 ? sizeof(float) : sizeof(uint16_t);
+    int failed = precision_dtype(precision) != header->dtype;
+    if (failed)
+        fprintf(stderr, "%s holds dtype %u weights, not floats or halves\n", path, header->dtype);
+
+    for (uint32_t i = 1; i < header->num_layers && !failed; i++)
+    {
+        failed = !blob_fits(table[i].weights_offset, weight_size * (uint64_t)table[i].length * table[i - 1].length, map_len) ||
+                 !blob_fits(table[i].biases_offset, sizeof(float) * (uint64_t)table[i].length, map_len);
+        if (failed)
+            fprintf(stderr, "%s has layer %u outside the file\n", path, i);
+    }
+    if (failed)
+    {
+        munmap(map, map_len);
+        return -1;
+    }
+
+    neural_net_t net;
+    net.num_layers = header->num_layers;
+    net.sigmoid_mode = SIGMOID_EXACT;
+    net.precision = precision;
+    net.optimizer = NULL;
+    net.loss = LOSS_QUADRATIC;
+    net.map = map;
+    net.map_len = map_len;
+    net.layers = (layer_t *)allocate_bytes(sizeof(layer_t) * net.num_layers);
+    for (int i = 0; i < net.num_layers; i++)
+    {
+        net.layers[i].length = table[i].length;
+        net.layers[i].activation = (activation_t)table[i].activation;
+        net.layers[i].half_weights.arr = NULL;
+    }
+    size_t params_len = layout_params(net.layers, net.num_layers);
+
+    // Float parameters saved the way the slab lays them out are used where
+    // they are, nothing is read until it is touched
+    uint64_t base = table[1].weights_offset;
+    int in_place = precision == PRECISION_F32 && blob_fits(base, sizeof(float) * (uint64_t)params_len, map_len);
+    for (int i = 1; i < net.num_layers && in_place; i++)
+    {
+        in_place = table[i].weights_offset == base + sizeof(float) * net.layers[i].weights_offset &&
+                   table[i].biases_offset == base + sizeof(float) * net.layers[i].biases_offset;
+    }
+    attach_slabs(&net, in_place ? (float *)(map + base) : NULL);
+
+    for (int i = 1; i < net.num_layers && !in_place; i++)
+    {
+        layer_t *layer = &net.layers[i];
+        size_t weights = (size_t)layer->weights.row * layer->weights.col;
+        if (precision != PRECISION_F32)
+        {
+            layer->half_weights.arr = (uint16_t *)(map + table[i].weights_offset);
+            layer->half_weights.row = layer->weights.row;
+            layer->half_weights.col = layer->weights.col;
+            layer->half_weights.precision = precision;
+            half_to_float(layer->weights.arr, layer->half_weights.arr, weights, precision);
+        }
+        else
+        {
+            memcpy(layer->weights.arr, map + table[i].weights_offset, sizeof(float) * weights);
+        }
+        memcpy(layer->biases.arr, map + table[i].biases_offset, sizeof(float) * layer->biases.len);
+    }
+
+    net.workspace.num_workers = 0;
+    reserve_workspace(&net, 1, 1);
+
+    *network = net;
+    return 0;
+}
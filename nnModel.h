@@ -0,0 +1,122 @@
+#ifndef NN_MODEL_H
+#define NN_MODEL_H
+
+#include <stdint.h>
+#include "NeuralNet.h"
+
+// Binary model file, in native byte order:
+//   model_header_t
+//   model_layer_t for every layer, the input layer included
+//   the weights and biases of layers 1 and up, each blob starting on a
+//   MODEL_ALIGN byte boundary of the file
+//   optional tagged sections of training state, each a
+//   model_section_header_t followed by its data, also aligned
+// The CRC covers the whole file with the crc field zeroed.
+#define MODEL_MAGIC "NNMODEL"
+#define MODEL_VERSION 1
+#define MODEL_ALIGN 64
+#define MODEL_ENDIAN 0x01020304u
+
+// Tensor dtypes
+#define MODEL_F32 0
+// Written and read by nnQuant.h, see there for the layout
+#define MODEL_I8 1
+// Half weights with float biases, laid out like MODEL_F32
+#define MODEL_F16 2
+#define MODEL_BF16 3
+
+// Layer activations, the values of activation_t
+#define MODEL_ACT_SIGMOID 0
+#define MODEL_ACT_RELU 1
+#define MODEL_ACT_LEAKY_RELU 2
+#define MODEL_ACT_TANH 3
+#define MODEL_ACT_SOFTMAX 4
+#define MODEL_ACT_LINEAR 5
+
+// Section tags. A loader skips the tags it doesn't know.
+#define MODEL_SECTION_TRAINING 1
+// optimizer_section_t and the state, see nnOptimizer.h. Tag 2 held the
+// state interleaved layer by layer, which is no longer read.
+#define MODEL_SECTION_OPTIMIZER 3
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t endian;
+    uint32_t num_layers;
+    uint32_t dtype;
+    uint32_t alignment;
+    uint32_t crc;
+    uint64_t file_len;
+    uint64_t sections_offset;
+    uint32_t num_sections;
+    uint8_t reserved[12];
+} model_header_t;
+
+typedef struct
+{
+    uint32_t length;
+    uint8_t activation;
+    uint8_t reserved[3];
+    // 0 for the input layer, which has no parameters
+    uint64_t weights_offset;
+    uint64_t biases_offset;
+} model_layer_t;
+
+typedef struct
+{
+    uint32_t tag;
+    uint32_t reserved;
+    uint64_t len;
+} model_section_header_t;
+
+// A section to be saved
+typedef struct
+{
+    uint32_t tag;
+    const void *data;
+    size_t len;
+} model_section_t;
+
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len);
+
+// Rounds offset up to MODEL_ALIGN
+uint64_t align_offset(uint64_t offset);
+
+// Writes len bytes at *offset and adds them to crc, zero padded up to the
+// next MODEL_ALIGN boundary when pad is set. Returns -1 on a short write.
+int write_blob(FILE *file, uint32_t *crc, uint64_t *offset, const void *data, size_t len, int pad);
+
+// Writes the layer sizes, weights and biases of network and the given
+// sections, and syncs the file to disk. A network in half precision writes
+// its half weights. Returns 0, or -1 after printing why to stderr.
+int save_model(neural_net_t *network, const char *path, const model_section_t *sections, int num_sections);
+
+// Maps a model file copy on write and checks its header, layer table and
+// sections, and with verify its CRC. Returns the mapping, or NULL after
+// printing why to stderr.
+unsigned char *map_model(const char *path, size_t *map_len, int verify);
+
+// Checks the CRC of a model file. Loading doesn't, as that reads every page
+// before the first inference. Returns 0, or -1 after printing why to stderr.
+int verify_model(const char *path);
+
+// Whether a blob of len bytes at offset is aligned and inside the file
+int blob_fits(uint64_t offset, uint64_t len, size_t map_len);
+
+// Maps the file copy on write and uses its float weights and biases as the
+// network's parameter slab, nothing is read until it is touched. Half
+// weights are mapped as the network's half copy and widened into an
+// allocated slab, and the network is left in that precision. verify checks the CRC, which
+// reads the whole file. Returns 0, or -1 after printing why to stderr.
+int load_model(neural_net_t *network, const char *path, int verify);
+
+// The data of the first section tagged tag in the file network was loaded
+// from, NULL if there is none
+const void *model_section(neural_net_t *network, uint32_t tag, size_t *len);
+
+// Whether path starts with MODEL_MAGIC
+int is_model_file(const char *path);
+
+#endif
@@ -0,0 +1,110 @@
+#include "nnOptimizer.h"
+#include "nnModel.h"
+#include "nnSimd.h"
+#include "nnProfile.h"
+
+void init_optimizer(optimizer_t *optimizer, neural_net_t *network, optimizer_kind_t kind)
+{
+    memset(optimizer, 0, sizeof(*optimizer));
+    optimizer->kind = kind;
+    optimizer->beta1 = 0.9f;
+    optimizer->beta2 = 0.999f;
+    optimizer->epsilon = 1e-8f;
+    optimizer->slots = kind == OPTIMIZER_ADAM ? 2 : kind == OPTIMIZER_SGD ? 0 : 1;
+
+    optimizer->arena = init_arena(network->params.len * optimizer->slots);
+    for (int slot = 0; slot < optimizer->slots; slot++)
+    {
+        optimizer->state[slot] = arena_alloc(&optimizer->arena, network->params.len);
+    }
+}
+
+void free_optimizer(optimizer_t *optimizer)
+{
+    free_arena(&optimizer->arena);
+}
+
+// One kind's update of n parameters from the state arrays of slot 0 and 1
+static void update(optimizer_t *optimizer, float *w, float *state0, float *state1, const float *g,
+                   float scale, float lr, float eps, int n)
+{
+    switch (optimizer->kind)
+    {
+    case OPTIMIZER_SGD:
+        simd.axpy(w, g, -lr * scale, n);
+        break;
+    case OPTIMIZER_MOMENTUM:
+        simd.momentum(w, state0, g, scale, lr, optimizer->beta1, n);
+        break;
+    case OPTIMIZER_NESTEROV:
+        simd.nesterov(w, state0, g, scale, lr, optimizer->beta1, n);
+        break;
+    case OPTIMIZER_RMSPROP:
+        simd.rmsprop(w, state0, g, scale, lr, optimizer->beta1, eps, n);
+        break;
+    case OPTIMIZER_ADAM:
+        simd.adam(w, state0, state1, g, scale, lr, optimizer->beta1, optimizer->beta2, eps, n);
+        break;
+    }
+}
+
+void optimizer_step(optimizer_t *optimizer, neural_net_t *network, const float *gradients, int batch_size,
+                    float learning_rate)
+{
+    float scale = 1.0f / (float)batch_size;
+    float lr = learning_rate;
+    float eps = optimizer->epsilon;
+    optimizer->step++;
+
+    // Adam's bias correction folded into the step size and epsilon, which
+    // gives the same update as correcting both moments
+    if (optimizer->kind == OPTIMIZER_ADAM)
+    {
+        double correction2 = sqrt(1 - pow(optimizer->beta2, (double)optimizer->step));
+        lr = (float)(learning_rate * correction2 / (1 - pow(optimizer->beta1, (double)optimizer->step)));
+        eps = (float)(optimizer->epsilon * correction2);
+    }
+
+    // The weights, gradients and state read and the weights and state
+    // written
+    PROFILE_START(update_start);
+    update(optimizer, network->params.arr, optimizer->state[0], optimizer->state[1], gradients,
+           scale, lr, eps, (int)network->params.len);
+    PROFILE_STOP(update_start, PROFILE_UPDATE, 0, 0, (3.0 + 2 * optimizer->slots) * sizeof(float) * network->params.len);
+
+    for (int i = 1; i < network->num_layers; i++)
+    {
+        layer_t *layer = &network->layers[i];
+        if (layer->half_weights.arr != NULL)
+            round_half_matrix(&layer->half_weights, &layer->weights);
+    }
+}
+
+size_t optimizer_section_len(optimizer_t *optimizer)
+{
+    return sizeof(optimizer_section_t) + sizeof(float) * optimizer->arena.used;
+}
+
+void write_optimizer_section(optimizer_t *optimizer, void *out)
+{
+    optimizer_section_t header = {optimizer->kind, optimizer->slots, optimizer->step, optimizer->arena.used};
+    memcpy(out, &header, sizeof(header));
+    memcpy((char *)out + sizeof(header), optimizer->arena.arr, sizeof(float) * optimizer->arena.used);
+}
+
+int restore_optimizer(optimizer_t *optimizer, neural_net_t *network)
+{
+    size_t len;
+    const char *saved = (const char *)model_section(network, MODEL_SECTION_OPTIMIZER, &len);
+    if (saved == NULL || len != optimizer_section_len(optimizer))
+        return -1;
+
+    optimizer_section_t header;
+    memcpy(&header, saved, sizeof(header));
+    if (header.kind != (uint32_t)optimizer->kind || header.len != optimizer->arena.used)
+        return -1;
+
+    optimizer->step = header.step;
+    memcpy(optimizer->arena.arr, saved + sizeof(header), sizeof(float) * optimizer->arena.used);
+    return 0;
+}
@@ -0,0 +1,73 @@
+#ifndef NN_OPTIMIZER_H
+#define NN_OPTIMIZER_H
+
+#include <stdint.h>
+#include "NeuralNet.h"
+
+typedef enum
+{
+    // w -= lr * g, what update_weights() does
+    OPTIMIZER_SGD,
+    OPTIMIZER_MOMENTUM,
+    OPTIMIZER_NESTEROV,
+    OPTIMIZER_RMSPROP,
+    OPTIMIZER_ADAM
+} optimizer_kind_t;
+
+// Most state arrays any kind keeps per parameter, Adam's two moments
+#define OPTIMIZER_SLOTS 2
+
+// The update rule train_step() applies to the summed gradients when a
+// network's optimizer points at one. Each slot of per-parameter state is a
+// zeroed copy of the network's parameter slab layout, so an update is one
+// streaming pass over the parameters, gradients and state together.
+// Padding between blocks is zero in all of them and stays zero.
+struct optimizer
+{
+    optimizer_kind_t kind;
+    // Momentum for momentum and Nesterov, the decay of the mean square for
+    // RMSProp, beta1 for Adam
+    float beta1;
+    // beta2 for Adam
+    float beta2;
+    float epsilon;
+    // Updates made so far, for Adam's bias correction
+    int64_t step;
+
+    int slots;
+    // The slots one after the other
+    arena_t arena;
+    float *state[OPTIMIZER_SLOTS];
+};
+
+// Leading the optimizer's MODEL_SECTION_OPTIMIZER section in a checkpoint,
+// followed by len floats of state
+typedef struct
+{
+    uint32_t kind;
+    uint32_t slots;
+    int64_t step;
+    uint64_t len;
+} optimizer_section_t;
+
+// Sizes the state to network with the usual defaults for kind, 0.9 momentum,
+// RMSProp decay 0.9, Adam betas 0.9 and 0.999, and 1e-8 epsilon. Set
+// network->optimizer to use it.
+void init_optimizer(optimizer_t *optimizer, neural_net_t *network, optimizer_kind_t kind);
+void free_optimizer(optimizer_t *optimizer);
+
+// Updates the parameters of network from the gradients summed over
+// batch_size samples in gradients, laid out like the parameter slab
+void optimizer_step(optimizer_t *optimizer, neural_net_t *network, const float *gradients, int batch_size,
+                    float learning_rate);
+
+// Bytes of the optimizer's checkpoint section, and writes it to out
+size_t optimizer_section_len(optimizer_t *optimizer);
+void write_optimizer_section(optimizer_t *optimizer, void *out);
+
+// Restores the state saved in the checkpoint network was loaded from.
+// Returns 0, or -1 if there is none or it is of another kind or size, which
+// leaves the state as it was.
+int restore_optimizer(optimizer_t *optimizer, neural_net_t *network);
+
+#endif
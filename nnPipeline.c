@@ -0,0 +1,181 @@
+#include "nnPipeline.h"
+#include "nnProfile.h"
+#include <sys/mman.h>
+#include <time.h>
+
+static double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Gathers the batch at the producer's position into the slot at tail and
+// moves the position on. Returns 0 once the last epoch has been produced.
+static int produce_batch(pipeline_t *pipeline)
+{
+    dataset_t *dataset = pipeline->dataset;
+
+    if (pipeline->row >= dataset->count)
+    {
+        pipeline->epoch++;
+        pipeline->row = 0;
+        pipeline->released = 0;
+    }
+    if (pipeline->epoch >= pipeline->last_epoch)
+        return 0;
+    if (pipeline->row == 0 && pipeline->sampler != NULL)
+        sampler_epoch(pipeline->sampler, pipeline->epoch);
+
+    int j = pipeline->row;
+    int rows = dataset->count - j < pipeline->batch_size ? dataset->count - j : pipeline->batch_size;
+
+    // The slot at tail is not visible to the consumer until filled is
+    // bumped, so it is written without holding the lock
+    pipeline_slot_t *slot = &pipeline->slots[pipeline->tail];
+    PROFILE_START(gather_start);
+    if (pipeline->sampler != NULL)
+    {
+        gather_batch_indexed(dataset, &pipeline->sampler->order[j], rows, &slot->inputs, &slot->expected);
+    }
+    else
+    {
+        gather_batch(dataset, j, rows, &slot->inputs, &slot->expected);
+        dataset_stream(dataset, &pipeline->released, j + rows);
+    }
+    if (pipeline->augment != NULL)
+        pipeline->augment(&slot->inputs, pipeline->augment_arg);
+    PROFILE_STOP(gather_start, PROFILE_DATA, 0, 0,
+                 2.0 * sizeof(float) * rows * (slot->inputs.col + slot->expected.col));
+
+    pipeline->tail = (pipeline->tail + 1) % pipeline->num_slots;
+    pipeline->row += rows;
+    return 1;
+}
+
+static void *produce(void *arg)
+{
+    pipeline_t *pipeline = (pipeline_t *)arg;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&pipeline->lock);
+        while (pipeline->filled == pipeline->num_slots && !pipeline->stop)
+            pthread_cond_wait(&pipeline->slot_emptied, &pipeline->lock);
+        if (pipeline->stop)
+        {
+            pthread_mutex_unlock(&pipeline->lock);
+            return NULL;
+        }
+        pthread_mutex_unlock(&pipeline->lock);
+
+        if (!produce_batch(pipeline))
+            return NULL;
+
+        pthread_mutex_lock(&pipeline->lock);
+        pipeline->filled++;
+        pthread_cond_signal(&pipeline->slot_filled);
+        pthread_mutex_unlock(&pipeline->lock);
+    }
+}
+
+void pipeline_start(pipeline_t *pipeline, dataset_t *dataset, sampler_t *sampler, int batch_size, int num_slots,
+                    int first_epoch, int last_epoch, int num_classes, augment_fn augment, void *augment_arg)
+{
+    pipeline->dataset = dataset;
+    pipeline->sampler = sampler;
+    pipeline->batch_size = batch_size;
+    pipeline->first_epoch = first_epoch;
+    pipeline->last_epoch = last_epoch;
+    pipeline->augment = augment;
+    pipeline->augment_arg = augment_arg;
+    pipeline->num_slots = num_slots;
+    pipeline->head = 0;
+    pipeline->filled = 0;
+    pipeline->stop = 0;
+    pipeline->epoch = first_epoch;
+    pipeline->row = 0;
+    pipeline->released = 0;
+    pipeline->tail = 0;
+    pipeline->stall_seconds = 0;
+    pipeline->stalls = 0;
+
+    size_t slot_len = arena_len((size_t)batch_size * dataset->features) + arena_len((size_t)batch_size * num_classes);
+    pipeline->arena = init_arena(slot_len * num_slots);
+    // Best effort, keeps the ring from being paged out under memory pressure
+    mlock(pipeline->arena.arr, pipeline->arena.len * sizeof(float));
+
+    pipeline->slots = (pipeline_slot_t *)allocate_bytes(sizeof(pipeline_slot_t) * num_slots);
+    for (int i = 0; i < num_slots; i++)
+    {
+        pipeline->slots[i].inputs = arena_matrix(&pipeline->arena, batch_size, dataset->features);
+        pipeline->slots[i].expected = arena_matrix(&pipeline->arena, batch_size, num_classes);
+    }
+
+    pthread_mutex_init(&pipeline->lock, NULL);
+    pthread_cond_init(&pipeline->slot_filled, NULL);
+    pthread_cond_init(&pipeline->slot_emptied, NULL);
+    int error = pthread_create(&pipeline->thread, NULL, produce, pipeline);
+    pipeline->threaded = error == 0;
+    if (error != 0)
+        fprintf(stderr, "couldn't start the pipeline thread (%s), assembling batches on the training thread\n",
+                strerror(error));
+}
+
+pipeline_slot_t *pipeline_next(pipeline_t *pipeline)
+{
+    if (!pipeline->threaded)
+    {
+        // Nothing runs ahead, so every batch is a stall of the time it
+        // takes to assemble
+        if (pipeline->filled == 0)
+        {
+            double start = now_seconds();
+            pipeline->filled += produce_batch(pipeline);
+            pipeline->stall_seconds += now_seconds() - start;
+            pipeline->stalls++;
+        }
+        return &pipeline->slots[pipeline->head];
+    }
+
+    pthread_mutex_lock(&pipeline->lock);
+    if (pipeline->filled == 0)
+    {
+        double start = now_seconds();
+        while (pipeline->filled == 0)
+            pthread_cond_wait(&pipeline->slot_filled, &pipeline->lock);
+        pipeline->stall_seconds += now_seconds() - start;
+        pipeline->stalls++;
+    }
+    pipeline_slot_t *slot = &pipeline->slots[pipeline->head];
+    pthread_mutex_unlock(&pipeline->lock);
+
+    return slot;
+}
+
+void pipeline_release(pipeline_t *pipeline)
+{
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->head = (pipeline->head + 1) % pipeline->num_slots;
+    pipeline->filled--;
+    pthread_cond_signal(&pipeline->slot_emptied);
+    pthread_mutex_unlock(&pipeline->lock);
+}
+
+void pipeline_stop(pipeline_t *pipeline)
+{
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->stop = 1;
+    pthread_cond_broadcast(&pipeline->slot_emptied);
+    pthread_mutex_unlock(&pipeline->lock);
+    if (pipeline->threaded)
+        pthread_join(pipeline->thread, NULL);
+
+    pthread_mutex_destroy(&pipeline->lock);
+    pthread_cond_destroy(&pipeline->slot_filled);
+    pthread_cond_destroy(&pipeline->slot_emptied);
+
+    munlock(pipeline->arena.arr, pipeline->arena.len * sizeof(float));
+    free(pipeline->slots);
+    free_arena(&pipeline->arena);
+}
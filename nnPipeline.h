@@ -0,0 +1,76 @@
+#ifndef NN_PIPELINE_H
+#define NN_PIPELINE_H
+
+#include <pthread.h>
+#include "nnSampler.h"
+
+// Batches in flight, the one training and two prepared ahead of it
+#define PIPELINE_SLOTS 3
+
+// Called on every batch the producer assembles, after the inputs are
+// scaled and before the trainer sees them
+typedef void (*augment_fn)(matrix_t *inputs, void *arg);
+
+typedef struct
+{
+    matrix_t inputs;
+    matrix_t expected;
+} pipeline_slot_t;
+
+// A background thread that gathers, scales and optionally augments the
+// next minibatches of a dataset into a ring of buffers while the current
+// one trains. The ring memory is locked in RAM when the OS allows it.
+typedef struct
+{
+    dataset_t *dataset;
+    sampler_t *sampler;
+    int batch_size;
+    int first_epoch;
+    int last_epoch;
+    augment_fn augment;
+    void *augment_arg;
+
+    arena_t arena;
+    pipeline_slot_t *slots;
+    int num_slots;
+    int head;
+    int filled;
+    int stop;
+
+    // Where the producer is: the epoch and row of the next batch, the slot
+    // it goes in and how far into the epoch the file has been released
+    int epoch;
+    int row;
+    int tail;
+    int released;
+
+    // 0 when the thread couldn't be started, pipeline_next() then
+    // assembles each batch on the calling thread
+    int threaded;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t slot_filled;
+    pthread_cond_t slot_emptied;
+
+    // Time the consumer spent waiting on the producer, and how often it did
+    double stall_seconds;
+    long stalls;
+} pipeline_t;
+
+// Starts producing epochs [first_epoch, last_epoch) of dataset in batches
+// of batch_size into num_slots buffers. Each epoch asks sampler for its
+// order, NULL walks the file in order. augment may be NULL. If the
+// producer thread can't be started this is reported on stderr and batches
+// are assembled by pipeline_next() instead.
+void pipeline_start(pipeline_t *pipeline, dataset_t *dataset, sampler_t *sampler, int batch_size, int num_slots,
+                    int first_epoch, int last_epoch, int num_classes, augment_fn augment, void *augment_arg);
+
+// Returns the next batch, waiting for it if the producer is behind. The
+// batch stays valid until pipeline_release().
+pipeline_slot_t *pipeline_next(pipeline_t *pipeline);
+void pipeline_release(pipeline_t *pipeline);
+
+// Stops the producer, even mid epoch, and frees the ring
+void pipeline_stop(pipeline_t *pipeline);
+
+#endif
@@ -0,0 +1,237 @@
+#include "nnProfile.h"
+
+#ifdef NN_PROFILE
+
+#include "nnMath.h"
+#include <pthread.h>
+#include <time.h>
+
+typedef struct
+{
+    uint64_t ticks;
+    uint64_t calls;
+    double flops;
+    double bytes;
+} profile_counter_t;
+
+typedef struct
+{
+    uint64_t start;
+    uint64_t ticks;
+    uint8_t phase;
+    uint8_t layer;
+} profile_event_t;
+
+typedef struct
+{
+    profile_counter_t counters[PROFILE_PHASES][PROFILE_MAX_LAYERS];
+    // PROFILE_MAX_EVENTS long once the thread records while tracing
+    profile_event_t *events;
+    int num_events;
+} profile_thread_t;
+
+static const char *phase_names[PROFILE_PHASES] = {
+    "forward", "backward", "loss", "gradient", "reduce", "update", "data", "wait", "test", "checkpoint",
+};
+
+static profile_thread_t threads[PROFILE_MAX_THREADS];
+static int num_threads;
+static __thread profile_thread_t *current;
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+// Where the ticks are counted from, for converting them to seconds
+static uint64_t origin_ticks;
+static double origin_seconds;
+
+static uint64_t epoch_ticks;
+static long epoch_allocations;
+
+static char *trace_path;
+static int tracing;
+static long dropped_events;
+
+static double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void close_at_exit()
+{
+    profile_trace_close();
+}
+
+static int open_trace(const char *path)
+{
+    if (trace_path != NULL)
+        return -1;
+    trace_path = strdup(path);
+    __atomic_store_n(&tracing, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static void profile_init()
+{
+    origin_ticks = profile_ticks();
+    origin_seconds = now_seconds();
+    epoch_ticks = origin_ticks;
+    epoch_allocations = allocation_count();
+
+    const char *path = getenv("NN_PROFILE_TRACE");
+    if (path != NULL && *path != '\0' && open_trace(path) == 0)
+        atexit(close_at_exit);
+}
+
+// Measured over everything since the first record, so it gets better
+// the longer the run
+static double ticks_per_second()
+{
+    double seconds = now_seconds() - origin_seconds;
+    return seconds > 0 ? (profile_ticks() - origin_ticks) / seconds : 1e9;
+}
+
+static profile_thread_t *profile_thread()
+{
+    if (current == NULL)
+    {
+        int index = __atomic_fetch_add(&num_threads, 1, __ATOMIC_RELAXED);
+        if (index >= PROFILE_MAX_THREADS)
+            return NULL;
+        current = &threads[index];
+    }
+    return current;
+}
+
+void profile_record(profile_phase_t phase, int layer, uint64_t start, double flops, double bytes)
+{
+    uint64_t end = profile_ticks();
+    pthread_once(&once, profile_init);
+    profile_thread_t *thread = profile_thread();
+    if (thread == NULL)
+        return;
+
+    layer = layer < 0 ? 0 : layer < PROFILE_MAX_LAYERS ? layer : PROFILE_MAX_LAYERS - 1;
+    profile_counter_t *counter = &thread->counters[phase][layer];
+    counter->ticks += end - start;
+    counter->calls++;
+    counter->flops += flops;
+    counter->bytes += bytes;
+
+    if (!__atomic_load_n(&tracing, __ATOMIC_ACQUIRE))
+        return;
+    // Not through allocate_bytes(), so the allocations the report counts
+    // are only the network's
+    if (thread->events == NULL)
+        thread->events = (profile_event_t *)malloc(sizeof(profile_event_t) * PROFILE_MAX_EVENTS);
+    if (thread->events == NULL)
+        return;
+    if (thread->num_events == PROFILE_MAX_EVENTS)
+    {
+        __atomic_fetch_add(&dropped_events, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    thread->events[thread->num_events++] = (profile_event_t){start, end - start, (uint8_t)phase, (uint8_t)layer};
+}
+
+void profile_epoch(int epoch, long samples)
+{
+    pthread_once(&once, profile_init);
+    uint64_t now = profile_ticks();
+    double rate = ticks_per_second();
+    double seconds = (now - epoch_ticks) / rate;
+    long allocations = allocation_count();
+    int count = num_threads < PROFILE_MAX_THREADS ? num_threads : PROFILE_MAX_THREADS;
+
+    printf("Profile of epoch %d: %.3f s, %.0f samples/s, %ld allocations\n", epoch, seconds,
+           seconds > 0 ? samples / seconds : 0, allocations - epoch_allocations);
+    printf("  %-10s %5s %10s %7s %9s %9s %9s\n", "phase", "layer", "ms", "% epoch", "calls", "GFLOP/s", "GB/s");
+
+    // Summed over the threads, so phases running in parallel can add up
+    // to more than the epoch
+    for (int phase = 0; phase < PROFILE_PHASES; phase++)
+    {
+        for (int layer = 0; layer < PROFILE_MAX_LAYERS; layer++)
+        {
+            profile_counter_t total = {0};
+            for (int t = 0; t < count; t++)
+            {
+                profile_counter_t *counter = &threads[t].counters[phase][layer];
+                total.ticks += counter->ticks;
+                total.calls += counter->calls;
+                total.flops += counter->flops;
+                total.bytes += counter->bytes;
+                memset(counter, 0, sizeof(*counter));
+            }
+            if (total.calls == 0)
+                continue;
+
+            double spent = total.ticks / rate;
+            printf("  %-10s %5d %10.3f %6.1f%% %9llu %9.2f %9.2f\n", phase_names[phase], layer, spent * 1e3,
+                   seconds > 0 ? 100 * spent / seconds : 0, (unsigned long long)total.calls,
+                   spent > 0 ? total.flops / spent * 1e-9 : 0, spent > 0 ? total.bytes / spent * 1e-9 : 0);
+        }
+    }
+
+    epoch_ticks = now;
+    epoch_allocations = allocations;
+}
+
+int profile_trace_open(const char *path)
+{
+    pthread_once(&once, profile_init);
+    return open_trace(path);
+}
+
+void profile_trace_close()
+{
+    if (trace_path == NULL)
+        return;
+    __atomic_store_n(&tracing, 0, __ATOMIC_RELEASE);
+
+    FILE *file = fopen(trace_path, "w");
+    if (file == NULL)
+    {
+        fprintf(stderr, "couldn't write the trace to %s\n", trace_path);
+    }
+    else
+    {
+        // Complete events in microseconds since the first record, one
+        // track per thread
+        double us_per_tick = 1e6 / ticks_per_second();
+        int count = num_threads < PROFILE_MAX_THREADS ? num_threads : PROFILE_MAX_THREADS;
+        const char *separator = "";
+        fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+        for (int t = 0; t < count; t++)
+        {
+            fprintf(file, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+                          "\"args\": {\"name\": \"thread %d\"}}",
+                    separator, t, t);
+            separator = ",\n";
+            for (int i = 0; i < threads[t].num_events; i++)
+            {
+                profile_event_t *event = &threads[t].events[i];
+                fprintf(file, ",\n{\"name\": \"%s %d\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+                              "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"layer\": %d}}",
+                        phase_names[event->phase], event->layer, phase_names[event->phase], t,
+                        (double)(int64_t)(event->start - origin_ticks) * us_per_tick,
+                        event->ticks * us_per_tick, event->layer);
+            }
+        }
+        fprintf(file, "\n]}\n");
+        fclose(file);
+        if (dropped_events > 0)
+            fprintf(stderr, "the trace dropped %ld events past %d a thread\n", dropped_events, PROFILE_MAX_EVENTS);
+    }
+
+    for (int t = 0; t < PROFILE_MAX_THREADS; t++)
+    {
+        free(threads[t].events);
+        threads[t].events = NULL;
+        threads[t].num_events = 0;
+    }
+    free(trace_path);
+    trace_path = NULL;
+}
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef NN_PROFILE_H
+#define NN_PROFILE_H
+
+#include <stdint.h>
+
+// Timers and counters on the hot paths, built in with -DNN_PROFILE (the
+// NN_PROFILE CMake option). Without it every macro below compiles to
+// nothing, arguments included, so the counts cost nothing to leave in.
+//
+// Each thread adds to its own counters, per phase and layer: time stamp
+// counter ticks, calls, flops and bytes moved. PROFILE_EPOCH() prints
+// them with the samples/s and the allocations of the epoch and starts
+// over. With NN_PROFILE_TRACE=path in the environment, or after
+// PROFILE_TRACE_OPEN(), every region is also kept as an event and written
+// to a Chrome trace JSON file, which chrome://tracing and Perfetto open.
+
+typedef enum
+{
+    PROFILE_FORWARD,
+    PROFILE_BACKWARD,
+    // The output error and loss
+    PROFILE_LOSS,
+    // Summing the gradients of a batch into the accumulators
+    PROFILE_GRADIENT,
+    // Summing the accumulators of the workers
+    PROFILE_REDUCE,
+    PROFILE_UPDATE,
+    // Assembling and copying batches
+    PROFILE_DATA,
+    // Training waiting for the pipeline
+    PROFILE_WAIT,
+    PROFILE_TEST,
+    PROFILE_CHECKPOINT,
+    PROFILE_PHASES
+} profile_phase_t;
+
+// Layers past the last are counted with it, regions of no particular
+// layer as layer 0
+#define PROFILE_MAX_LAYERS 16
+// Threads past the first this many aren't counted
+#define PROFILE_MAX_THREADS 64
+// Events kept per thread for a trace, later ones are dropped and counted
+#define PROFILE_MAX_EVENTS (1 << 20)
+
+#ifdef NN_PROFILE
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+// The invariant TSC where there is one, nanoseconds otherwise
+static inline uint64_t profile_ticks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+#endif
+}
+
+// Adds the region from start to now to the calling thread's counters
+void profile_record(profile_phase_t phase, int layer, uint64_t start, double flops, double bytes);
+
+// Prints the counters since the last report, samples being those the
+// epoch trained on, and clears them
+void profile_epoch(int epoch, long samples);
+
+// Starts keeping events for a trace written to path by
+// profile_trace_close(), which has to be called once the threads being
+// traced are done. Returns 0, or -1 if a trace is already open.
+int profile_trace_open(const char *path);
+void profile_trace_close();
+
+#define PROFILE_START(name) uint64_t name = profile_ticks()
+#define PROFILE_STOP(name, phase, layer, flops, bytes) profile_record(phase, layer, name, flops, bytes)
+#define PROFILE_EPOCH(epoch, samples) profile_epoch(epoch, samples)
+#define PROFILE_TRACE_OPEN(path) profile_trace_open(path)
+#define PROFILE_TRACE_CLOSE() profile_trace_close()
+
+#else
+
+#define PROFILE_START(name)
+#define PROFILE_STOP(name, phase, layer, flops, bytes) ((void)0)
+#define PROFILE_EPOCH(epoch, samples) ((void)0)
+#define PROFILE_TRACE_OPEN(path) ((void)0)
+#define PROFILE_TRACE_CLOSE() ((void)0)
+
+#endif
+
+#endif
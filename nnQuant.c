@@ -0,0 +1,504 @@
+#include "nnQuant.h"
+#include "nnModel.h"
+#include "nnSimd.h"
+#include <math.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// out[s * ldo + r] = sum over k of a[s * lda + k] * w[r * ldw + k], for
+// samples rows of a and rows rows of w. len is a multiple of QUANT_K_ALIGN.
+typedef void (*qgemm_fn)(int32_t *out, int ldo, const uint8_t *a, int lda, int samples,
+                         const int8_t *w, int ldw, int rows, int len);
+
+static void qgemm_scalar(int32_t *out, int ldo, const uint8_t *a, int lda, int samples,
+                         const int8_t *w, int ldw, int rows, int len)
+{
+    for (int s = 0; s < samples; s++)
+    {
+        for (int r = 0; r < rows; r++)
+        {
+            int32_t sum = 0;
+            for (int k = 0; k < len; k++)
+            {
+                sum += a[(size_t)s * lda + k] * w[(size_t)r * ldw + k];
+            }
+            out[(size_t)s * ldo + r] = sum;
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// Four samples share every load of a weight row, so the weights are read
+// once per four samples instead of once per sample
+#define QGEMM_SAMPLES 4
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
+static inline __attribute__((always_inline)) void qrows_avx2(int32_t *out, int ldo, const uint8_t *a, int lda, int count,
+                                                             const int8_t *w, int ldw, int rows, int len)
+{
+    const __m256i ones = _mm256_set1_epi16(1);
+
+    for (int r = 0; r < rows; r++)
+    {
+        __m256i acc[QGEMM_SAMPLES];
+        for (int j = 0; j < count; j++)
+            acc[j] = _mm256_setzero_si256();
+
+        for (int k = 0; k < len; k += 32)
+        {
+            __m256i wv = _mm256_load_si256((const __m256i *)&w[(size_t)r * ldw + k]);
+            for (int j = 0; j < count; j++)
+            {
+                __m256i av = _mm256_load_si256((const __m256i *)&a[(size_t)j * lda + k]);
+                // u8 x s8 pairs into int16, then pairs of those into int32
+                acc[j] = _mm256_add_epi32(acc[j], _mm256_madd_epi16(_mm256_maddubs_epi16(av, wv), ones));
+            }
+        }
+
+        for (int j = 0; j < count; j++)
+        {
+            __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc[j]), _mm256_extracti128_si256(acc[j], 1));
+            sum = _mm_hadd_epi32(sum, sum);
+            sum = _mm_hadd_epi32(sum, sum);
+            out[(size_t)j * ldo + r] = _mm_cvtsi128_si32(sum);
+        }
+    }
+}
+
+static void qgemm_avx2(int32_t *out, int ldo, const uint8_t *a, int lda, int samples,
+                       const int8_t *w, int ldw, int rows, int len)
+{
+    int s = 0;
+    for (; s + QGEMM_SAMPLES <= samples; s += QGEMM_SAMPLES)
+        qrows_avx2(&out[(size_t)s * ldo], ldo, &a[(size_t)s * lda], lda, QGEMM_SAMPLES, w, ldw, rows, len);
+    for (; s < samples; s++)
+        qrows_avx2(&out[(size_t)s * ldo], ldo, &a[(size_t)s * lda], lda, 1, w, ldw, rows, len);
+}
+
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx512vnni")
+
+static inline __attribute__((always_inline)) void qrows_vnni(int32_t *out, int ldo, const uint8_t *a, int lda, int count,
+                                                             const int8_t *w, int ldw, int rows, int len)
+{
+    for (int r = 0; r < rows; r++)
+    {
+        __m512i acc[QGEMM_SAMPLES];
+        for (int j = 0; j < count; j++)
+            acc[j] = _mm512_setzero_si512();
+
+        for (int k = 0; k < len; k += 64)
+        {
+            __m512i wv = _mm512_load_si512((const void *)&w[(size_t)r * ldw + k]);
+            for (int j = 0; j < count; j++)
+            {
+                // vpdpbusd sums the four u8 x s8 products into int32 directly
+                acc[j] = _mm512_dpbusd_epi32(acc[j], _mm512_load_si512((const void *)&a[(size_t)j * lda + k]), wv);
+            }
+        }
+
+        for (int j = 0; j < count; j++)
+            out[(size_t)j * ldo + r] = _mm512_reduce_add_epi32(acc[j]);
+    }
+}
+
+static void qgemm_vnni(int32_t *out, int ldo, const uint8_t *a, int lda, int samples,
+                       const int8_t *w, int ldw, int rows, int len)
+{
+    int s = 0;
+    for (; s + QGEMM_SAMPLES <= samples; s += QGEMM_SAMPLES)
+        qrows_vnni(&out[(size_t)s * ldo], ldo, &a[(size_t)s * lda], lda, QGEMM_SAMPLES, w, ldw, rows, len);
+    for (; s < samples; s++)
+        qrows_vnni(&out[(size_t)s * ldo], ldo, &a[(size_t)s * lda], lda, 1, w, ldw, rows, len);
+}
+
+#pragma GCC pop_options
+
+#endif
+
+static qgemm_fn qgemm = qgemm_scalar;
+const char *quant_kernel_name = "scalar";
+
+__attribute__((constructor)) void quant_init()
+{
+    const char *forced = getenv("NN_SIMD");
+    qgemm = qgemm_scalar;
+    quant_kernel_name = "scalar";
+
+    if (forced != NULL && strcmp(forced, "scalar") == 0)
+        return;
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+
+    const char *names[] = {"avx512", "avx2"};
+    qgemm_fn kernels[] = {qgemm_vnni, qgemm_avx2};
+    int supported[] = {
+        __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vnni"),
+        __builtin_cpu_supports("avx2"),
+    };
+
+    for (int i = 0; i < (int)(sizeof(kernels) / sizeof(kernels[0])); i++)
+    {
+        if (!supported[i])
+            continue;
+        if (forced != NULL && strcmp(forced, names[i]) != 0)
+            continue;
+        qgemm = kernels[i];
+        quant_kernel_name = names[i];
+        return;
+    }
+#endif
+}
+
+static int padded(int len)
+{
+    return (len + QUANT_K_ALIGN - 1) / QUANT_K_ALIGN * QUANT_K_ALIGN;
+}
+
+// Bytes of the arena, which counts in floats
+static void *arena_bytes(arena_t *arena, size_t len)
+{
+    return arena_alloc(arena, (len + sizeof(float) - 1) / sizeof(float));
+}
+
+static size_t arena_bytes_len(size_t len)
+{
+    return arena_len((len + sizeof(float) - 1) / sizeof(float));
+}
+
+static void init_quant_layers(quant_model_t *quant, int num_layers, const int *lengths, const activation_t *activations,
+                              sigmoid_mode_t sigmoid_mode)
+{
+    quant->num_layers = num_layers;
+    quant->sigmoid_mode = sigmoid_mode;
+    quant->map = NULL;
+    quant->map_len = 0;
+    quant->lengths = (int *)allocate_bytes(sizeof(int) * num_layers);
+    quant->layers = (quant_layer_t *)allocate_bytes(sizeof(quant_layer_t) * num_layers);
+
+    for (int i = 0; i < num_layers; i++)
+    {
+        quant->lengths[i] = lengths[i];
+        if (i == 0)
+            continue;
+        quant->layers[i].row = lengths[i];
+        quant->layers[i].col = lengths[i - 1];
+        quant->layers[i].stride = padded(lengths[i - 1]);
+        quant->layers[i].activation = activations[i];
+    }
+}
+
+static void sum_weight_rows(quant_layer_t *layer)
+{
+    for (int r = 0; r < layer->row; r++)
+    {
+        int32_t sum = 0;
+        for (int k = 0; k < layer->col; k++)
+        {
+            sum += layer->weights[(size_t)r * layer->stride + k];
+        }
+        layer->row_sums[r] = sum;
+    }
+}
+
+// Sets the input range of every layer from the float model's activations
+static void calibrate(quant_model_t *quant, model_t *model, matrix_t *calibration)
+{
+    float *low = (float *)allocate_bytes(sizeof(float) * model->num_layers);
+    float *high = (float *)allocate_bytes(sizeof(float) * model->num_layers);
+
+    int widest = 0;
+    for (int i = 0; i < model->num_layers; i++)
+        widest = model->lengths[i] > widest ? model->lengths[i] : widest;
+
+    arena_t arena = init_arena(2 * arena_len((size_t)calibration->row * widest));
+    matrix_t buffers[2] = {arena_matrix(&arena, calibration->row, widest), arena_matrix(&arena, calibration->row, widest)};
+
+    matrix_t in = *calibration;
+    for (int i = 1; i < model->num_layers; i++)
+    {
+        // The range always holds 0, so sigmoid outputs get a zero point of 0
+        for (size_t j = 0; j < (size_t)in.row * in.col; j++)
+        {
+            low[i] = in.arr[j] < low[i] ? in.arr[j] : low[i];
+            high[i] = in.arr[j] > high[i] ? in.arr[j] : high[i];
+        }
+
+        matrix_t out = {buffers[i % 2].arr, in.row, model->lengths[i]};
+        epilogue_t forward = {model->activations[i], model->sigmoid_mode, model->biases[i].arr, NULL};
+        multiply_mat_matT_epilogue(&out, &in, &model->weights[i], &forward);
+        in = out;
+    }
+
+    for (int i = 1; i < model->num_layers; i++)
+    {
+        quant_layer_t *layer = &quant->layers[i];
+        layer->input_scale = high[i] > low[i] ? (high[i] - low[i]) / QUANT_MAX_ACTIVATION : 1;
+        layer->input_zero = (int)lrintf(-low[i] / layer->input_scale);
+    }
+
+    free_arena(&arena);
+    free(low);
+    free(high);
+}
+
+void quantize_model(quant_model_t *quant, model_t *model, matrix_t *calibration)
+{
+    init_quant_layers(quant, model->num_layers, model->lengths, model->activations, model->sigmoid_mode);
+
+    size_t len = 0;
+    for (int i = 1; i < quant->num_layers; i++)
+    {
+        quant_layer_t *layer = &quant->layers[i];
+        len += arena_bytes_len((size_t)layer->row * layer->stride) + 3 * arena_len(layer->row);
+    }
+    quant->arena = init_arena(len);
+
+    for (int i = 1; i < quant->num_layers; i++)
+    {
+        quant_layer_t *layer = &quant->layers[i];
+        matrix_t *weights = &model->weights[i];
+        layer->weights = (int8_t *)arena_bytes(&quant->arena, (size_t)layer->row * layer->stride);
+        layer->scales = arena_alloc(&quant->arena, layer->row);
+        layer->biases = arena_alloc(&quant->arena, layer->row);
+        layer->row_sums = (int32_t *)arena_alloc(&quant->arena, layer->row);
+        memcpy(layer->biases, model->biases[i].arr, sizeof(float) * layer->row);
+
+        // Symmetric per output channel, the largest weight maps to +-127
+        for (int r = 0; r < layer->row; r++)
+        {
+            const float *row = &weights->arr[(size_t)r * weights->col];
+            float largest = 0;
+            for (int k = 0; k < layer->col; k++)
+                largest = fabsf(row[k]) > largest ? fabsf(row[k]) : largest;
+
+            layer->scales[r] = largest > 0 ? largest / 127 : 1;
+            for (int k = 0; k < layer->col; k++)
+                layer->weights[(size_t)r * layer->stride + k] = (int8_t)lrintf(row[k] / layer->scales[r]);
+        }
+        sum_weight_rows(layer);
+    }
+
+    calibrate(quant, model, calibration);
+}
+
+void free_quant_model(quant_model_t *quant)
+{
+    free(quant->lengths);
+    free(quant->layers);
+    free_arena(&quant->arena);
+    if (quant->map != NULL)
+        munmap(quant->map, quant->map_len);
+    quant->map = NULL;
+}
+
+int save_quant_model(quant_model_t *quant, const char *path)
+{
+    model_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MODEL_MAGIC, sizeof(MODEL_MAGIC));
+    header.version = MODEL_VERSION;
+    header.endian = MODEL_ENDIAN;
+    header.num_layers = quant->num_layers;
+    header.dtype = MODEL_I8;
+    header.alignment = MODEL_ALIGN;
+
+    model_layer_t *table = (model_layer_t *)allocate_bytes(sizeof(model_layer_t) * quant->num_layers);
+    uint64_t offset = align_offset(sizeof(header) + sizeof(model_layer_t) * quant->num_layers);
+    for (int i = 0; i < quant->num_layers; i++)
+    {
+        table[i].length = quant->lengths[i];
+        if (i == 0)
+            continue;
+        table[i].activation = quant->layers[i].activation;
+
+        quant_layer_t *layer = &quant->layers[i];
+        table[i].weights_offset = offset;
+        offset = align_offset(offset + (uint64_t)layer->row * layer->stride);
+        table[i].biases_offset = offset;
+        offset = align_offset(offset + sizeof(float) * (2 * (uint64_t)layer->row + 2));
+    }
+    header.file_len = offset;
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "couldn't create %s\n", path);
+        free(table);
+        return -1;
+    }
+
+    uint32_t crc = 0;
+    offset = 0;
+    int failed = write_blob(file, &crc, &offset, &header, sizeof(header), 0) ||
+                 write_blob(file, &crc, &offset, table, sizeof(model_layer_t) * quant->num_layers, 1);
+    for (int i = 1; i < quant->num_layers && !failed; i++)
+    {
+        quant_layer_t *layer = &quant->layers[i];
+        float input[2] = {layer->input_scale, (float)layer->input_zero};
+        failed = write_blob(file, &crc, &offset, layer->weights, (size_t)layer->row * layer->stride, 1) ||
+                 write_blob(file, &crc, &offset, layer->biases, sizeof(float) * layer->row, 0) ||
+                 write_blob(file, &crc, &offset, layer->scales, sizeof(float) * layer->row, 0) ||
+                 write_blob(file, &crc, &offset, input, sizeof(input), 1);
+    }
+
+    header.crc = crc;
+    if (!failed)
+        failed = fseek(file, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, file) != 1;
+    if (!failed)
+        failed = fflush(file) != 0 || fsync(fileno(file)) != 0;
+    failed = fclose(file) != 0 || failed;
+    free(table);
+
+    if (failed)
+    {
+        fprintf(stderr, "couldn't write %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+int load_quant_model(quant_model_t *quant, const char *path)
+{
+    size_t map_len;
+    unsigned char *map = map_model(path, &map_len, 0);
+    if (map == NULL)
+        return -1;
+
+    model_header_t *header = (model_header_t *)map;
+    const model_layer_t *table = (const model_layer_t *)(map + sizeof(model_header_t));
+    int failed = header->dtype != MODEL_I8;
+    if (failed)
+        fprintf(stderr, "%s isn't a quantized model\n", path);
+
+    for (uint32_t i = 1; i < header->num_layers && !failed; i++)
+    {
+        failed = !blob_fits(table[i].weights_offset, (uint64_t)table[i].length * padded(table[i - 1].length), map_len) ||
+                 !blob_fits(table[i].biases_offset, sizeof(float) * (2 * (uint64_t)table[i].length + 2), map_len);
+        if (failed)
+            fprintf(stderr, "%s has layer %u outside the file\n", path, i);
+    }
+    if (failed)
+    {
+        munmap(map, map_len);
+        return -1;
+    }
+
+    int *lengths = (int *)allocate_bytes(sizeof(int) * header->num_layers);
+    activation_t *activations = (activation_t *)allocate_bytes(sizeof(activation_t) * header->num_layers);
+    for (uint32_t i = 0; i < header->num_layers; i++)
+    {
+        lengths[i] = table[i].length;
+        activations[i] = (activation_t)table[i].activation;
+    }
+    init_quant_layers(quant, header->num_layers, lengths, activations, SIGMOID_EXACT);
+    free(lengths);
+    free(activations);
+    quant->map = map;
+    quant->map_len = map_len;
+
+    size_t len = 0;
+    for (int i = 1; i < quant->num_layers; i++)
+        len += arena_len(quant->layers[i].row);
+    quant->arena = init_arena(len);
+
+    for (int i = 1; i < quant->num_layers; i++)
+    {
+        quant_layer_t *layer = &quant->layers[i];
+        float *params = (float *)(map + table[i].biases_offset);
+        layer->weights = (int8_t *)(map + table[i].weights_offset);
+        layer->biases = params;
+        layer->scales = &params[layer->row];
+        layer->input_scale = params[2 * layer->row];
+        layer->input_zero = (int)params[2 * layer->row + 1];
+        layer->row_sums = (int32_t *)arena_alloc(&quant->arena, layer->row);
+        sum_weight_rows(layer);
+    }
+
+    return 0;
+}
+
+void init_quant_context(quant_context_t *context, quant_model_t *quant, int batch_size)
+{
+    context->widest = 0;
+    for (int i = 0; i < quant->num_layers; i++)
+        context->widest = padded(quant->lengths[i]) > context->widest ? padded(quant->lengths[i]) : context->widest;
+
+    size_t cells = (size_t)batch_size * context->widest;
+    context->batch_size = batch_size;
+    context->arena = init_arena(arena_bytes_len(cells) + 2 * arena_len(cells));
+    context->activations = (uint8_t *)arena_bytes(&context->arena, cells);
+    context->sums = (int32_t *)arena_alloc(&context->arena, cells);
+    context->outputs = arena_alloc(&context->arena, cells);
+}
+
+void free_quant_context(quant_context_t *context)
+{
+    free_arena(&context->arena);
+}
+
+// Quantizes len floats to the input range of layer. The padding after them
+// meets zero weights, so whatever it holds adds nothing.
+static void quantize_row(uint8_t *out, const float *in, int len, quant_layer_t *layer)
+{
+    float inverse = 1.0f / layer->input_scale;
+    for (int k = 0; k < len; k++)
+    {
+        int q = (int)lrintf(in[k] * inverse) + layer->input_zero;
+        out[k] = (uint8_t)(q < 0 ? 0 : q > QUANT_MAX_ACTIVATION ? QUANT_MAX_ACTIVATION : q);
+    }
+}
+
+void predict_batch_int8(quant_model_t *quant, quant_context_t *context, matrix_t *inputs, matrix_t *outputs)
+{
+    int last = quant->num_layers - 1;
+
+    for (int start = 0; start < inputs->row; start += context->batch_size)
+    {
+        int rows = inputs->row - start < context->batch_size ? inputs->row - start : context->batch_size;
+
+        for (int s = 0; s < rows; s++)
+        {
+            quantize_row(&context->activations[(size_t)s * quant->layers[1].stride],
+                         &inputs->arr[(size_t)(start + s) * inputs->col], inputs->col, &quant->layers[1]);
+        }
+
+        for (int i = 1; i <= last; i++)
+        {
+            quant_layer_t *layer = &quant->layers[i];
+            qgemm(context->sums, layer->row, context->activations, layer->stride, rows,
+                  layer->weights, layer->stride, layer->row, layer->stride);
+
+            // The products are done, so the activations can be overwritten
+            // row by row with the next layer's inputs
+            for (int s = 0; s < rows; s++)
+            {
+                const int32_t *sums = &context->sums[(size_t)s * layer->row];
+                float *out = i == last ? &outputs->arr[(size_t)(start + s) * outputs->col] : context->outputs;
+
+                for (int r = 0; r < layer->row; r++)
+                {
+                    float scale = layer->scales[r] * layer->input_scale;
+                    out[r] = (float)(sums[r] - layer->input_zero * layer->row_sums[r]) * scale;
+                }
+                simd.activate(out, out, layer->biases, layer->row, layer->activation, quant->sigmoid_mode == SIGMOID_FAST);
+
+                if (i < last)
+                {
+                    quant_layer_t *next = &quant->layers[i + 1];
+                    quantize_row(&context->activations[(size_t)s * next->stride], out, layer->row, next);
+                }
+            }
+        }
+    }
+}
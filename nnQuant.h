@@ -0,0 +1,89 @@
+#ifndef NN_QUANT_H
+#define NN_QUANT_H
+
+#include <stdint.h>
+#include "nnInference.h"
+
+// Weight rows and activation rows are zero padded to a multiple of this
+// many bytes, so the kernels never handle a tail
+#define QUANT_K_ALIGN 64
+
+// Largest quantized activation. pmaddubsw adds two u8 x s8 products into a
+// saturating int16, 2 * 127 * 127 fits and 2 * 255 * 127 doesn't.
+#define QUANT_MAX_ACTIVATION 127
+
+// A layer with int8 weights. Output r is
+//   scales[r] * input_scale * sum_k (weights[r][k] * (q[k] - input_zero)) + biases[r]
+// with q the layer's inputs quantized to 0..QUANT_MAX_ACTIVATION by
+//   q = round(x / input_scale) + input_zero
+typedef struct
+{
+    int row;
+    int col;
+    // col rounded up to QUANT_K_ALIGN
+    int stride;
+    // row x stride, one symmetric scale per output channel
+    int8_t *weights;
+    float *scales;
+    float *biases;
+    // Sum of each weight row, takes the zero point out of the products
+    int32_t *row_sums;
+    float input_scale;
+    int input_zero;
+    activation_t activation;
+} quant_layer_t;
+
+// In a MODEL_I8 file the layer table's weights_offset points at the
+// row x stride int8 weights, and biases_offset at row biases, row scales,
+// input_scale and input_zero, all floats.
+typedef struct
+{
+    int num_layers;
+    int *lengths;
+    // Indexed by layer, the input layer's unused
+    quant_layer_t *layers;
+    sigmoid_mode_t sigmoid_mode;
+    // Holds the tensors, or only the row sums when they are mapped from a
+    // file
+    arena_t arena;
+    void *map;
+    size_t map_len;
+} quant_model_t;
+
+// Scratch of one thread's predictions, like exec_context_t
+typedef struct
+{
+    arena_t arena;
+    int batch_size;
+    // batch_size rows of the widest padded layer input
+    uint8_t *activations;
+    int32_t *sums;
+    // Float outputs of a hidden layer before they are quantized again
+    float *outputs;
+    int widest;
+} quant_context_t;
+
+// Name of the int8 kernel in use, "scalar", "avx2" or "avx512" (VNNI)
+extern const char *quant_kernel_name;
+
+// Picks the kernel like simd_init() does, NN_SIMD applies the same way.
+// Runs automatically at startup.
+void quant_init();
+
+// Quantizes the weights of model per output channel, and sets the range of
+// every layer's inputs from the largest and smallest values it sees when
+// the rows of calibration are run through the float model
+void quantize_model(quant_model_t *quant, model_t *model, matrix_t *calibration);
+void free_quant_model(quant_model_t *quant);
+
+// Both return 0, or -1 after printing why to stderr
+int save_quant_model(quant_model_t *quant, const char *path);
+int load_quant_model(quant_model_t *quant, const char *path);
+
+void init_quant_context(quant_context_t *context, quant_model_t *quant, int batch_size);
+void free_quant_context(quant_context_t *context);
+
+// Same as predict_batch(), with int8 x uint8 products summed in int32
+void predict_batch_int8(quant_model_t *quant, quant_context_t *context, matrix_t *inputs, matrix_t *outputs);
+
+#endif
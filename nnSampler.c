@@ -0,0 +1,229 @@
+#include "nnSampler.h"
+#include <sys/mman.h>
+
+unsigned long long rng_next(rng_t *rng)
+{
+    unsigned long long z = (rng->state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+int rng_below(rng_t *rng, int n)
+{
+    // Lemire's multiply and shift, rejecting the few draws that would bias it
+    unsigned long long m = (rng_next(rng) >> 32) * (unsigned long long)n;
+    unsigned low = (unsigned)m;
+    if (low < (unsigned)n)
+    {
+        unsigned threshold = -(unsigned)n % (unsigned)n;
+        while (low < threshold)
+        {
+            m = (rng_next(rng) >> 32) * (unsigned long long)n;
+            low = (unsigned)m;
+        }
+    }
+    return (int)(m >> 32);
+}
+
+float rng_float(rng_t *rng)
+{
+    return (rng_next(rng) >> 40) * (1.0f / 16777216.0f);
+}
+
+static void shuffle(rng_t *rng, int *arr, int len)
+{
+    for (int i = len - 1; i > 0; i--)
+    {
+        int j = rng_below(rng, i + 1);
+        int temp = arr[i];
+        arr[i] = arr[j];
+        arr[j] = temp;
+    }
+}
+
+static int compare_keys(const void *a, const void *b)
+{
+    double ka = ((const sample_key_t *)a)->key;
+    double kb = ((const sample_key_t *)b)->key;
+    return (ka > kb) - (ka < kb);
+}
+
+static void init_classes(sampler_t *sampler, dataset_t *dataset)
+{
+    sampler->num_classes = 0;
+    for (int i = 0; i < sampler->count; i++)
+    {
+        int label = dataset_label(dataset, i);
+        sampler->num_classes = label + 1 > sampler->num_classes ? label + 1 : sampler->num_classes;
+    }
+
+    sampler->class_start = (int *)allocate_bytes(sizeof(int) * (sampler->num_classes + 1));
+    sampler->by_class = (int *)allocate_bytes(sizeof(int) * sampler->count);
+
+    for (int i = 0; i < sampler->count; i++)
+        sampler->class_start[dataset_label(dataset, i) + 1]++;
+    for (int c = 0; c < sampler->num_classes; c++)
+        sampler->class_start[c + 1] += sampler->class_start[c];
+
+    // Counting sort, fill[c] is the next free slot of class c
+    int *fill = (int *)allocate_bytes(sizeof(int) * sampler->num_classes);
+    memcpy(fill, sampler->class_start, sizeof(int) * sampler->num_classes);
+    for (int i = 0; i < sampler->count; i++)
+        sampler->by_class[fill[dataset_label(dataset, i)]++] = i;
+    free(fill);
+}
+
+static void init_alias(sampler_t *sampler, dataset_t *dataset, const float *weights)
+{
+    int n = sampler->count;
+    double *scaled = (double *)allocate_bytes(sizeof(double) * n);
+    int *small = (int *)allocate_bytes(sizeof(int) * n);
+    int *large = (int *)allocate_bytes(sizeof(int) * n);
+    sampler->prob = (float *)allocate_bytes(sizeof(float) * n);
+    sampler->alias = (int *)allocate_bytes(sizeof(int) * n);
+
+    double total = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (weights != NULL)
+        {
+            scaled[i] = weights[i] > 0 ? weights[i] : 0;
+        }
+        else
+        {
+            int label = dataset_label(dataset, i);
+            scaled[i] = 1.0 / (sampler->class_start[label + 1] - sampler->class_start[label]);
+        }
+        total += scaled[i];
+    }
+
+    int num_small = 0, num_large = 0;
+    for (int i = 0; i < n; i++)
+    {
+        scaled[i] = total > 0 ? scaled[i] * n / total : 1;
+        if (scaled[i] < 1)
+            small[num_small++] = i;
+        else
+            large[num_large++] = i;
+    }
+
+    // Pair every under full column with an over full one that tops it up
+    while (num_small > 0 && num_large > 0)
+    {
+        int s = small[--num_small];
+        int l = large[--num_large];
+        sampler->prob[s] = (float)scaled[s];
+        sampler->alias[s] = l;
+        scaled[l] -= 1 - scaled[s];
+        if (scaled[l] < 1)
+            small[num_small++] = l;
+        else
+            large[num_large++] = l;
+    }
+    // Whatever is left is full up to rounding error
+    while (num_large > 0)
+    {
+        int l = large[--num_large];
+        sampler->prob[l] = 1;
+        sampler->alias[l] = l;
+    }
+    while (num_small > 0)
+    {
+        int s = small[--num_small];
+        sampler->prob[s] = 1;
+        sampler->alias[s] = s;
+    }
+
+    free(scaled);
+    free(small);
+    free(large);
+}
+
+void init_sampler(sampler_t *sampler, dataset_t *dataset, sample_mode_t mode,
+                  unsigned long long seed, const float *weights)
+{
+    memset(sampler, 0, sizeof(*sampler));
+    sampler->mode = mode;
+    sampler->seed = seed;
+    sampler->count = dataset->count;
+    sampler->order = (int *)allocate_bytes(sizeof(int) * sampler->count);
+
+    for (int i = 0; i < sampler->count; i++)
+        sampler->order[i] = i;
+
+    if (mode == SAMPLE_STRATIFIED || (mode == SAMPLE_WEIGHTED && weights == NULL))
+        init_classes(sampler, dataset);
+    if (mode == SAMPLE_STRATIFIED)
+        sampler->keys = (sample_key_t *)allocate_bytes(sizeof(sample_key_t) * sampler->count);
+    if (mode == SAMPLE_WEIGHTED)
+        init_alias(sampler, dataset, weights);
+
+    // load_dataset advises sequential reads, which lets the kernel drop
+    // pages right behind them. Random order comes back to them.
+    if (mode != SAMPLE_SEQUENTIAL)
+        madvise(dataset->images.map, dataset->images.map_len, MADV_NORMAL);
+}
+
+void free_sampler(sampler_t *sampler)
+{
+    free(sampler->order);
+    free(sampler->class_start);
+    free(sampler->by_class);
+    free(sampler->keys);
+    free(sampler->prob);
+    free(sampler->alias);
+    sampler->order = NULL;
+}
+
+void sampler_epoch(sampler_t *sampler, int epoch)
+{
+    // Each epoch restarts the generator from a state of its own, the
+    // splitmix64 output function decorrelates neighbouring states
+    sampler->rng.state = sampler->seed ^ (unsigned long long)epoch * 0x9e3779b97f4a7c15ULL;
+
+    switch (sampler->mode)
+    {
+    case SAMPLE_SEQUENTIAL:
+        break;
+
+    case SAMPLE_SHUFFLE:
+        for (int i = 0; i < sampler->count; i++)
+            sampler->order[i] = i;
+        shuffle(&sampler->rng, sampler->order, sampler->count);
+        break;
+
+    case SAMPLE_STRATIFIED:
+        // Shuffle within each class, then give the r-th of a class's n
+        // samples the key (r + offset) / n. Sorting on it interleaves the
+        // classes at even spacing through the epoch.
+        for (int c = 0; c < sampler->num_classes; c++)
+        {
+            int start = sampler->class_start[c];
+            int len = sampler->class_start[c + 1] - start;
+            double offset = rng_float(&sampler->rng);
+
+            // order is free until the sort, shuffle a copy of the class
+            // there so by_class stays the same for every epoch
+            memcpy(&sampler->order[start], &sampler->by_class[start], sizeof(int) * len);
+            shuffle(&sampler->rng, &sampler->order[start], len);
+            for (int r = 0; r < len; r++)
+            {
+                sampler->keys[start + r].key = (r + offset) / len;
+                sampler->keys[start + r].index = sampler->order[start + r];
+            }
+        }
+        qsort(sampler->keys, sampler->count, sizeof(sample_key_t), compare_keys);
+        for (int i = 0; i < sampler->count; i++)
+            sampler->order[i] = sampler->keys[i].index;
+        break;
+
+    case SAMPLE_WEIGHTED:
+        for (int i = 0; i < sampler->count; i++)
+        {
+            int j = rng_below(&sampler->rng, sampler->count);
+            sampler->order[i] = rng_float(&sampler->rng) < sampler->prob[j] ? j : sampler->alias[j];
+        }
+        break;
+    }
+}
@@ -0,0 +1,71 @@
+#ifndef NN_SAMPLER_H
+#define NN_SAMPLER_H
+
+#include "nnData.h"
+
+typedef enum
+{
+    // File order every epoch
+    SAMPLE_SEQUENTIAL,
+    // A fresh random permutation every epoch
+    SAMPLE_SHUFFLE,
+    // A permutation that spreads every class evenly over the epoch, so
+    // each minibatch holds the classes in about their overall proportion
+    SAMPLE_STRATIFIED,
+    // count draws with replacement, sample i drawn with probability
+    // proportional to weights[i]
+    SAMPLE_WEIGHTED
+} sample_mode_t;
+
+// splitmix64, one 64 bit word of state so a seed fully reproduces a run
+typedef struct
+{
+    unsigned long long state;
+} rng_t;
+
+unsigned long long rng_next(rng_t *rng);
+// Uniform in [0, n)
+int rng_below(rng_t *rng, int n);
+// Uniform in [0, 1)
+float rng_float(rng_t *rng);
+
+typedef struct
+{
+    double key;
+    int index;
+} sample_key_t;
+
+// Produces the order in which an epoch visits a dataset. The samples are
+// never moved, batches are gathered through the indices in order.
+typedef struct
+{
+    sample_mode_t mode;
+    unsigned long long seed;
+    rng_t rng;
+    int count;
+    int *order;
+
+    // SAMPLE_STRATIFIED, sample indices grouped by class, class c at
+    // by_class[class_start[c]] up to class_start[c + 1]
+    int num_classes;
+    int *class_start;
+    int *by_class;
+    sample_key_t *keys;
+
+    // SAMPLE_WEIGHTED, Vose alias table
+    float *prob;
+    int *alias;
+} sampler_t;
+
+// weights is only read for SAMPLE_WEIGHTED, one per sample. NULL weights
+// every class equally regardless of how many samples it has.
+void init_sampler(sampler_t *sampler, dataset_t *dataset, sample_mode_t mode,
+                  unsigned long long seed, const float *weights);
+void free_sampler(sampler_t *sampler);
+
+// Fills order with the sample indices of epoch. The order depends only on
+// the seed and epoch, so a run resumed from a checkpoint sees the same
+// epochs it would have.
+void sampler_epoch(sampler_t *sampler, int epoch);
+
+#endif
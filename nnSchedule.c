@@ -0,0 +1,75 @@
+#include "nnSchedule.h"
+#include <math.h>
+
+void init_schedule(schedule_t *schedule, schedule_kind_t kind, float learning_rate)
+{
+    memset(schedule, 0, sizeof(*schedule));
+    schedule->kind = kind;
+    schedule->learning_rate = learning_rate;
+    schedule->step_epochs = 10;
+    schedule->gamma = 0.1f;
+    schedule->plateau_patience = 2;
+    schedule->min_delta = 0.001f;
+}
+
+float schedule_rate(schedule_t *schedule, training_state_t *state, float epoch, int total)
+{
+    float rate = schedule->learning_rate;
+    switch (schedule->kind)
+    {
+    case SCHEDULE_CONSTANT:
+        break;
+    case SCHEDULE_STEP:
+    {
+        // The epoch the step is in, so the rate only changes between epochs
+        int current = (int)ceilf(epoch) - 1;
+        rate *= powf(schedule->gamma, (float)((current > 0 ? current : 0) / schedule->step_epochs));
+        break;
+    }
+    case SCHEDULE_COSINE:
+    {
+        float span = (float)(total - schedule->warmup_epochs);
+        float t = span > 0 ? (epoch - schedule->warmup_epochs) / span : 1.0f;
+        t = t < 0 ? 0 : t > 1 ? 1 : t;
+        rate = schedule->min_learning_rate +
+               (schedule->learning_rate - schedule->min_learning_rate) * 0.5f * (1.0f + cosf((float)M_PI * t));
+        break;
+    }
+    case SCHEDULE_PLATEAU:
+        rate *= powf(schedule->gamma, (float)state->reductions);
+        break;
+    }
+
+    if (rate < schedule->min_learning_rate)
+        rate = schedule->min_learning_rate;
+    if (epoch < schedule->warmup_epochs)
+        rate *= epoch / schedule->warmup_epochs;
+    return rate;
+}
+
+int schedule_stopped(schedule_t *schedule, training_state_t *state)
+{
+    return schedule->patience > 0 && state->stale_epochs >= schedule->patience;
+}
+
+int schedule_epoch(schedule_t *schedule, training_state_t *state, float accuracy)
+{
+    if (state->best_epoch == 0 || accuracy > state->best_accuracy + schedule->min_delta)
+    {
+        state->best_accuracy = accuracy;
+        state->best_epoch = state->epoch;
+        state->stale_epochs = 0;
+        state->plateau_epochs = 0;
+    }
+    else
+    {
+        state->stale_epochs++;
+        // Only the epochs since the last reduction count towards the next
+        if (schedule->kind == SCHEDULE_PLATEAU && ++state->plateau_epochs >= schedule->plateau_patience)
+        {
+            state->reductions++;
+            state->plateau_epochs = 0;
+        }
+    }
+    return schedule_stopped(schedule, state);
+}
@@ -0,0 +1,62 @@
+#ifndef NN_SCHEDULE_H
+#define NN_SCHEDULE_H
+
+#include "NeuralNet.h"
+
+typedef enum
+{
+    // learning_rate throughout
+    SCHEDULE_CONSTANT,
+    // Multiplied by gamma every step_epochs epochs
+    SCHEDULE_STEP,
+    // Half a cosine from learning_rate down to min_learning_rate over the
+    // epochs after the warmup
+    SCHEDULE_COSINE,
+    // Multiplied by gamma whenever the accuracy hasn't improved for
+    // plateau_patience epochs
+    SCHEDULE_PLATEAU
+} schedule_kind_t;
+
+// How train_dataset() sets the learning rate of every step, and when it
+// stops early. Everything that changes as training goes on is kept in
+// training_state_t, so it is checkpointed with the run and a resumed run
+// carries on with the same rate and patience.
+struct schedule
+{
+    schedule_kind_t kind;
+    float learning_rate;
+    // No schedule goes below it
+    float min_learning_rate;
+    // The rate rises linearly from 0 over the first warmup_epochs, step by
+    // step, whatever the kind
+    int warmup_epochs;
+
+    int step_epochs;
+    // Factor of a step or a plateau
+    float gamma;
+    int plateau_patience;
+
+    // Accuracy, as a fraction of the test set, an epoch has to gain over the
+    // best so far to count as an improvement
+    float min_delta;
+    // Stops after this many epochs without an improvement and rolls back to
+    // the best one, 0 never stops early
+    int patience;
+};
+
+// Defaults for kind: step every 10 epochs by 0.1, plateau after 2 epochs
+// by 0.1, 0.001 min_delta, no warmup and no early stopping
+void init_schedule(schedule_t *schedule, schedule_kind_t kind, float learning_rate);
+
+// The rate of the step that ends epoch epochs into a run of total epochs,
+// epoch counting part epochs
+float schedule_rate(schedule_t *schedule, training_state_t *state, float epoch, int total);
+
+// Records the accuracy of the epoch state has just finished. Returns 1 if
+// training should stop.
+int schedule_epoch(schedule_t *schedule, training_state_t *state, float accuracy);
+
+// Whether state has already run out of patience, as a resumed run may have
+int schedule_stopped(schedule_t *schedule, training_state_t *state);
+
+#endif
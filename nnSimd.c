@@ -0,0 +1,99 @@
+#include "nnSimd.h"
+#include "nnMath.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#define KERNEL_TABLE(suffix, label) \
+    {label, add_##suffix, sub_##suffix, mul_##suffix, scale_##suffix, axpy_##suffix, \
+     sigmoid_##suffix, sigmoid_fast_##suffix, dsigmoid_##suffix, dsigmoid_activated_##suffix, \
+     activate_##suffix, backprop_##suffix, cross_entropy_##suffix, dot_##suffix, sum_##suffix, \
+     momentum_##suffix, nesterov_##suffix, rmsprop_##suffix, adam_##suffix}
+
+// Portable code, one float at a time
+#define SIMD_WIDTH 1
+#define SIMD_NAME(fn) fn##_scalar
+#define SIMD_SQRT(v) ((VEC){sqrtf((v)[0])})
+#include "nnSimdKernels.h"
+#undef SIMD_WIDTH
+#undef SIMD_NAME
+#undef SIMD_SQRT
+
+static const simd_kernels_t scalar_kernels = KERNEL_TABLE(scalar, "scalar");
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// SSE2 is part of the x86-64 baseline, so these need no target pragma
+#define SIMD_WIDTH 4
+#define SIMD_NAME(fn) fn##_sse
+#define SIMD_SQRT(v) ((VEC)_mm_sqrt_ps((__m128)(v)))
+#include "nnSimdKernels.h"
+#undef SIMD_WIDTH
+#undef SIMD_NAME
+#undef SIMD_SQRT
+
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+#define SIMD_WIDTH 8
+#define SIMD_NAME(fn) fn##_avx2
+#define SIMD_SQRT(v) ((VEC)_mm256_sqrt_ps((__m256)(v)))
+#include "nnSimdKernels.h"
+#undef SIMD_WIDTH
+#undef SIMD_NAME
+#undef SIMD_SQRT
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#define SIMD_WIDTH 16
+#define SIMD_NAME(fn) fn##_avx512
+#define SIMD_SQRT(v) ((VEC)_mm512_sqrt_ps((__m512)(v)))
+#include "nnSimdKernels.h"
+#undef SIMD_WIDTH
+#undef SIMD_NAME
+#undef SIMD_SQRT
+#pragma GCC pop_options
+
+static const simd_kernels_t sse_kernels = KERNEL_TABLE(sse, "sse");
+static const simd_kernels_t avx2_kernels = KERNEL_TABLE(avx2, "avx2");
+static const simd_kernels_t avx512_kernels = KERNEL_TABLE(avx512, "avx512");
+
+#endif
+
+simd_kernels_t simd = KERNEL_TABLE(scalar, "scalar");
+
+__attribute__((constructor)) void simd_init()
+{
+    const char *forced = getenv("NN_SIMD");
+    simd = scalar_kernels;
+
+    if (forced != NULL && strcmp(forced, "scalar") == 0)
+        return;
+
+#if defined(__x86_64__) || defined(__i386__)
+    // __builtin_cpu_supports reads CPUID, and for AVX and up also checks
+    // that the OS saves the wider registers
+    __builtin_cpu_init();
+
+    const simd_kernels_t *candidates[] = {&avx512_kernels, &avx2_kernels, &sse_kernels};
+    int supported[] = {
+        __builtin_cpu_supports("avx512f"),
+        __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"),
+        __builtin_cpu_supports("sse2"),
+    };
+
+    for (int i = 0; i < (int)(sizeof(candidates) / sizeof(candidates[0])); i++)
+    {
+        if (!supported[i])
+            continue;
+        if (forced != NULL && strcmp(forced, candidates[i]->name) != 0)
+            continue;
+        simd = *candidates[i];
+        return;
+    }
+#endif
+}
@@ -0,0 +1,73 @@
+#ifndef NN_SIMD_H
+#define NN_SIMD_H
+
+// Vectorized kernels behind the elementwise and reduction ops in nnMath.c.
+// One table is built per instruction set and the best one the CPU supports
+// is picked at startup. All kernels take plain arrays of n floats and
+// handle any n, including the tail that does not fill a whole register.
+typedef struct
+{
+    const char *name;
+
+    // out = a + b, out = a - b, out = a * b
+    void (*add)(float *out, const float *a, const float *b, int n);
+    void (*sub)(float *out, const float *a, const float *b, int n);
+    void (*mul)(float *out, const float *a, const float *b, int n);
+
+    // out = a * scalar, out += a * scalar
+    void (*scale)(float *out, const float *a, float scalar, int n);
+    void (*axpy)(float *out, const float *a, float scalar, int n);
+
+    // out = sigmoid(a), out = sigmoid(a) * (1 - sigmoid(a)). The errors of
+    // sigmoid and sigmoid_fast are those of SIGMOID_EXACT and SIGMOID_FAST.
+    void (*sigmoid)(float *out, const float *a, int n);
+    void (*sigmoid_fast)(float *out, const float *a, int n);
+    void (*dsigmoid)(float *out, const float *a, int n);
+
+    // The sigmoid derivative from an already activated a, out = a * (1 - a)
+    void (*dsigmoid_activated)(float *out, const float *a, int n);
+
+    // out = f(a + bias) for an activation_t f, bias NULL for none. Softmax
+    // takes the n values as one row. fast evaluates sigmoid and tanh with
+    // sigmoid_fast's exp.
+    void (*activate)(float *out, const float *a, const float *bias, int n, int activation, int fast);
+    // delta = g * f'(a) from the activated outputs a, g being delta, or
+    // a - expected when expected isn't NULL. For softmax the n values are
+    // one row and g goes through its Jacobian, a * (g - sum of g * a).
+    void (*backprop)(float *delta, const float *a, const float *expected, int n, int activation);
+
+    // Softmax cross-entropy of a row of n logits z against targets y in one
+    // pass: p = softmax(z), delta = p - y, returns the sum of
+    // y * (logsumexp(z) - z). p may be z.
+    float (*cross_entropy)(float *p, float *delta, const float *z, const float *y, int n, int fast);
+
+    // Sum of a * b, and sum of a
+    float (*dot)(const float *a, const float *b, int n);
+    float (*sum)(const float *a, int n);
+
+    // Optimizer updates of n parameters w in one pass, with g the summed
+    // gradient and scale turning it into the mean, g' = g * scale.
+    // momentum:  v = mu * v + g',  w -= lr * v
+    // nesterov:  v = mu * v + g',  w -= lr * (g' + mu * v)
+    // rmsprop:   s = rho * s + (1 - rho) * g'^2,  w -= lr * g' / (sqrt(s) + eps)
+    // adam:      m = b1 * m + (1 - b1) * g',  v = b2 * v + (1 - b2) * g'^2,
+    //            w -= lr * m / (sqrt(v) + eps), bias correction being left
+    //            to the caller's lr and eps
+    void (*momentum)(float *w, float *v, const float *g, float scale, float lr, float mu, int n);
+    void (*nesterov)(float *w, float *v, const float *g, float scale, float lr, float mu, int n);
+    void (*rmsprop)(float *w, float *s, const float *g, float scale, float lr, float rho, float eps, int n);
+    void (*adam)(float *w, float *m, float *v, const float *g, float scale, float lr,
+                 float beta1, float beta2, float eps, int n);
+} simd_kernels_t;
+
+// The kernels in use. Valid before simd_init() runs, it then points at the
+// portable ones.
+extern simd_kernels_t simd;
+
+// Picks the widest instruction set the CPU and OS support. Runs
+// automatically at startup, and can be called again after changing the
+// NN_SIMD environment variable, which forces one of "scalar", "sse",
+// "avx2" or "avx512" when the CPU supports it.
+void simd_init();
+
+#endif
@@ -0,0 +1,568 @@
+// Kernel bodies for nnSimd.c. This file has no include guard on purpose,
+// it is included once per instruction set with SIMD_WIDTH (floats per
+// register), SIMD_NAME (adds the instruction set suffix) and SIMD_SQRT (the
+// instruction set's square root of a VEC) defined, under a target pragma,
+// so the compiler lowers the same vector code to SSE, AVX2 or AVX-512.
+
+typedef float SIMD_NAME(vec_t) __attribute__((vector_size(SIMD_WIDTH * sizeof(float))));
+typedef int SIMD_NAME(ivec_t) __attribute__((vector_size(SIMD_WIDTH * sizeof(int))));
+
+#define VEC SIMD_NAME(vec_t)
+#define IVEC SIMD_NAME(ivec_t)
+
+static inline VEC SIMD_NAME(load)(const float *p)
+{
+    VEC v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline void SIMD_NAME(store)(float *p, VEC v)
+{
+    memcpy(p, &v, sizeof(v));
+}
+
+// mask ? a : b, the mask being the result of a vector comparison
+static inline VEC SIMD_NAME(select)(IVEC mask, VEC a, VEC b)
+{
+    return (VEC)(((IVEC)a & mask) | ((IVEC)b & ~mask));
+}
+
+static inline float SIMD_NAME(hsum)(VEC v)
+{
+    float sum = 0;
+    for (int i = 0; i < SIMD_WIDTH; i++)
+        sum += v[i];
+    return sum;
+}
+
+// exp(x), Cephes style: x = n*ln(2) + r with |r| <= ln(2)/2, a degree 6
+// polynomial for exp(r) and 2^n built in the exponent bits. Max error is
+// 2 ULP over [-87.3, 88.3], inputs outside that are clamped to it.
+static inline VEC SIMD_NAME(exp)(VEC x)
+{
+    VEC hi = (VEC){0} + 88.3762626647949f;
+    VEC lo = (VEC){0} - 87.3365447504f;
+    x = SIMD_NAME(select)(x > hi, hi, x);
+    x = SIMD_NAME(select)(x < lo, lo, x);
+
+    // Round to nearest by pushing the fraction bits out of the mantissa
+    VEC n = x * 1.44269504088896341f + 12582912.0f;
+    n = n - 12582912.0f;
+
+    VEC r = x - n * 0.693359375f;
+    r = r + n * 2.12194440e-4f;
+
+    VEC p = (VEC){0} + 1.9875691500E-4f;
+    p = p * r + 1.3981999507E-3f;
+    p = p * r + 8.3334519073E-3f;
+    p = p * r + 4.1665795894E-2f;
+    p = p * r + 1.6666665459E-1f;
+    p = p * r + 5.0000001201E-1f;
+    p = p * r * r + r + 1.0f;
+
+    IVEC pow2 = (__builtin_convertvector(n, IVEC) + 127) << 23;
+    return p * (VEC)pow2;
+}
+
+static inline VEC SIMD_NAME(sigmoid_vec)(VEC x)
+{
+    return 1.0f / (1.0f + SIMD_NAME(exp)(-x));
+}
+
+// exp(x) as 2^(x * log2(e)): one multiply for the range reduction and a
+// degree 3 polynomial for 2^f on [-0.5, 0.5]. Max relative error is
+// 7.8e-5 over [-87, 88], inputs outside that are clamped to it.
+static inline VEC SIMD_NAME(fast_exp)(VEC x)
+{
+    VEC hi = (VEC){0} + 88.0f;
+    VEC lo = (VEC){0} - 87.0f;
+    x = SIMD_NAME(select)(x > hi, hi, x);
+    x = SIMD_NAME(select)(x < lo, lo, x);
+
+    VEC t = x * 1.44269504088896341f;
+    VEC n = (t + 12582912.0f) - 12582912.0f;
+    VEC f = t - n;
+
+    VEC p = (VEC){0} + 5.508868e-2f;
+    p = p * f + 2.4260405e-1f;
+    p = p * f + 6.9327624e-1f;
+    p = p * f + 9.9992894e-1f;
+
+    IVEC pow2 = (__builtin_convertvector(n, IVEC) + 127) << 23;
+    return p * (VEC)pow2;
+}
+
+// The relative error e of fast_exp moves sigmoid by at most
+// sigmoid * (1 - sigmoid) * e <= e / 4, so this is within 2e-5 of the
+// exact sigmoid everywhere
+static inline VEC SIMD_NAME(fast_sigmoid_vec)(VEC x)
+{
+    return 1.0f / (1.0f + SIMD_NAME(fast_exp)(-x));
+}
+
+static void SIMD_NAME(add)(float *out, const float *a, const float *b, int n)
+{
+    int i = 0;
+    for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH)
+        SIMD_NAME(store)(&out[i], SIMD_NAME(load)(&a[i]) + SIMD_NAME(load)(&b[i]));
+    for (; i < n; i++)
+        out[i] = a[i] + b[i];
+}
+
+static void SIMD_NAME(sub)(float *out, const float *a, const float *b, int n)
+{
+    int i = 0;
+    for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH)
+        SIMD_NAME(store)(&out[i], SIMD_NAME(load)(&a[i]) - SIMD_NAME(load)(&b[i]));
+    for (; i < n; i++)
+        out[i] = a[i] - b[i];
+}
+
+static void SIMD_NAME(mul)(float *out, const float *a, const float *b, int n)
+{
+    int i = 0;
+    for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH)
+        SIMD_NAME(store)(&out[i], SIMD_NAME(load)(&a[i]) * SIMD_NAME(load)(&b[i]));
+    for (; i < n; i++)
+        out[i] = a[i] * b[i];
+}
+
+static void SIMD_NAME(scale)(float *out, const float *a, float scalar, int n)
+{
+    int i = 0;
+    for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH)
+        SIMD_NAME(store)(&out[i], SIMD_NAME(load)(&a[i]) * scalar);
+    for (; i < n; i++)
+        out[i] = a[i] * scalar;
+}
+
+static void SIMD_NAME(axpy)(float *out, const float *a, float scalar, int n)
+{
+    int i = 0;
+    for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH)
+        SIMD_NAME(store)(&out[i], SIMD_NAME(load)(&out[i]) + SIMD_NAME(load)(&a[i]) * scalar);
+    for (; i < n; i++)
+        out[i] += a[i] * scalar;
+}
+
+// The tail goes through a zero padded register so every element gets the
+// same approximation no matter where it sits in the array
+static void SIMD_NAME(sigmoid)(float *out, const float *a, int n)
+{
+    int i = 0;
+    for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH)
+        SIMD_NAME(store)(&out[i], SIMD_NAME(sigmoid_vec)(SIMD_NAME(load)(&a[i])));
+    if (i < n)
+    {
+        float tail[SIMD_WIDTH] = {0};
+        memcpy(tail, &a[i], (n - i) * sizeof(float));
+        SIMD_NAME(store)(tail, SIMD_NAME(sigmoid_vec)(SIMD_NAME(load)(tail)));
+        memcpy(&out[i], tail, (n - i) * sizeof(float));
+    }
+}
+
+static void SIMD_NAME(sigmoid_fast)(float *out, const float *a, int n)
+{
+    int i = 0;
+    for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH)
+        SIMD_NAME(store)(&out[i], SIMD_NAME(fast_sigmoid_vec)(SIMD_NAME(load)(&a[i])));
+    if (i < n)
+    {
+        float tail[SIMD_WIDTH] = {0};
+        memcpy(tail, &a[i], (n - i) * sizeof(float));
+        SIMD_NAME(store)(tail, SIMD_NAME(fast_sigmoid_vec)(SIMD_NAME(load)(tail)));
+        memcpy(&out[i], tail, (n - i) * sizeof(float));
+    }
+}
+
+static void SIMD_NAME(dsigmoid)(float *out, const float *a, int n)
+{
+    int i = 0;
+    for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH)
+    {
+        VEC sig = SIMD_NAME(sigmoid_vec)(SIMD_NAME(load)(&a[i]));
+        SIMD_NAME(store)(&out[i], sig * (1.0f - sig));
+    }
+    if (i < n)
+    {
+        float tail[SIMD_WIDTH] = {0};
+        memcpy(tail, &a[i], (n - i) * sizeof(float));
+        VEC sig = SIMD_NAME(sigmoid_vec)(SIMD_NAME(load)(tail));
+        SIMD_NAME(store)(tail, sig * (1.0f - sig));
+        memcpy(&out[i], tail, (n - i) * sizeof(float));
+    }
+}
+
+static void SIMD_NAME(dsigmoid_activated)(float *out, const float *a, int n)
+{
+    int i = 0;
+    for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH)
+    {
+        VEC sig = SIMD_NAME(load)(&a[i]);
+        SIMD_NAME(store)(&out[i], sig * (1.0f - sig));
+    }
+    for (; i < n; i++)
+        out[i] = a[i] * (1 - a[i]);
+}
+
+// Two accumulators to hide the add latency
+static float SIMD_NAME(dot)(const float *a, const float *b, int n)
+{
+    VEC acc0 = {0};
+    VEC acc1 = {0};
+    int i = 0;
+    for (; i + 2 * SIMD_WIDTH <= n; i += 2 * SIMD_WIDTH)
+    {
+        acc0 += SIMD_NAME(load)(&a[i]) * SIMD_NAME(load)(&b[i]);
+        acc1 += SIMD_NAME(load)(&a[i + SIMD_WIDTH]) * SIMD_NAME(load)(&b[i + SIMD_WIDTH]);
+    }
+    for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH)
+        acc0 += SIMD_NAME(load)(&a[i]) * SIMD_NAME(load)(&b[i]);
+
+    float sum = SIMD_NAME(hsum)(acc0 + acc1);
+    for (; i < n; i++)
+        sum += a[i] * b[i];
+    return sum;
+}
+
+static float SIMD_NAME(sum)(const float *a, int n)
+{
+    VEC acc0 = {0};
+    VEC acc1 = {0};
+    int i = 0;
+    for (; i + 2 * SIMD_WIDTH <= n; i += 2 * SIMD_WIDTH)
+    {
+        acc0 += SIMD_NAME(load)(&a[i]);
+        acc1 += SIMD_NAME(load)(&a[i + SIMD_WIDTH]);
+    }
+    for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH)
+        acc0 += SIMD_NAME(load)(&a[i]);
+
+    float sum = SIMD_NAME(hsum)(acc0 + acc1);
+    for (; i < n; i++)
+        sum += a[i];
+    return sum;
+}
+
+// An elementwise activation of x. Always inlined with a constant
+// activation, so each gets a loop of its own with the switch folded away.
+static inline __attribute__((always_inline)) VEC SIMD_NAME(activation_vec)(VEC x, int activation, int fast)
+{
+    switch (activation)
+    {
+    case ACTIVATION_RELU:
+        return SIMD_NAME(select)(x > 0, x, (VEC){0});
+    case ACTIVATION_LEAKY_RELU:
+        return SIMD_NAME(select)(x > 0, x, x * LEAKY_RELU_SLOPE);
+    case ACTIVATION_TANH:
+        // tanh(x) = 2 * sigmoid(2x) - 1
+        x = x + x;
+        return (fast ? SIMD_NAME(fast_sigmoid_vec)(x) : SIMD_NAME(sigmoid_vec)(x)) * 2.0f - 1.0f;
+    default:
+        return fast ? SIMD_NAME(fast_sigmoid_vec)(x) : SIMD_NAME(sigmoid_vec)(x);
+    }
+}
+
+// The derivative of an elementwise activation from its output a
+static inline __attribute__((always_inline)) VEC SIMD_NAME(derivative_vec)(VEC a, int activation)
+{
+    switch (activation)
+    {
+    case ACTIVATION_RELU:
+        return SIMD_NAME(select)(a > 0, (VEC){0} + 1.0f, (VEC){0});
+    case ACTIVATION_LEAKY_RELU:
+        return SIMD_NAME(select)(a > 0, (VEC){0} + 1.0f, (VEC){0} + LEAKY_RELU_SLOPE);
+    case ACTIVATION_TANH:
+        return 1.0f - a * a;
+    default:
+        return a * (1.0f - a);
+    }
+}
+
+static inline __attribute__((always_inline)) void SIMD_NAME(activate_loop)(float *out, const float *a, const float *bias,
+                                                                            int n, int activation, int fast)
+{
+    int i = 0;
+    for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH)
+    {
+        VEC x = SIMD_NAME(load)(&a[i]);
+        if (bias != NULL)
+            x += SIMD_NAME(load)(&bias[i]);
+        SIMD_NAME(store)(&out[i], SIMD_NAME(activation_vec)(x, activation, fast));
+    }
+    if (i < n)
+    {
+        float tail[SIMD_WIDTH] = {0};
+        for (int j = 0; j < n - i; j++)
+            tail[j] = a[i + j] + (bias != NULL ? bias[i + j] : 0);
+        SIMD_NAME(store)(tail, SIMD_NAME(activation_vec)(SIMD_NAME(load)(tail), activation, fast));
+        memcpy(&out[i], tail, (n - i) * sizeof(float));
+    }
+}
+
+// The largest value is taken out before exp, so nothing overflows, and the
+// sum is at least 1
+static void SIMD_NAME(softmax)(float *out, const float *a, const float *bias, int n, int fast)
+{
+    float max = -INFINITY;
+    for (int i = 0; i < n; i++)
+    {
+        out[i] = a[i] + (bias != NULL ? bias[i] : 0);
+        max = out[i] > max ? out[i] : max;
+    }
+
+    VEC sum = {0};
+    int i = 0;
+    for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH)
+    {
+        VEC x = SIMD_NAME(load)(&out[i]) - max;
+        VEC e = fast ? SIMD_NAME(fast_exp)(x) : SIMD_NAME(exp)(x);
+        SIMD_NAME(store)(&out[i], e);
+        sum += e;
+    }
+    float total = SIMD_NAME(hsum)(sum);
+    if (i < n)
+    {
+        float tail[SIMD_WIDTH] = {0};
+        memcpy(tail, &out[i], (n - i) * sizeof(float));
+        VEC x = SIMD_NAME(load)(tail) - max;
+        SIMD_NAME(store)(tail, fast ? SIMD_NAME(fast_exp)(x) : SIMD_NAME(exp)(x));
+        for (int j = 0; j < n - i; j++)
+            total += tail[j];
+        memcpy(&out[i], tail, (n - i) * sizeof(float));
+    }
+
+    SIMD_NAME(scale)(out, out, 1.0f / total, n);
+}
+
+static void SIMD_NAME(activate)(float *out, const float *a, const float *bias, int n, int activation, int fast)
+{
+    switch (activation)
+    {
+    case ACTIVATION_RELU:
+        SIMD_NAME(activate_loop)(out, a, bias, n, ACTIVATION_RELU, 0);
+        break;
+    case ACTIVATION_LEAKY_RELU:
+        SIMD_NAME(activate_loop)(out, a, bias, n, ACTIVATION_LEAKY_RELU, 0);
+        break;
+    case ACTIVATION_TANH:
+        if (fast)
+            SIMD_NAME(activate_loop)(out, a, bias, n, ACTIVATION_TANH, 1);
+        else
+            SIMD_NAME(activate_loop)(out, a, bias, n, ACTIVATION_TANH, 0);
+        break;
+    case ACTIVATION_SOFTMAX:
+        SIMD_NAME(softmax)(out, a, bias, n, fast);
+        break;
+    case ACTIVATION_LINEAR:
+        if (bias != NULL)
+            SIMD_NAME(add)(out, a, bias, n);
+        else if (out != a)
+            memmove(out, a, n * sizeof(float));
+        break;
+    default:
+        if (fast)
+            SIMD_NAME(activate_loop)(out, a, bias, n, ACTIVATION_SIGMOID, 1);
+        else
+            SIMD_NAME(activate_loop)(out, a, bias, n, ACTIVATION_SIGMOID, 0);
+        break;
+    }
+}
+
+static inline __attribute__((always_inline)) void SIMD_NAME(backprop_loop)(float *delta, const float *a, const float *expected,
+                                                                            int n, int activation)
+{
+    int i = 0;
+    for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH)
+    {
+        VEC out = SIMD_NAME(load)(&a[i]);
+        VEC g = expected != NULL ? out - SIMD_NAME(load)(&expected[i]) : SIMD_NAME(load)(&delta[i]);
+        SIMD_NAME(store)(&delta[i], g * SIMD_NAME(derivative_vec)(out, activation));
+    }
+    if (i < n)
+    {
+        float out[SIMD_WIDTH] = {0};
+        float g[SIMD_WIDTH] = {0};
+        for (int j = 0; j < n - i; j++)
+        {
+            out[j] = a[i + j];
+            g[j] = expected != NULL ? a[i + j] - expected[i + j] : delta[i + j];
+        }
+        SIMD_NAME(store)(g, SIMD_NAME(load)(g) * SIMD_NAME(derivative_vec)(SIMD_NAME(load)(out), activation));
+        memcpy(&delta[i], g, (n - i) * sizeof(float));
+    }
+}
+
+static void SIMD_NAME(backprop)(float *delta, const float *a, const float *expected, int n, int activation)
+{
+    switch (activation)
+    {
+    case ACTIVATION_RELU:
+        SIMD_NAME(backprop_loop)(delta, a, expected, n, ACTIVATION_RELU);
+        break;
+    case ACTIVATION_LEAKY_RELU:
+        SIMD_NAME(backprop_loop)(delta, a, expected, n, ACTIVATION_LEAKY_RELU);
+        break;
+    case ACTIVATION_TANH:
+        SIMD_NAME(backprop_loop)(delta, a, expected, n, ACTIVATION_TANH);
+        break;
+    case ACTIVATION_LINEAR:
+        if (expected != NULL)
+            SIMD_NAME(sub)(delta, a, expected, n);
+        break;
+    case ACTIVATION_SOFTMAX:
+    {
+        if (expected != NULL)
+            SIMD_NAME(sub)(delta, a, expected, n);
+        float dot = SIMD_NAME(dot)(delta, a, n);
+        int i = 0;
+        for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH)
+            SIMD_NAME(store)(&delta[i], SIMD_NAME(load)(&a[i]) * (SIMD_NAME(load)(&delta[i]) - dot));
+        for (; i < n; i++)
+            delta[i] = a[i] * (delta[i] - dot);
+        break;
+    }
+    default:
+        SIMD_NAME(backprop_loop)(delta, a, expected, n, ACTIVATION_SIGMOID);
+        break;
+    }
+}
+
+// The targets are read while the logits are still there, so p can
+// overwrite them on the way through
+static float SIMD_NAME(cross_entropy)(float *p, float *delta, const float *z, const float *y, int n, int fast)
+{
+    float max = -INFINITY;
+    for (int i = 0; i < n; i++)
+        max = z[i] > max ? z[i] : max;
+
+    VEC sum = {0};
+    VEC target = {0};
+    VEC target_logits = {0};
+    int i = 0;
+    for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH)
+    {
+        VEC x = SIMD_NAME(load)(&z[i]) - max;
+        VEC t = SIMD_NAME(load)(&y[i]);
+        VEC e = fast ? SIMD_NAME(fast_exp)(x) : SIMD_NAME(exp)(x);
+        target += t;
+        target_logits += t * x;
+        sum += e;
+        SIMD_NAME(store)(&p[i], e);
+    }
+    float total = SIMD_NAME(hsum)(sum);
+    float targets = SIMD_NAME(hsum)(target);
+    float weighted = SIMD_NAME(hsum)(target_logits);
+    if (i < n)
+    {
+        // Zero padded lanes of x would add e^0 to the sum, so only the
+        // real ones are kept
+        float tail[SIMD_WIDTH] = {0};
+        for (int j = 0; j < n - i; j++)
+        {
+            tail[j] = z[i + j] - max;
+            targets += y[i + j];
+            weighted += y[i + j] * tail[j];
+        }
+        VEC x = SIMD_NAME(load)(tail);
+        SIMD_NAME(store)(tail, fast ? SIMD_NAME(fast_exp)(x) : SIMD_NAME(exp)(x));
+        for (int j = 0; j < n - i; j++)
+            total += tail[j];
+        memcpy(&p[i], tail, (n - i) * sizeof(float));
+    }
+
+    float inverse = 1.0f / total;
+    i = 0;
+    for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH)
+    {
+        VEC prob = SIMD_NAME(load)(&p[i]) * inverse;
+        SIMD_NAME(store)(&p[i], prob);
+        SIMD_NAME(store)(&delta[i], prob - SIMD_NAME(load)(&y[i]));
+    }
+    for (; i < n; i++)
+    {
+        p[i] *= inverse;
+        delta[i] = p[i] - y[i];
+    }
+
+    // logsumexp(z) - z = log(total) - (z - max)
+    return targets * logf(total) - weighted;
+}
+
+static void SIMD_NAME(momentum)(float *w, float *v, const float *g, float scale, float lr, float mu, int n)
+{
+    int i = 0;
+    for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH)
+    {
+        VEC velocity = SIMD_NAME(load)(&v[i]) * mu + SIMD_NAME(load)(&g[i]) * scale;
+        SIMD_NAME(store)(&v[i], velocity);
+        SIMD_NAME(store)(&w[i], SIMD_NAME(load)(&w[i]) - velocity * lr);
+    }
+    for (; i < n; i++)
+    {
+        v[i] = v[i] * mu + g[i] * scale;
+        w[i] -= v[i] * lr;
+    }
+}
+
+static void SIMD_NAME(nesterov)(float *w, float *v, const float *g, float scale, float lr, float mu, int n)
+{
+    int i = 0;
+    for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH)
+    {
+        VEC grad = SIMD_NAME(load)(&g[i]) * scale;
+        VEC velocity = SIMD_NAME(load)(&v[i]) * mu + grad;
+        SIMD_NAME(store)(&v[i], velocity);
+        SIMD_NAME(store)(&w[i], SIMD_NAME(load)(&w[i]) - (grad + velocity * mu) * lr);
+    }
+    for (; i < n; i++)
+    {
+        float grad = g[i] * scale;
+        v[i] = v[i] * mu + grad;
+        w[i] -= (grad + v[i] * mu) * lr;
+    }
+}
+
+static void SIMD_NAME(rmsprop)(float *w, float *s, const float *g, float scale, float lr, float rho, float eps, int n)
+{
+    int i = 0;
+    for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH)
+    {
+        VEC grad = SIMD_NAME(load)(&g[i]) * scale;
+        VEC square = SIMD_NAME(load)(&s[i]) * rho + grad * grad * (1 - rho);
+        SIMD_NAME(store)(&s[i], square);
+        SIMD_NAME(store)(&w[i], SIMD_NAME(load)(&w[i]) - grad * lr / (SIMD_SQRT(square) + eps));
+    }
+    for (; i < n; i++)
+    {
+        float grad = g[i] * scale;
+        s[i] = s[i] * rho + grad * grad * (1 - rho);
+        w[i] -= grad * lr / (sqrtf(s[i]) + eps);
+    }
+}
+
+static void SIMD_NAME(adam)(float *w, float *m, float *v, const float *g, float scale, float lr,
+                            float beta1, float beta2, float eps, int n)
+{
+    int i = 0;
+    for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH)
+    {
+        VEC grad = SIMD_NAME(load)(&g[i]) * scale;
+        VEC mean = SIMD_NAME(load)(&m[i]) * beta1 + grad * (1 - beta1);
+        VEC square = SIMD_NAME(load)(&v[i]) * beta2 + grad * grad * (1 - beta2);
+        SIMD_NAME(store)(&m[i], mean);
+        SIMD_NAME(store)(&v[i], square);
+        SIMD_NAME(store)(&w[i], SIMD_NAME(load)(&w[i]) - mean * lr / (SIMD_SQRT(square) + eps));
+    }
+    for (; i < n; i++)
+    {
+        float grad = g[i] * scale;
+        m[i] = m[i] * beta1 + grad * (1 - beta1);
+        v[i] = v[i] * beta2 + grad * grad * (1 - beta2);
+        w[i] -= m[i] * lr / (sqrtf(v[i]) + eps);
+    }
+}
+
+#undef VEC
+#undef IVEC
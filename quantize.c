@@ -0,0 +1,169 @@
+#include "nnQuant.h"
+#include "nnModel.h"
+#include <math.h>
+#include <sys/stat.h>
+#include <time.h>
+
+// Quantizes a trained model to int8, calibrating the activation ranges on
+// the first samples of a dataset, then compares the accuracy and
+// throughput of the int8 kernels with the float model on a test set.
+//
+// usage: quantize model.nnm calibration-images calibration-labels test-images test-labels [output.nnm]
+
+#define CALIBRATION_SAMPLES 1000
+#define BATCH_SIZE 256
+#define DEFAULT_OUTPUT "quantized.nnm"
+
+static double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static long file_size(const char *path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 ? (long)st.st_size : -1;
+}
+
+static int count_correct(matrix_t *outputs, dataset_t *set)
+{
+    int sum = 0;
+    for (int i = 0; i < outputs->row; i++)
+    {
+        float *row = &outputs->arr[(size_t)i * outputs->col];
+        int max_index = 0;
+        for (int j = 0; j < outputs->col; j++)
+        {
+            if (row[j] > row[max_index])
+                max_index = j;
+        }
+        sum += max_index == dataset_label(set, i);
+    }
+    return sum;
+}
+
+static float max_difference(matrix_t *a, matrix_t *b)
+{
+    float largest = 0;
+    for (size_t i = 0; i < (size_t)a->row * a->col; i++)
+        largest = fabsf(a->arr[i] - b->arr[i]) > largest ? fabsf(a->arr[i] - b->arr[i]) : largest;
+    return largest;
+}
+
+// Samples per second, over at least half a second of repeats
+static double float_throughput(model_t *model, matrix_t *inputs, matrix_t *outputs)
+{
+    exec_context_t context;
+    init_context(&context, model, BATCH_SIZE);
+
+    int reps = 0;
+    double start = now_seconds(), elapsed;
+    do
+    {
+        predict_batch(model, &context, inputs, outputs);
+        reps++;
+        elapsed = now_seconds() - start;
+    } while (elapsed < 0.5);
+
+    free_context(&context);
+    return (double)inputs->row * reps / elapsed;
+}
+
+static double int8_throughput(quant_model_t *quant, matrix_t *inputs, matrix_t *outputs)
+{
+    quant_context_t context;
+    init_quant_context(&context, quant, BATCH_SIZE);
+
+    int reps = 0;
+    double start = now_seconds(), elapsed;
+    do
+    {
+        predict_batch_int8(quant, &context, inputs, outputs);
+        reps++;
+        elapsed = now_seconds() - start;
+    } while (elapsed < 0.5);
+
+    free_quant_context(&context);
+    return (double)inputs->row * reps / elapsed;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 6)
+    {
+        fprintf(stderr, "usage: %s model.nnm calibration-images calibration-labels test-images test-labels [output.nnm]\n", argv[0]);
+        exit(-1);
+    }
+    const char *output_path = argc > 6 ? argv[6] : DEFAULT_OUTPUT;
+
+    model_t model;
+    dataset_t calibration_set, test_set;
+    if (open_model(&model, argv[1]) == -1 ||
+        load_dataset(&calibration_set, argv[2], argv[3], 0) == -1 ||
+        load_dataset(&test_set, argv[4], argv[5], 0) == -1)
+    {
+        exit(-1);
+    }
+    int outputs = model.lengths[model.num_layers - 1];
+    if (calibration_set.features != model.lengths[0] || test_set.features != model.lengths[0])
+    {
+        fprintf(stderr, "dataset shape doesn't match the model\n");
+        exit(-1);
+    }
+
+    int samples = calibration_set.count < CALIBRATION_SAMPLES ? calibration_set.count : CALIBRATION_SAMPLES;
+    matrix_t calibration = init_matrix(samples, calibration_set.features);
+    gather_inputs(&calibration_set, 0, samples, &calibration);
+
+    quant_model_t quant;
+    quantize_model(&quant, &model, &calibration);
+    if (save_quant_model(&quant, output_path) == -1)
+        exit(-1);
+    free_quant_model(&quant);
+
+    // Evaluate what was written, not what is still in memory
+    if (verify_model(output_path) == -1 || load_quant_model(&quant, output_path) == -1)
+        exit(-1);
+    quant.sigmoid_mode = model.sigmoid_mode;
+    printf("Calibrated on %d samples, wrote %s: %ld bytes, float model %ld bytes\n",
+           samples, output_path, file_size(output_path), file_size(argv[1]));
+
+    matrix_t inputs = init_matrix(test_set.count, test_set.features);
+    matrix_t float_outputs = init_matrix(test_set.count, outputs);
+    matrix_t int8_outputs = init_matrix(test_set.count, outputs);
+    gather_inputs(&test_set, 0, test_set.count, &inputs);
+
+    double float_rate = float_throughput(&model, &inputs, &float_outputs);
+    printf("%-8s accuracy %d / %d  %10.0f samples/s\n", "float",
+           count_correct(&float_outputs, &test_set), test_set.count, float_rate);
+
+    // Every int8 kernel this CPU runs, forced one at a time
+    const char *kernels[] = {"scalar", "avx2", "avx512"};
+    for (int i = 0; i < (int)(sizeof(kernels) / sizeof(kernels[0])); i++)
+    {
+        setenv("NN_SIMD", kernels[i], 1);
+        quant_init();
+        if (strcmp(quant_kernel_name, kernels[i]) != 0)
+            continue;
+
+        double rate = int8_throughput(&quant, &inputs, &int8_outputs);
+        printf("int8 %-4s accuracy %d / %d  %10.0f samples/s  %.2fx  max output difference %.4f\n", kernels[i],
+               count_correct(&int8_outputs, &test_set), test_set.count, rate, rate / float_rate,
+               max_difference(&int8_outputs, &float_outputs));
+    }
+    unsetenv("NN_SIMD");
+    quant_init();
+
+    free_matrix(&inputs);
+    free_matrix(&float_outputs);
+    free_matrix(&int8_outputs);
+    free_matrix(&calibration);
+    free_quant_model(&quant);
+    close_model(&model);
+    free_dataset(&calibration_set);
+    free_dataset(&test_set);
+
+    return 0;
+}
@@ -0,0 +1,501 @@
+#include "NeuralNet.h"
+#include "nnInference.h"
+#include "nnModel.h"
+#include "nnOptimizer.h"
+#include "nnSimd.h"
+#include <string.h>
+
+// Checks of the kernels, the sigmoid modes, the model formats and the
+// allocation free hot paths, one test per name so ctest runs and reports
+// them separately. Files are written to the working directory, the
+// checked in legacy models are read from source-dir.
+//
+// usage: tests name [source-dir]
+
+static const char *isas[] = {"scalar", "sse", "avx2", "avx512"};
+
+static void fill_random(float *arr, int len, float low, float high)
+{
+    for (int i = 0; i < len; i++)
+    {
+        arr[i] = low + (high - low) * ((float)rand() / RAND_MAX);
+    }
+}
+
+// out = op(a) * op(b), computed one dot product at a time in double
+static void reference_mat_mat(double *out, matrix_t *a, matrix_t *b, int m, int n, int k, int trans_a, int trans_b)
+{
+    for (int i = 0; i < m; i++)
+    {
+        for (int j = 0; j < n; j++)
+        {
+            double sum = 0;
+            for (int p = 0; p < k; p++)
+            {
+                float a_val = trans_a ? a->arr[p * a->col + i] : a->arr[i * a->col + p];
+                float b_val = trans_b ? b->arr[j * b->col + p] : b->arr[p * b->col + j];
+                sum += (double)a_val * b_val;
+            }
+            out[i * n + j] = sum;
+        }
+    }
+}
+
+static double reference_activation(activation_t activation, double x)
+{
+    switch (activation)
+    {
+    case ACTIVATION_SIGMOID:
+        return 1 / (1 + exp(-x));
+    case ACTIVATION_RELU:
+        return x > 0 ? x : 0;
+    case ACTIVATION_LEAKY_RELU:
+        return x > 0 ? x : x * LEAKY_RELU_SLOPE;
+    case ACTIVATION_TANH:
+        return tanh(x);
+    default:
+        return x;
+    }
+}
+
+// The derivative from the activated output a
+static double reference_derivative(activation_t activation, double a)
+{
+    switch (activation)
+    {
+    case ACTIVATION_SIGMOID:
+        return a * (1 - a);
+    case ACTIVATION_RELU:
+        return a > 0 ? 1 : 0;
+    case ACTIVATION_LEAKY_RELU:
+        return a > 0 ? 1 : LEAKY_RELU_SLOPE;
+    case ACTIVATION_TANH:
+        return 1 - a * a;
+    default:
+        return 1;
+    }
+}
+
+// Largest difference of out from expected, printed with whether it is
+// within tolerance
+static int compare(const char *what, const char *isa, int m, int n, int k, const float *out, const double *expected,
+                   double tolerance)
+{
+    double max_error = 0;
+    for (int i = 0; i < m * n; i++)
+    {
+        double error = fabs(out[i] - expected[i]);
+        if (!(error <= max_error))
+            max_error = error;
+    }
+    int passed = max_error <= tolerance;
+    if (!passed)
+        printf("%-8s %-22s %4d %4d %4d  max error %.3g over %.3g\n", isa, what, m, n, k, max_error, tolerance);
+    return passed ? 0 : 1;
+}
+
+// The three products and the forward and backward epilogues against a
+// double reference, under every instruction set
+static int test_sgemm(const char *dir)
+{
+    static const int shapes[][3] = {
+        {1, 1, 1}, {1, 30, 784}, {3, 5, 7}, {17, 33, 65}, {64, 64, 64}, {100, 37, 300}, {129, 10, 257},
+    };
+    static const activation_t activations[] = {
+        ACTIVATION_SIGMOID, ACTIVATION_RELU, ACTIVATION_LEAKY_RELU, ACTIVATION_TANH, ACTIVATION_LINEAR,
+    };
+    int failed = 0;
+    (void)dir;
+
+    for (size_t s = 0; s < sizeof(isas) / sizeof(isas[0]); s++)
+    {
+        setenv("NN_SIMD", isas[s], 1);
+        simd_init();
+        for (size_t t = 0; t < sizeof(shapes) / sizeof(shapes[0]); t++)
+        {
+            int m = shapes[t][0], n = shapes[t][1], k = shapes[t][2];
+            matrix_t a = init_matrix(m, k), at = init_matrix(k, m);
+            matrix_t b = init_matrix(k, n), bt = init_matrix(n, k);
+            matrix_t out = init_matrix(m, n);
+            float *bias = (float *)allocate_bytes(sizeof(float) * n);
+            float *activated = (float *)allocate_bytes(sizeof(float) * m * n);
+            double *expected = (double *)allocate_bytes(sizeof(double) * m * n);
+            fill_random(a.arr, m * k, -1, 1);
+            fill_random(at.arr, k * m, -1, 1);
+            fill_random(b.arr, k * n, -1, 1);
+            fill_random(bt.arr, n * k, -1, 1);
+            fill_random(bias, n, -1, 1);
+            // Negative activated outputs are only seen by the ReLUs, whose
+            // derivative at them is what is being checked
+            fill_random(activated, m * n, -0.5f, 1);
+
+            // Inputs are in [-1, 1), so the error of a length k dot
+            // product in float is bounded by roughly k * epsilon
+            double tolerance = k * 1.2e-7 * 4;
+
+            multiply_mat_mat(&out, &a, &b);
+            reference_mat_mat(expected, &a, &b, m, n, k, 0, 0);
+            failed += compare("A*B", isas[s], m, n, k, out.arr, expected, tolerance);
+            multiply_mat_matT(&out, &a, &bt);
+            reference_mat_mat(expected, &a, &bt, m, n, k, 0, 1);
+            failed += compare("A*B^T", isas[s], m, n, k, out.arr, expected, tolerance);
+            multiply_matT_mat(&out, &at, &b);
+            reference_mat_mat(expected, &at, &b, m, n, k, 1, 0);
+            failed += compare("A^T*B", isas[s], m, n, k, out.arr, expected, tolerance);
+
+            for (size_t i = 0; i < sizeof(activations) / sizeof(activations[0]); i++)
+            {
+                activation_t activation = activations[i];
+
+                // The forward pass of a layer, out = activation(A * B^T + bias)
+                epilogue_t forward = {activation, SIGMOID_EXACT, bias, NULL};
+                multiply_mat_matT_epilogue(&out, &a, &bt, &forward);
+                reference_mat_mat(expected, &a, &bt, m, n, k, 0, 1);
+                for (int j = 0; j < m * n; j++)
+                    expected[j] = reference_activation(activation, expected[j] + bias[j % n]);
+                failed += compare("forward epilogue", isas[s], m, n, k, out.arr, expected, tolerance + 1e-6);
+
+                // The backward pass, out = (A * B) * activation'(activated)
+                epilogue_t backward = {activation, SIGMOID_EXACT, NULL, activated};
+                multiply_mat_mat_epilogue(&out, &a, &b, &backward);
+                reference_mat_mat(expected, &a, &b, m, n, k, 0, 0);
+                for (int j = 0; j < m * n; j++)
+                    expected[j] *= reference_derivative(activation, activated[j]);
+                failed += compare("backward epilogue", isas[s], m, n, k, out.arr, expected, tolerance + 1e-6);
+            }
+
+            // Softmax normalizes whole rows, after the tiles are done
+            epilogue_t softmax = {ACTIVATION_SOFTMAX, SIGMOID_EXACT, bias, NULL};
+            multiply_mat_matT_epilogue(&out, &a, &bt, &softmax);
+            reference_mat_mat(expected, &a, &bt, m, n, k, 0, 1);
+            for (int i = 0; i < m; i++)
+            {
+                double max = -INFINITY, sum = 0;
+                for (int j = 0; j < n; j++)
+                    max = fmax(max, expected[i * n + j] + bias[j]);
+                for (int j = 0; j < n; j++)
+                    sum += exp(expected[i * n + j] + bias[j] - max);
+                for (int j = 0; j < n; j++)
+                    expected[i * n + j] = exp(expected[i * n + j] + bias[j] - max) / sum;
+            }
+            failed += compare("softmax epilogue", isas[s], m, n, k, out.arr, expected, tolerance + 1e-6);
+
+            free_matrix(&a);
+            free_matrix(&at);
+            free_matrix(&b);
+            free_matrix(&bt);
+            free_matrix(&out);
+            free(bias);
+            free(activated);
+            free(expected);
+        }
+    }
+    unsetenv("NN_SIMD");
+    simd_init();
+    return failed;
+}
+
+// The distance of value from expected in units in the last place of
+// expected rounded to float
+static double ulps(float value, double expected)
+{
+    float rounded = fabsf((float)expected);
+    return fabs(value - expected) / (nextafterf(rounded, INFINITY) - rounded);
+}
+
+// Both sigmoid modes against a double reference, under every instruction
+// set, at the errors nnMath.h documents for them. Every 4099th float
+// pattern is tried, along with the worst cases found by trying them all.
+static int test_sigmoid(const char *dir)
+{
+    // Where the ULP error of each mode peaks, then the relative and the
+    // absolute error of the fast one
+    static const float worst[] = {-0x1.0a2bd8p+4f, -0x1.09292cp+2f, -0x1.5bf5b8p+6f, -0x1.d7f0dap-3f};
+    int n = sizeof(worst) / sizeof(worst[0]);
+    vector_t x = init_vector(n + (int)(((1ull << 32) + 4098) / 4099));
+    vector_t out = init_vector(x.len);
+    int failed = 0;
+    (void)dir;
+
+    memcpy(x.arr, worst, sizeof(worst));
+    for (uint64_t bits = 0; bits < (1ull << 32); bits += 4099)
+    {
+        uint32_t pattern = (uint32_t)bits;
+        float value;
+        memcpy(&value, &pattern, sizeof(value));
+        if (isfinite(value))
+            x.arr[n++] = value;
+    }
+    x.len = out.len = n;
+
+    for (size_t s = 0; s < sizeof(isas) / sizeof(isas[0]); s++)
+    {
+        setenv("NN_SIMD", isas[s], 1);
+        simd_init();
+        for (int fast = 0; fast < 2; fast++)
+        {
+            sigmoid_vec_mode(&out, &x, fast ? SIGMOID_FAST : SIGMOID_EXACT);
+            double max_error = 0, max_relative = 0, max_ulps = 0;
+            for (int i = 0; i < n; i++)
+            {
+                double expected = 1 / (1 + exp(-(double)x.arr[i]));
+                double error = fabs(out.arr[i] - expected);
+                max_error = fmax(max_error, error);
+                if (x.arr[i] >= -87)
+                {
+                    max_relative = fmax(max_relative, error / expected);
+                    max_ulps = fmax(max_ulps, ulps(out.arr[i], expected));
+                }
+            }
+            int passed = fast ? max_error <= 1.9e-5 && max_relative <= 7.9e-5 : max_error <= 9e-8 && max_ulps <= 2.5;
+            if (!passed)
+            {
+                printf("%-8s %s sigmoid: max error %.3g, relative %.3g, %.2f ULP\n", isas[s], fast ? "fast" : "exact",
+                       max_error, max_relative, max_ulps);
+                failed++;
+            }
+        }
+    }
+    unsetenv("NN_SIMD");
+    simd_init();
+    free_vector(&x);
+    free_vector(&out);
+    return failed;
+}
+
+static int same_parameters(neural_net_t *a, neural_net_t *b)
+{
+    if (a->num_layers != b->num_layers)
+        return 0;
+    for (int i = 0; i < a->num_layers; i++)
+    {
+        layer_t *x = &a->layers[i];
+        layer_t *y = &b->layers[i];
+        if (x->length != y->length || (i > 0 && x->activation != y->activation))
+            return 0;
+        if (i == 0)
+            continue;
+        if (memcmp(x->weights.arr, y->weights.arr, sizeof(float) * x->weights.row * x->weights.col) != 0 ||
+            memcmp(x->biases.arr, y->biases.arr, sizeof(float) * x->biases.len) != 0)
+            return 0;
+    }
+    return 1;
+}
+
+// A network saved and loaded again, in floats with a section and in fp16
+static int test_model(const char *dir)
+{
+    int sizes[] = {20, 7, 3};
+    int failed = 0;
+    (void)dir;
+
+    srand(1);
+    neural_net_t net = allocate_neural_net(3, sizes, SIGMOID_EXACT);
+    init_activation(&net, 1, ACTIVATION_RELU);
+    init_activation(&net, 2, ACTIVATION_SOFTMAX);
+
+    const char section[] = "training state";
+    model_section_t sections[] = {{MODEL_SECTION_TRAINING, section, sizeof(section)}};
+    neural_net_t loaded;
+    if (save_model(&net, "test-model.nnm", sections, 1) == -1 || load_model(&loaded, "test-model.nnm", 1) == -1)
+        return 1;
+
+    size_t len;
+    const char *saved = (const char *)model_section(&loaded, MODEL_SECTION_TRAINING, &len);
+    if (!same_parameters(&net, &loaded) || loaded.precision != PRECISION_F32)
+    {
+        printf("float model differs after loading\n");
+        failed++;
+    }
+    if (saved == NULL || len != sizeof(section) || memcmp(saved, section, len) != 0)
+    {
+        printf("section differs after loading\n");
+        failed++;
+    }
+    free_network(&loaded);
+
+    // A flipped bit in the last byte fails verify_model() but not loading,
+    // which leaves the CRC alone
+    FILE *file = fopen("test-model.nnm", "r+b");
+    fseek(file, -1, SEEK_END);
+    int last = fgetc(file);
+    fseek(file, -1, SEEK_END);
+    fputc(last ^ 1, file);
+    fclose(file);
+    if (verify_model("test-model.nnm") != -1 || load_model(&loaded, "test-model.nnm", 0) == -1)
+    {
+        printf("corrupted model isn't caught by verify_model() alone\n");
+        failed++;
+    }
+    else
+        free_network(&loaded);
+
+    // Half models load their half weights as they were saved
+    set_precision(&net, PRECISION_FP16);
+    if (save_model(&net, "test-model.nnm", NULL, 0) == -1 || load_model(&loaded, "test-model.nnm", 1) == -1)
+        return failed + 1;
+    for (int i = 1; i < net.num_layers; i++)
+    {
+        layer_t *layer = &net.layers[i];
+        if (loaded.precision != PRECISION_FP16 ||
+            memcmp(layer->half_weights.arr, loaded.layers[i].half_weights.arr,
+                   sizeof(uint16_t) * layer->weights.row * layer->weights.col) != 0 ||
+            memcmp(layer->biases.arr, loaded.layers[i].biases.arr, sizeof(float) * layer->biases.len) != 0)
+        {
+            printf("fp16 layer %d differs after loading\n", i);
+            failed++;
+        }
+    }
+    free_network(&loaded);
+
+    free_network(&net);
+    remove("test-model.nnm");
+    return failed;
+}
+
+static int check_value(const char *what, float value, float expected)
+{
+    if (value == expected)
+        return 0;
+    printf("%s is %.9g, not %.9g\n", what, value, expected);
+    return 1;
+}
+
+// The checked in legacy models, at weights read from the files by hand
+static int test_pickl(const char *dir)
+{
+    char path[4096];
+    neural_net_t net;
+    int failed = 0;
+
+    snprintf(path, sizeof(path), "%s/784-30-10-testTest.pickl", dir);
+    if (load_network(&net, path) == -1)
+        return 1;
+    failed += check_value("784-30-10 w1[0]", net.layers[1].weights.arr[0], -0.788532972f);
+    failed += check_value("784-30-10 b1[29]", net.layers[1].biases.arr[29], 0.142836675f);
+    failed += check_value("784-30-10 b2[9]", net.layers[2].biases.arr[9], -2.30446029f);
+    free_network(&net);
+
+    // Saved when the network trained in doubles
+    snprintf(path, sizeof(path), "%s/784-128-128-10-testTest.pickl", dir);
+    if (load_network(&net, path) == -1)
+        return failed + 1;
+    failed += check_value("784-128-128-10 w1[0]", net.layers[1].weights.arr[0], (float)0.92782458656264888);
+    failed += check_value("784-128-128-10 b3[9]", net.layers[3].biases.arr[9], (float)-1.4443101114943091);
+    free_network(&net);
+
+    // A file shorter than its name says is refused
+    snprintf(path, sizeof(path), "%s/784-30-10-testTest.pickl", dir);
+    FILE *in = fopen(path, "rb");
+    FILE *out = fopen("784-30-10-short.pickl", "wb");
+    char buffer[1000];
+    if (in == NULL || out == NULL || fread(buffer, 1, sizeof(buffer), in) != sizeof(buffer) ||
+        fwrite(buffer, 1, sizeof(buffer), out) != sizeof(buffer))
+        return failed + 1;
+    fclose(in);
+    fclose(out);
+    if (load_network(&net, "784-30-10-short.pickl") != -1)
+    {
+        printf("a truncated .pickl loaded\n");
+        free_network(&net);
+        failed++;
+    }
+    remove("784-30-10-short.pickl");
+
+    return failed;
+}
+
+// After a first call to warm them up, the single sample passes, a
+// training step and a prediction make no heap allocations
+static int test_allocations(const char *dir)
+{
+    int sizes[] = {20, 16, 3};
+    int batch_size = 8;
+    (void)dir;
+
+    srand(1);
+    neural_net_t net = allocate_neural_net(3, sizes, SIGMOID_EXACT);
+    init_activation(&net, 1, ACTIVATION_RELU);
+    init_activation(&net, 2, ACTIVATION_SOFTMAX);
+    set_loss(&net, LOSS_CROSS_ENTROPY);
+    optimizer_t optimizer;
+    init_optimizer(&optimizer, &net, OPTIMIZER_ADAM);
+    net.optimizer = &optimizer;
+    reserve_workspace(&net, batch_size, 2);
+
+    matrix_t inputs = init_matrix(batch_size, sizes[0]);
+    matrix_t expected = init_matrix(batch_size, sizes[2]);
+    matrix_t outputs = init_matrix(batch_size, sizes[2]);
+    fill_random(inputs.arr, batch_size * sizes[0], 0, 1);
+    for (int i = 0; i < batch_size; i++)
+        expected.arr[i * sizes[2] + i % sizes[2]] = 1;
+    vector_t sample_expected = {expected.arr, sizes[2]};
+
+    model_t model = model_view(&net);
+    exec_context_t context;
+    init_context(&context, &model, batch_size);
+
+    int failed = 0;
+    for (int round = 0; round < 2; round++)
+    {
+        long before = allocation_count();
+        for (int i = 0; i < 4; i++)
+        {
+            memcpy(net.layers[0].activated_outputs.arr, inputs.arr, sizeof(float) * sizes[0]);
+            forward_pass(&net);
+            backward_pass(&net, &sample_expected);
+            train_step(&net, &inputs, &expected, 0.01f);
+            predict_batch(&model, &context, &inputs, &outputs);
+        }
+        // The first round warms up
+        long allocations = allocation_count() - before;
+        if (round > 0 && allocations != 0)
+        {
+            printf("%ld allocations after warming up\n", allocations);
+            failed++;
+        }
+    }
+
+    free_context(&context);
+    close_model(&model);
+    free_matrix(&inputs);
+    free_matrix(&expected);
+    free_matrix(&outputs);
+    net.optimizer = NULL;
+    free_optimizer(&optimizer);
+    free_network(&net);
+    return failed;
+}
+
+typedef struct
+{
+    const char *name;
+    int (*run)(const char *dir);
+} test_t;
+
+static const test_t tests[] = {
+    {"sgemm", test_sgemm},
+    {"sigmoid", test_sigmoid},
+    {"model", test_model},
+    {"pickl", test_pickl},
+    {"allocations", test_allocations},
+};
+
+int main(int argc, char **argv)
+{
+    const char *dir = argc > 2 ? argv[2] : ".";
+    for (size_t i = 0; argc > 1 && i < sizeof(tests) / sizeof(tests[0]); i++)
+    {
+        if (strcmp(argv[1], tests[i].name) != 0)
+            continue;
+        int failed = tests[i].run(dir);
+        printf("%s: %s\n", tests[i].name, failed == 0 ? "ok" : "FAILED");
+        return failed == 0 ? 0 : 1;
+    }
+
+    fprintf(stderr, "usage: %s name [source-dir], name one of", argv[0]);
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+        fprintf(stderr, " %s", tests[i].name);
+    fprintf(stderr, "\n");
+    return 2;
+}